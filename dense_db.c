@@ -26,7 +26,12 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <fcntl.h>
 #include <error.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include "dense_db.h"
+#include "dense_db_bits.h"
 
 #ifndef DEBUG
 #define DEBUG 0
@@ -42,88 +47,149 @@ do { \
 
 #define round_up_to_n(x, n) ((((x) % (n)) == 0) ? (x) : ((x) + (n) - ((x) % (n))))
 
+// Slack after the last row so that 64 bit loads of its trailing fields stay
+// inside the file
+#define TAIL_PAD 8
+
+// New tables pad their header so the data region starts on a cache line,
+// which keeps the columns of PAX blocks 64 bit aligned
+#define DATA_ALIGN 64
+
+// Requests for fewer rows than this are served in the order given, as
+// grouping them costs more than it saves
+#define MULTI_GET_GROUP_MIN 64
+
+// At most 1 << MULTI_GET_BUCKET_BITS buckets when grouping requests
+#define MULTI_GET_BUCKET_BITS 12
+
+// How many rows ahead multi gets prefetch by default
+#define PREFETCH_DISTANCE 16
+
+// The buffer pool dense_db_table_open_pooled makes when none was set
+#define BUFPOOL_BYTES (64 * 1024 * 1024)
+
+// How much of a pooled table a column access copies at once
+#define POOL_WINDOW_BYTES (64 * 1024)
+
+// Writes are tracked per page of the file, one bit each
+#define DIRTY_SHIFT 12
+
+// Version 2 headers start with a magic string, which v1 headers (a 32 bit
+// big endian header size) can't, as theirs are far below 16MB:
+//   magic[8] version:32 flags:32 header_size:64 rows:64 n_fields:32
+//   block_rows:32 then each field's name (NUL terminated) and size:32
+// All numbers are big endian.  The low byte of flags holds the layout,
+// HEADER_COMPACT marks tables rewritten by dense_db_table_compact,
+// HEADER_ZONEMAP those keeping a zone map, HEADER_BITMAPS those with
+// bitmap indexes and HEADER_HASHES those with hash indexes.
+#define HEADER_MAGIC "DENSEDB"
+#define HEADER_VERSION 2
+#define HEADER_ROWS_OFFSET 24
+#define HEADER_LAYOUT_MASK 0xff
+#define HEADER_COMPACT 0x100
+#define HEADER_ZONEMAP 0x200
+#define HEADER_BITMAPS 0x400
+#define HEADER_HASHES 0x800
+
+// Rows per PAX block, smaller tables use the next power of two above their
+// row count (but at least 64, so every column starts on a 64 bit boundary)
+#define PAX_BLOCK_ROWS 4096
+#define PAX_MIN_BLOCK_ROWS 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() do { } while (0)
+#endif
+
 #define ERROR_AT_LINE(fmt, ...) error_at_line(1, errno, __FILE__, __LINE__, fmt , ##__VA_ARGS__)
 
-static uint64_t bit_get(uint64_t * storage, int size, int offset)
+// The generic paths: a field of any width, a 64 bit chunk at a time.  Values
+// go in and out as raw little endian bytes, rounded up to the byte.
+static void bit_read(uint8_t * data, int shift, int size, void * out)
 {
-  uint64_t r = (*storage >> offset) & ((1ull << size) - 1ull);
+  uint8_t * ptr = out;
 
-  DEBUG_LOG("%p: %" PRIu64 " = bit_get(%d, %d)\n", storage, r, size, offset);
+  for (; size > 0; size -= 64, data += 8, ptr += 8) {
+    uint64_t val = htole64(bits_get(data, shift, MIN(size, 64)));
 
-  return r;
+    DEBUG_LOG("%p: %" PRIu64 " = bit_read(%d, %d)\n", data, le64toh(val), MIN(size, 64), shift);
+
+    memcpy(ptr, &val, round_up_to_n(MIN(size, 64), 8) / 8);
+  }
 }
 
-static void bit_set(uint64_t * storage, int size, int offset, uint64_t set)
+static void bit_write(uint8_t * data, int shift, int size, void * in)
 {
-  *storage = (*storage & ~(((1ull << size) - 1ull) << offset)) | (set << offset);
+  uint8_t * ptr = in;
 
-  DEBUG_LOG("%p: bit_set(%d, %d, %" PRIu64 ")\n", storage, size, offset, set);
+  for (; size > 0; size -= 64, data += 8, ptr += 8) {
+    uint64_t val = 0;
+    memcpy(&val, ptr, round_up_to_n(MIN(size, 64), 8) / 8);
+
+    DEBUG_LOG("%p: bit_write(%d, %d, %" PRIu64 ")\n", data, MIN(size, 64), shift, le64toh(val));
+
+    bits_put_atomic(data, shift, MIN(size, 64), le64toh(val));
+  }
 }
 
-static void bit_fiddle(void * buf, int size, int offset, void * param, int is_read)
+static inline uint8_t * table_base(dense_db_table_t * table)
 {
-  uint64_t * data = buf;
-
-  uint64_t * ptr = param;
+  return (uint8_t *)table->data + table->header_size;
+}
 
-  // Move the data pointer up until we're in the right 64 bit word
-  if (offset >= 64) {
-    data += offset / 64;
-    offset = offset % 64;
-  }
+// Only meaningful for DENSE_DB_LAYOUT_ROW
+static inline uint8_t * row_data(dense_db_table_t * table, uint64_t row)
+{
+  return table_base(table) + (row * table->row_size / 8);
+}
 
-  // Loop until we've read or written all we set out to
-  for (; size > 0; size -= 64) {
-    // only work with as many bits as fit in the word
-    int inner_size = MIN(size, 64 - offset);
+static uint32_t get_be32(char ** ptr)
+{
+  uint32_t buf;
 
-    // memcpy has to round up to the nearest byte
-    int inner_size4mem = round_up_to_n(MIN(size, 64), 8) / 8;
+  memcpy(&buf, *ptr, 4);
+  *ptr += 4;
 
-    // This get's interleaved for reads and writes
-    uint64_t val;
+  return be32toh(buf);
+}
 
-    if (is_read) {
-      val = bit_get(data, inner_size, offset);
-    } else {
-      val = 0;
-      memcpy(&val, ptr, inner_size4mem);
+static uint64_t get_be64(char ** ptr)
+{
+  uint64_t buf;
 
-      bit_set(data, inner_size, offset, val);
-    }
+  memcpy(&buf, *ptr, 8);
+  *ptr += 8;
 
-    // We've read or written all we can in one pass
-    data++;
+  return be64toh(buf);
+}
 
-    if (size > 64 && offset) {
-      // If there's something left over
-      
-      if (is_read) {
-	// read the remaining bytes from the next memory location and merge
-	// them with what you got in the last read
-	uint64_t ir = bit_get(data, offset, 0);
+static void put_be32(uint8_t ** ptr, uint32_t val)
+{
+  uint32_t buf = htobe32(val);
 
-	ir <<= (64 - offset);
+  memcpy(*ptr, &buf, 4);
+  *ptr += 4;
+}
 
-	val |= ir;
-      } else {
-	// write the remaining bits into the next memory location
-	val >>= (64 - offset);
+static void put_be64(uint8_t ** ptr, uint64_t val)
+{
+  uint64_t buf = htobe64(val);
 
-	bit_set(data, offset, 0, val);
-      }
-    } else {
-      // The next bit of work to do is right at the byte boundary
-      offset = 0;
-    }
+  memcpy(*ptr, &buf, 8);
+  *ptr += 8;
+}
 
-    if (is_read) {
-      // We've been accumulating in val, now write it out
-      memcpy(ptr, &val, inner_size4mem);
-    }
+// Bytes of data region holding rows rows
+static size_t data_bytes(size_t block_rows, size_t block_bits, size_t rows)
+{
+  return (rows + block_rows - 1) / block_rows * block_bits / 8;
+}
 
-    ptr++;
-  }
+// Bit offset of a field of row in the data region, for either layout
+static inline uint64_t field_bit(dense_db_table_t * table, uint64_t row, uint64_t column, int size)
+{
+  return (row >> table->block_shift) * table->block_bits + column + (row & (table->block_rows - 1)) * size;
 }
 
 dense_db_t * dense_db_new(char * storage_path, int max_fds)
@@ -132,10 +198,16 @@ dense_db_t * dense_db_new(char * storage_path, int max_fds)
 
   db->storage_path = strdup(storage_path);
   db->max_fds = max_fds;
+  db->prefetch_distance = PREFETCH_DISTANCE;
 
   return db;
 }
 
+void dense_db_set_prefetch_distance(dense_db_t * db, size_t rows)
+{
+  db->prefetch_distance = rows;
+}
+
 static off_t get_file_size(int fd)
 {
   struct stat sb;
@@ -143,250 +215,2191 @@ static off_t get_file_size(int fd)
   return sb.st_size;
 }
 
-static void * mmap_table(int fd, size_t size)
+static void * mmap_table(int fd, size_t size, int hints)
 {
-  void * data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  void * data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | (hints & DENSE_DB_HINT_POPULATE ? MAP_POPULATE : 0), fd, 0);
 
   if (data == MAP_FAILED) ERROR_AT_LINE("failed to mmap table");
 
   return data;
 }
 
+// Drop the mapping and fd of an unreferenced table, keeping its schema
+static void table_unmap(dense_db_table_t * table)
+{
+  if (table->pool) {
+    // Written back, but not yet synced
+    if (dense_db_bufpool_forget(table->pool, table->fd)) table->unsynced = 1;
+  } else {
+    if (munmap(table->data, table->size) < 0) ERROR_AT_LINE("Error in munmap");
+
+    table->db->mapped_bytes -= table->size;
+  }
+
+  if (close(table->fd) < 0) ERROR_AT_LINE("Error in close");
+
+  table->data = NULL;
+  table->fd = -1;
+
+  table->db->n_mapped--;
+}
+
+static void sync_table(dense_db_table_t * table);
+
 static void dense_db_table_destroy(dense_db_table_t * table)
 {
+  // A saved zone map is only marked clean once the rows it covers are on
+  // disk too
+  if (table->zones) {
+    if (table->zones->dirty && table->zones->persist) sync_table(table);
+
+    dense_db_zonemap_save(table);
+    dense_db_zonemap_destroy(table->zones);
+  }
+
+  // Likewise for bitmap indexes
+  if (table->bmindex) {
+    if (table->bmindex->dirty && table->bmindex->persist) sync_table(table);
+
+    dense_db_bmindex_save(table);
+    dense_db_bmindex_destroy(table);
+  }
+
+  if (table->hashes) {
+    if (table->hashes->dirty && table->hashes->persist) sync_table(table);
+
+    dense_db_hashindex_save(table);
+    dense_db_hashindex_destroy(table);
+  }
+
   int i;
   for (i = 0; i < table->n_fields; i++) {
     free(table->fields[i].name);
   }
 
+  if (table->fd >= 0) table_unmap(table);
+
   free(table->name);
   free(table->fields);
+  free(table->seqlocks);
+  free(table->dirty);
 
-  if (munmap(table->data, table->size) < 0) ERROR_AT_LINE("Error in munmap");
-
-  if (close(table->fd) < 0) ERROR_AT_LINE("Error in close");
+  pthread_mutex_destroy(&table->sync_lock);
 
   free(table);
 }
 
-void dense_table_sync(dense_db_table_t * table)
+// Make room in the dirty bitmap for size bytes of file
+static void dirty_grow(dense_db_table_t * table, size_t size)
 {
-  if (msync(table->data, table->size, MS_SYNC | MS_INVALIDATE) < 0) ERROR_AT_LINE("Error in sync");
+  size_t words = ((size >> DIRTY_SHIFT) + 64) / 64;
+
+  if (words <= table->dirty_words) return;
+
+  table->dirty = realloc(table->dirty, sizeof(*table->dirty) * words);
+  memset(table->dirty + table->dirty_words, 0, sizeof(*table->dirty) * (words - table->dirty_words));
+
+  table->dirty_words = words;
 }
 
-dense_db_accessor_t dense_db_table_get_accessor(dense_db_table_t * table, char * field)
+// Note a write to bytes [from, to) of the file.  Writers mark after storing,
+// so a sync that clears the bit first still sees their data.
+static inline void mark_dirty(dense_db_table_t * table, size_t from, size_t to)
 {
-  dense_db_accessor_t acc = { 0 };
+  // The buffer pool tracks its own dirty pages
+  if (table->pool) return;
 
-  int i;
-  for (i = 0; i < table->n_fields; i++) {
-    if (strcmp(table->fields[i].name, field) == 0) {
-      acc.size = table->fields[i].size;
-      break;
-    }
+  size_t page;
+  for (page = from >> DIRTY_SHIFT; page <= (to - 1) >> DIRTY_SHIFT; page++) {
+    uint64_t * word = table->dirty + page / 64;
+    uint64_t bit = 1ULL << (page % 64);
 
-    acc.offset += table->fields[i].size;
+    // Pages are usually dirty already, don't bounce their line around
+    if (! (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)) __atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
   }
+}
 
-  return acc;
+static inline void mark_field(dense_db_table_t * table, uint64_t row, uint64_t column, int size)
+{
+  uint64_t bit = field_bit(table, row, column, size);
+
+  mark_dirty(table, table->header_size + bit / 8, table->header_size + (bit + size + 7) / 8);
 }
 
-void dense_db_table_get(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, void * out)
+static inline void mark_column(dense_db_table_t * table, uint64_t column, int size, uint64_t first_row, size_t count)
 {
-  void * data = (table->data + table->header_size + (row * table->row_size / 8));
+  if (table->layout == DENSE_DB_LAYOUT_ROW) {
+    mark_dirty(table, table->header_size + field_bit(table, first_row, column, size) / 8, table->header_size + (field_bit(table, first_row + count - 1, column, size) + size + 7) / 8);
+    return;
+  }
+
+  while (count) {
+    size_t n = MIN(count, table->block_rows - (first_row & (table->block_rows - 1)));
 
-  bit_fiddle(data, acc.size, acc.offset, out, 1);
+    mark_dirty(table, table->header_size + field_bit(table, first_row, column, size) / 8, table->header_size + (field_bit(table, first_row + n - 1, column, size) + size + 7) / 8);
+
+    first_row += n;
+    count -= n;
+  }
 }
 
-uint64_t dense_db_table_get_int(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc)
+static void flush_range(dense_db_table_t * table, size_t first_page, size_t end_page, int wait)
 {
-  uint64_t num = 0;
-  dense_db_table_get(table, row, acc, &num);
+  size_t from = first_page << DIRTY_SHIFT;
+  size_t to = MIN(end_page << DIRTY_SHIFT, table->size);
 
-  return le64toh(num);
+  if (from >= to) return;
+
+  if (wait) {
+    if (msync(table->data + from, to - from, MS_SYNC | MS_INVALIDATE) < 0) ERROR_AT_LINE("Error in sync");
+  } else {
+    if (sync_file_range(table->fd, from, to - from, SYNC_FILE_RANGE_WRITE) < 0) ERROR_AT_LINE("Error in sync_file_range");
+  }
 }
 
-void dense_db_table_set(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, void * in)
+// Write out the runs of dirty pages.  Only waiting syncs clear them, pages
+// an async one started on still need waiting for.
+static void flush_dirty(dense_db_table_t * table, int wait)
 {
-  void * data = (table->data + table->header_size + (row * table->row_size / 8));
+  pthread_mutex_lock(&table->sync_lock);
+
+  if (table->pool) {
+    dense_db_bufpool_flush(table->pool, table->fd);
+
+    if (wait) {
+      if (fdatasync(table->fd) < 0) ERROR_AT_LINE("Error in sync");
+
+      memset(table->dirty, 0, sizeof(*table->dirty) * table->dirty_words);
+      table->unsynced = 0;
+    } else {
+      if (sync_file_range(table->fd, 0, 0, SYNC_FILE_RANGE_WRITE) < 0) ERROR_AT_LINE("Error in sync_file_range");
+    }
+
+    pthread_mutex_unlock(&table->sync_lock);
+    return;
+  }
+
+  // Left over from when the table was last pooled
+  if (wait && table->unsynced) {
+    if (fdatasync(table->fd) < 0) ERROR_AT_LINE("Error in sync");
 
-  bit_fiddle(data, acc.size, acc.offset, in, 0);
+    table->unsynced = 0;
+  }
+
+  size_t run = 0, run_end = 0;
+
+  size_t i;
+  for (i = 0; i < table->dirty_words; i++) {
+    if (! __atomic_load_n(table->dirty + i, __ATOMIC_RELAXED)) continue;
+
+    uint64_t word = wait ? __atomic_exchange_n(table->dirty + i, 0, __ATOMIC_ACQUIRE) : __atomic_load_n(table->dirty + i, __ATOMIC_ACQUIRE);
+
+    while (word) {
+      size_t page = i * 64 + __builtin_ctzll(word);
+      word &= word - 1;
+
+      if (page != run_end) {
+        flush_range(table, run, run_end, wait);
+        run = page;
+      }
+
+      run_end = page + 1;
+    }
+  }
+
+  flush_range(table, run, run_end, wait);
+
+  pthread_mutex_unlock(&table->sync_lock);
 }
 
-void dense_db_table_set_int(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, uint64_t in)
+void dense_table_sync(dense_db_table_t * table)
 {
-  uint64_t num = htole64(in);
+  flush_dirty(table, 1);
+}
 
-  dense_db_table_set(table, row, acc, &num);
+void dense_table_sync_async(dense_db_table_t * table)
+{
+  flush_dirty(table, 0);
 }
 
-dense_db_table_t * dense_db_table_open(dense_db_t * db, char * name)
+// Sync a table whether it's mapped or not
+static void sync_table(dense_db_table_t * table)
 {
-  dense_db_table_t * table = NULL;
+  if (table->fd >= 0) {
+    dense_table_sync(table);
+    return;
+  }
 
-  HASH_FIND(hh, db->lookup, name, strlen(name), table);
+  // An evicted table's writes are still in the page cache, reachable
+  // through any fd of its file
+  size_t i;
+  for (i = 0; i < table->dirty_words && ! table->dirty[i]; i++);
 
-  if (table) {
-    HASH_DEL(db->lookup, table);
-  } else {
-    if (HASH_COUNT(db->lookup) >= db->max_fds) {
-      dense_db_table_t * to_delete, * temp;
+  if (i == table->dirty_words && ! table->unsynced) return;
+
+  char * path;
+  assert(asprintf(&path, "%s/%s", table->db->storage_path, table->name) > 0);
 
-      HASH_ITER(hh, db->lookup, to_delete, temp) {
-	if (! to_delete->refcount) {
-	  HASH_DEL(db->lookup, to_delete);
+  int fd;
+  if ((fd = open(path, O_RDWR)) < 0) ERROR_AT_LINE("Error in open");
+  if (fdatasync(fd) < 0) ERROR_AT_LINE("Error in sync");
+  if (close(fd) < 0) ERROR_AT_LINE("Error in close");
 
-	  dense_db_table_destroy(to_delete);
+  free(path);
 
-	  if (HASH_COUNT(db->lookup) >= db->max_fds) break;
-	}
-      }
+  memset(table->dirty, 0, sizeof(*table->dirty) * table->dirty_words);
+  table->unsynced = 0;
+}
+
+void dense_db_sync(dense_db_t * db)
+{
+  dense_db_table_t * table, * temp;
+
+  HASH_ITER(hh, db->lookup, table, temp) {
+    sync_table(table);
+  }
+}
+
+static void * flusher_main(void * arg)
+{
+  dense_db_table_t * table = arg;
+
+  pthread_mutex_lock(&table->sync_lock);
+
+  while (table->flusher_running) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+
+    until.tv_sec += table->flush_interval_ms / 1000;
+    until.tv_nsec += (table->flush_interval_ms % 1000) * 1000000L;
+
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
     }
 
-    table = calloc(sizeof(*table), 1);
+    pthread_cond_timedwait(&table->flusher_cond, &table->sync_lock, &until);
 
-    table->name = strdup(name);
+    if (! table->flusher_running) break;
 
-    char * path;
-    assert(asprintf(&path, "%s/%s", db->storage_path, name) > 0);
+    pthread_mutex_unlock(&table->sync_lock);
+    flush_dirty(table, 1);
+    pthread_mutex_lock(&table->sync_lock);
+  }
 
-    int fd;
-    if ((fd = open(path, O_RDWR)) < 0) ERROR_AT_LINE("Error in open");
+  pthread_mutex_unlock(&table->sync_lock);
 
-    table->fd = fd;
+  return NULL;
+}
 
-    free(path);
+void dense_db_table_start_flusher(dense_db_table_t * table, int interval_ms)
+{
+  if (table->flusher_running) return;
 
-    table->size = get_file_size(fd);
-    table->data = mmap_table(fd, table->size);
+  // The flusher holds a reference, so the table stays mapped under it
+  table->refcount++;
 
-    char * ptr = table->data;
+  table->flush_interval_ms = interval_ms;
+  table->flusher_running = 1;
 
-    uint32_t buf;
-    memcpy(&buf, ptr, 4);
-    ptr += 4;
+  pthread_cond_init(&table->flusher_cond, NULL);
 
-    table->header_size = be32toh(buf);
+  if ((errno = pthread_create(&table->flusher, NULL, flusher_main, table))) ERROR_AT_LINE("Error in starting the flusher");
+}
 
-    memcpy(&buf, ptr, 4);
-    ptr += 4;
+void dense_db_table_stop_flusher(dense_db_table_t * table)
+{
+  if (! table->flusher_running) return;
 
-    table->n_fields = be32toh(buf);
-    table->fields = calloc(sizeof(dense_db_field_t), table->n_fields);
+  pthread_mutex_lock(&table->sync_lock);
+  table->flusher_running = 0;
+  pthread_cond_signal(&table->flusher_cond);
+  pthread_mutex_unlock(&table->sync_lock);
 
-    memcpy(&buf, ptr, 4);
-    ptr += 4;
+  pthread_join(table->flusher, NULL);
+  pthread_cond_destroy(&table->flusher_cond);
 
-    table->rows = be32toh(buf);
+  dense_db_table_close(table);
+}
 
-    int i;
-    for (i = 0; i < table->n_fields; i++) {
-      table->fields[i].name = strdup(ptr);
+// Each sequence lock counts the writes to its rows that started and those
+// that finished.  Readers know no write overlapped theirs if both counts
+// were equal before they read and begin hadn't moved after.
+static inline dense_db_seqlock_t * seqlock_for(dense_db_table_t * table, uint64_t row)
+{
+  return table->seqlocks + (row >> table->seqlock_shift);
+}
 
-      size_t len = strlen(ptr) + 1;
+static inline void check_writable(dense_db_table_t * table)
+{
+  if (table->compact) error_at_line(1, 0, __FILE__, __LINE__, "Table %s is compacted and read only", table->name);
+}
 
-      ptr += len;
+static inline void write_begin(dense_db_table_t * table, uint64_t row)
+{
+  if (! table->seqlocks) return;
 
-      memcpy(&buf, ptr, 4);
+  __atomic_fetch_add(&seqlock_for(table, row)->begin, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-      ptr += 4;
+static inline void write_end(dense_db_table_t * table, uint64_t row)
+{
+  if (! table->seqlocks) return;
 
-      table->fields[i].size = be32toh(buf);
-      table->row_size += table->fields[i].size;
-    }
+  __atomic_fetch_add(&seqlock_for(table, row)->end, 1, __ATOMIC_RELEASE);
+}
 
-    table->row_size = round_up_to_n(table->row_size, 8);
-    table->db = db;
+void dense_db_table_enable_seqlock(dense_db_table_t * table, int shift)
+{
+  if (table->seqlocks) return;
+
+  table->seqlock_shift = shift;
+  table->seqlocks = calloc(sizeof(*table->seqlocks), (table->capacity >> shift) + 1);
+}
+
+uint64_t dense_db_table_read_begin(dense_db_table_t * table, uint64_t row)
+{
+  if (! table->seqlocks) return 0;
+
+  dense_db_seqlock_t * lock = seqlock_for(table, row);
+
+  for (;;) {
+    uint64_t end = __atomic_load_n(&lock->end, __ATOMIC_ACQUIRE);
+    uint64_t begin = __atomic_load_n(&lock->begin, __ATOMIC_ACQUIRE);
+
+    if (begin == end) return begin;
+
+    // a write is in progress
+    CPU_RELAX();
   }
+}
 
-  HASH_ADD_KEYPTR(hh, db->lookup, table->name, strlen(table->name), table);
+int dense_db_table_read_retry(dense_db_table_t * table, uint64_t row, uint64_t seq)
+{
+  if (! table->seqlocks) return 0;
 
-  table->refcount++;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
 
-  return table;
+  return __atomic_load_n(&seqlock_for(table, row)->begin, __ATOMIC_RELAXED) != seq;
 }
 
-dense_db_table_t * dense_db_table_create(dense_db_t * db, char * name, dense_db_field_t * fields, size_t n_fields, size_t rows)
+dense_db_accessor_t dense_db_table_get_accessor(dense_db_table_t * table, char * field)
 {
-  size_t header_size = 12; // to accomodate for the leader header length, n_fields and rows
-  size_t row_size = 0;
+  dense_db_accessor_t acc = { 0 };
 
   int i;
-  for (i = 0; i < n_fields; i++) {
-    header_size += strlen(fields[i].name) + 1;
-    header_size += 4;  // 32 bit field lengths;
-    row_size += fields[i].size;
+  for (i = 0; i < table->n_fields; i++) {
+    if (strcmp(table->fields[i].name, field) == 0) {
+      acc.size = table->fields[i].size;
+      break;
+    }
+
+    acc.offset += table->fields[i].size;
   }
 
-  row_size = round_up_to_n(row_size, 8);
+  acc.field = i;
 
-  char * fname;
-  assert(asprintf(&fname, "%s/%s", db->storage_path, name) > 0);
+  acc.byte = acc.offset / 8;
+  acc.shift = acc.offset % 8;
+  acc.mask = bits_mask(acc.size);
+  acc.column = acc.offset * table->block_rows;
 
-  int fd;
-  if ((fd = open(fname, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) < 0) ERROR_AT_LINE("Error in creat");
+  if (acc.size <= 64) {
+    acc.kind = acc.shift + acc.size <= 64 ? DENSE_DB_ACC_WORD : DENSE_DB_ACC_STRADDLE;
+  } else {
+    acc.kind = acc.shift == 0 && acc.size % 8 == 0 ? DENSE_DB_ACC_BYTES : DENSE_DB_ACC_GENERIC;
+  }
 
-  free(fname);
+  return acc;
+}
 
-  size_t total_size = round_up_to_n(header_size + rows * row_size / 8, 8);
+// Pooled tables are read and written through a window: a copy of the
+// bytes holding a range of bits, with the same alignment (mod 8) and tail
+// padding they'd have mapped, so the bit kernels work on it unchanged
+typedef struct window {
+  uint64_t start;
+  size_t len;
+  uint64_t * buf;
+  uint64_t small[8];
+} window_t;
+
+// Load the window holding data region bits [from, to), returning where the
+// byte holding from landed
+static uint8_t * window_load(dense_db_table_t * table, window_t * w, uint64_t from, uint64_t to)
+{
+  uint64_t first = table->header_size + from / 8;
+  uint64_t end = table->header_size + (to + 7) / 8 + TAIL_PAD;
 
-  if (ftruncate(fd, total_size) < 0) ERROR_AT_LINE("Error in reserving %zd bytes for the table with fd %d", total_size, fd);
+  w->start = first & ~7ULL;
+  w->len = round_up_to_n(end, 8) - w->start;
+  w->buf = w->len <= sizeof(w->small) ? w->small : malloc(w->len);
 
-  void * data = mmap_table(fd, total_size);
+  dense_db_bufpool_read(table->pool, table->fd, w->start, w->buf, w->len);
 
-  uint8_t * ptr = data;
+  return (uint8_t *)w->buf + (first - w->start);
+}
 
-  // Write the header
-  
-  uint32_t buf;
-  
-  buf = htobe32(header_size);
-  memcpy(ptr, &buf, 4);
-  ptr += 4;
+// Write the window back, leaving out the padding past the end of the file
+static void window_store(dense_db_table_t * table, window_t * w)
+{
+  if (w->start < table->size) dense_db_bufpool_write(table->pool, table->fd, w->start, w->buf, MIN(w->len, table->size - w->start));
+}
 
-  buf = htobe32(n_fields);
-  memcpy(ptr, &buf, 4);
-  ptr += 4;
+static void window_free(window_t * w)
+{
+  if (w->buf != w->small) free(w->buf);
+}
 
-  buf = htobe32(rows);
-  memcpy(ptr, &buf, 4);
-  ptr += 4;
+static void pooled_read(dense_db_table_t * table, uint64_t bit, int size, void * out)
+{
+  window_t w;
+  uint8_t * data = window_load(table, &w, bit, bit + size);
 
-  for (i = 0; i < n_fields; i++) {
-    size_t len = strlen(fields[i].name) + 1;
-    memcpy(ptr, fields[i].name, len);
+  bit_read(data, bit % 8, size, out);
 
-    ptr += len;
+  window_free(&w);
+}
 
-    buf = htobe32(fields[i].size);
-    memcpy(ptr, &buf, 4);
+static uint64_t pooled_get_int(dense_db_table_t * table, uint64_t bit, int size)
+{
+  window_t w;
+  uint8_t * data = window_load(table, &w, bit, bit + size);
 
-    ptr += 4;
-  }
+  uint64_t val = bits_get(data, bit % 8, size);
 
-  if (msync(data, total_size, MS_SYNC | MS_INVALIDATE) < 0) ERROR_AT_LINE("Error in sync");
-  if (munmap(data, total_size) < 0) ERROR_AT_LINE("Error in munmap");
-  if (close(fd) < 0) ERROR_AT_LINE("Error in close");
+  window_free(&w);
 
-  return dense_db_table_open(db, name);
+  return val;
 }
 
-void dense_db_table_close(dense_db_table_t * table)
+// in as for bit_write
+static void pooled_write(dense_db_table_t * table, uint64_t bit, int size, void * in)
 {
-  table->refcount--;
+  window_t w;
+
+  dense_db_bufpool_lock(table->pool);
+
+  uint8_t * data = window_load(table, &w, bit, bit + size);
+
+  bit_write(data, bit % 8, size, in);
+
+  window_store(table, &w);
+
+  dense_db_bufpool_unlock(table->pool);
+
+  window_free(&w);
 }
 
-void dense_db_destroy(dense_db_t * db)
+static void pooled_put_int(dense_db_table_t * table, uint64_t bit, int size, uint64_t in)
 {
-  dense_db_table_t * ele, * temp;
+  window_t w;
 
-  HASH_ITER(hh, db->lookup, ele, temp) {
-    HASH_DEL(db->lookup, ele);
+  dense_db_bufpool_lock(table->pool);
 
-    assert(! ele->refcount);
+  uint8_t * data = window_load(table, &w, bit, bit + size);
 
-    dense_db_table_destroy(ele);
-  }
+  bits_put(data, bit % 8, size, in);
+
+  window_store(table, &w);
+
+  dense_db_bufpool_unlock(table->pool);
+
+  window_free(&w);
+}
+
+// Decode or encode count rows of a field a window at a time
+static void pooled_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, uint64_t * vals, int write)
+{
+  size_t window_rows = MAX(POOL_WINDOW_BYTES * 8 / table->row_size, 1);
+
+  while (count) {
+    size_t n = MIN(count, window_rows);
+
+    // PAX columns are only contiguous within a block
+    if (table->layout == DENSE_DB_LAYOUT_PAX) n = MIN(n, table->block_rows - (first_row & (table->block_rows - 1)));
+
+    uint64_t bit = field_bit(table, first_row, acc.column, acc.size);
+    uint64_t end = field_bit(table, first_row + n - 1, acc.column, acc.size) + acc.size;
+
+    window_t w;
+
+    if (write) dense_db_bufpool_lock(table->pool);
+
+    uint8_t * data = window_load(table, &w, bit, end);
+
+    if (table->layout == DENSE_DB_LAYOUT_ROW) {
+      if (write) {
+        bits_pack_strided(data, table->row_size / 8, acc.shift, acc.size, n, vals);
+      } else {
+        bits_unpack_strided(data, table->row_size / 8, acc.shift, acc.size, n, vals);
+      }
+    } else {
+      if (write) {
+        bits_pack_packed(data, bit % 8, acc.size, n, vals);
+      } else {
+        bits_unpack_packed(data, bit % 8, acc.size, n, vals);
+      }
+    }
+
+    if (write) {
+      window_store(table, &w);
+      dense_db_bufpool_unlock(table->pool);
+    }
+
+    window_free(&w);
+
+    first_row += n;
+    vals += n;
+    count -= n;
+  }
+}
+
+void dense_db_table_get(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, void * out)
+{
+  if (table->compact) {
+    dense_db_compact_get(table, row, acc.field, out);
+    return;
+  }
+
+  if (table->pool) {
+    pooled_read(table, field_bit(table, row, acc.column, acc.size), acc.size, out);
+    return;
+  }
+
+  if (table->layout == DENSE_DB_LAYOUT_PAX) {
+    uint64_t bit = field_bit(table, row, acc.column, acc.size);
+
+    bit_read(table_base(table) + bit / 8, bit % 8, acc.size, out);
+    return;
+  }
+
+  uint8_t * data = row_data(table, row) + acc.byte;
+
+  if (acc.kind == DENSE_DB_ACC_BYTES) {
+    memcpy(out, data, acc.size / 8);
+  } else {
+    bit_read(data, acc.shift, acc.size, out);
+  }
+}
+
+uint64_t dense_db_table_get_int(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc)
+{
+  if (table->compact && acc.size <= 64) return dense_db_compact_get_int(table, row, acc.field);
+
+  if (table->pool && acc.size <= 64) return pooled_get_int(table, field_bit(table, row, acc.column, acc.size), acc.size);
+
+  if (table->layout == DENSE_DB_LAYOUT_ROW) {
+    uint8_t * data = row_data(table, row) + acc.byte;
+
+    switch (acc.kind) {
+      case DENSE_DB_ACC_WORD:
+        return (bits_load(data) >> acc.shift) & acc.mask;
+      case DENSE_DB_ACC_STRADDLE:
+        return bits_get(data, acc.shift, acc.size);
+    }
+  } else if (acc.size <= 64) {
+    uint64_t bit = field_bit(table, row, acc.column, acc.size);
+
+    return bits_get(table_base(table) + bit / 8, bit % 8, acc.size);
+  }
+
+  uint64_t num = 0;
+  dense_db_table_get(table, row, acc, &num);
+
+  return le64toh(num);
+}
+
+void dense_db_table_get_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, uint64_t * out)
+{
+  assert(acc.size <= 64);
+
+  if (table->compact) {
+    dense_db_compact_get_column(table, acc.field, first_row, count, out);
+    return;
+  }
+
+  if (table->pool) {
+    pooled_column(table, acc, first_row, count, out, 0);
+    return;
+  }
+
+  if (table->layout == DENSE_DB_LAYOUT_ROW) {
+    bits_unpack_strided(row_data(table, first_row) + acc.byte, table->row_size / 8, acc.shift, acc.size, count, out);
+    return;
+  }
+
+  // A PAX column is contiguous within a block, so decode a block at a time
+  while (count) {
+    size_t n = MIN(count, table->block_rows - (first_row & (table->block_rows - 1)));
+
+    bits_unpack_packed(table_base(table), field_bit(table, first_row, acc.column, acc.size), acc.size, n, out);
+
+    first_row += n;
+    out += n;
+    count -= n;
+  }
+}
+
+typedef struct multi_get_entry {
+  uint64_t row;
+  size_t idx;
+} multi_get_entry_t;
+
+static inline void prefetch_field(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc)
+{
+  __builtin_prefetch(table_base(table) + field_bit(table, row, acc.column, acc.size) / 8);
+}
+
+void dense_db_table_multi_get(dense_db_table_t * table, dense_db_accessor_t acc, const uint64_t * rows, size_t n, uint64_t * out)
+{
+  assert(acc.size <= 64);
+
+  size_t distance = table->db->prefetch_distance;
+  size_t i;
+
+  // Neither has a field's values where field_bit says
+  if (table->pool || table->compact) {
+    for (i = 0; i < n; i++) {
+      out[i] = dense_db_table_get_int(table, rows[i], acc);
+    }
+
+    return;
+  }
+
+  if (n < MULTI_GET_GROUP_MIN) {
+    for (i = 0; i < n; i++) {
+      if (i + distance < n) prefetch_field(table, rows[i + distance], acc);
+
+      out[i] = dense_db_table_get_int(table, rows[i], acc);
+    }
+
+    return;
+  }
+
+  // Bucket the requests by the high bits of their row ids, which visits
+  // them in roughly address order: requests for the same page and line end
+  // up next to each other, and the walk through the page tables stays
+  // local.  One counting sort pass is cheap next to a full sort.
+  int row_bits = 64 - __builtin_clzll(table->rows | 1);
+  int bucket_bits = MIN(MULTI_GET_BUCKET_BITS, 63 - __builtin_clzll(n));
+  int shift = MAX(row_bits - bucket_bits, 0);
+  size_t n_buckets = (size_t)1 << bucket_bits;
+
+  size_t * starts = calloc(sizeof(*starts), n_buckets + 1);
+  multi_get_entry_t * order = malloc(sizeof(*order) * n);
+
+  for (i = 0; i < n; i++) {
+    starts[MIN(rows[i] >> shift, n_buckets - 1) + 1]++;
+  }
+
+  for (i = 0; i < n_buckets; i++) {
+    starts[i + 1] += starts[i];
+  }
+
+  for (i = 0; i < n; i++) {
+    multi_get_entry_t * entry = order + starts[MIN(rows[i] >> shift, n_buckets - 1)]++;
+
+    entry->row = rows[i];
+    entry->idx = i;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (i + distance < n) prefetch_field(table, order[i + distance].row, acc);
+
+    out[order[i].idx] = dense_db_table_get_int(table, order[i].row, acc);
+  }
+
+  free(starts);
+  free(order);
+}
+
+static void table_put(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, void * in)
+{
+  if (table->pool) {
+    pooled_write(table, field_bit(table, row, acc.column, acc.size), acc.size, in);
+    return;
+  }
+
+  if (table->layout == DENSE_DB_LAYOUT_PAX) {
+    uint64_t bit = field_bit(table, row, acc.column, acc.size);
+
+    bit_write(table_base(table) + bit / 8, bit % 8, acc.size, in);
+    return;
+  }
+
+  uint8_t * data = row_data(table, row) + acc.byte;
+
+  if (acc.kind == DENSE_DB_ACC_BYTES) {
+    memcpy(data, in, acc.size / 8);
+  } else {
+    bit_write(data, acc.shift, acc.size, in);
+  }
+}
+
+static void table_put_int(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, uint64_t in)
+{
+  if (table->pool && acc.size <= 64) {
+    pooled_put_int(table, field_bit(table, row, acc.column, acc.size), acc.size, in);
+    return;
+  }
+
+  if (table->layout == DENSE_DB_LAYOUT_ROW) {
+    uint8_t * data = row_data(table, row) + acc.byte;
+
+    // Unlike reads, writes go through the aligned words the field touches
+    // whatever its kind, swapping them in atomically so writers of other
+    // fields sharing those words don't lose their updates
+    if (acc.size <= 64) {
+      bits_put_atomic(data, acc.shift, acc.size, in);
+      return;
+    }
+  } else if (acc.size <= 64) {
+    uint64_t bit = field_bit(table, row, acc.column, acc.size);
+
+    bits_put_atomic(table_base(table) + bit / 8, bit % 8, acc.size, in);
+    return;
+  }
+
+  uint64_t num = htole64(in);
+
+  table_put(table, row, acc, &num);
+}
+
+static void table_put_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, const uint64_t * in)
+{
+  if (table->pool) {
+    pooled_column(table, acc, first_row, count, (uint64_t *)in, 1);
+    return;
+  }
+
+  if (table->layout == DENSE_DB_LAYOUT_ROW) {
+    bits_pack_strided(row_data(table, first_row) + acc.byte, table->row_size / 8, acc.shift, acc.size, count, in);
+    return;
+  }
+
+  while (count) {
+    size_t n = MIN(count, table->block_rows - (first_row & (table->block_rows - 1)));
+
+    bits_pack_packed(table_base(table), field_bit(table, first_row, acc.column, acc.size), acc.size, n, in);
+
+    first_row += n;
+    in += n;
+    count -= n;
+  }
+}
+
+static inline int field_indexed(dense_db_table_t * table, int field)
+{
+  return dense_db_bmindex_has(table, field) || dense_db_hashindex_has(table, field);
+}
+
+// Lock the indexes of a field about to be written, returning the value it
+// holds, until index_end gets the new one
+static uint64_t index_begin(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t row)
+{
+  uint64_t old = 0;
+
+  if (dense_db_bmindex_has(table, acc.field)) old = dense_db_bmindex_begin(table, acc, row);
+  if (dense_db_hashindex_has(table, acc.field)) old = dense_db_hashindex_begin(table, acc, row);
+
+  return old;
+}
+
+static void index_end(dense_db_table_t * table, int field, uint64_t row, uint64_t old, uint64_t v)
+{
+  if (dense_db_bmindex_has(table, field)) dense_db_bmindex_end(table, field, row, old, v);
+  if (dense_db_hashindex_has(table, field)) dense_db_hashindex_end(table, field, row, old, v);
+}
+
+void dense_db_table_set(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, void * in)
+{
+  check_writable(table);
+  dense_db_zonemap_begin(table);
+
+  int indexed = field_indexed(table, acc.field);
+  uint64_t old = indexed ? index_begin(table, acc, row) : 0;
+
+  uint64_t num = 0;
+
+  if ((table->zones || indexed) && acc.size <= 64) {
+    memcpy(&num, in, (acc.size + 7) / 8);
+    num = le64toh(num) & acc.mask;
+
+    // Widened before the value lands, so no filter skips a zone holding it
+    if (table->zones) dense_db_zonemap_set(table, acc.field, row, num);
+  }
+
+  write_begin(table, row);
+  table_put(table, row, acc, in);
+  mark_field(table, row, acc.column, acc.size);
+  write_end(table, row);
+
+  if (indexed && acc.size <= 64) index_end(table, acc.field, row, old, num);
+}
+
+void dense_db_table_set_int(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, uint64_t in)
+{
+  check_writable(table);
+  dense_db_zonemap_begin(table);
+
+  int indexed = field_indexed(table, acc.field);
+  uint64_t old = indexed ? index_begin(table, acc, row) : 0;
+
+  if (acc.size <= 64) dense_db_zonemap_set(table, acc.field, row, in & acc.mask);
+
+  write_begin(table, row);
+  table_put_int(table, row, acc, in);
+  mark_field(table, row, acc.column, acc.size);
+  write_end(table, row);
+
+  if (indexed) index_end(table, acc.field, row, old, in & acc.mask);
+}
+
+static void table_set_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, const uint64_t * in)
+{
+  if (! table->seqlocks) {
+    table_put_column(table, acc, first_row, count, in);
+    mark_column(table, acc.column, acc.size, first_row, count);
+    return;
+  }
+
+  // Take the rows covered by one sequence lock at a time
+  while (count) {
+    size_t n = MIN(count, (((first_row >> table->seqlock_shift) + 1) << table->seqlock_shift) - first_row);
+
+    write_begin(table, first_row);
+    table_put_column(table, acc, first_row, n, in);
+    mark_column(table, acc.column, acc.size, first_row, n);
+    write_end(table, first_row);
+
+    first_row += n;
+    in += n;
+    count -= n;
+  }
+}
+
+void dense_db_table_set_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, const uint64_t * in)
+{
+  assert(acc.size <= 64);
+
+  check_writable(table);
+
+  if (! count) return;
+
+  dense_db_zonemap_begin(table);
+  dense_db_zonemap_set_column(table, acc.field, first_row, count, in, acc.mask);
+
+  if (! field_indexed(table, acc.field)) {
+    table_set_column(table, acc, first_row, count, in);
+    return;
+  }
+
+  int bitmaps = dense_db_bmindex_has(table, acc.field), hashes = dense_db_hashindex_has(table, acc.field);
+  uint64_t * old = malloc(sizeof(*old) * count);
+
+  if (bitmaps) dense_db_bmindex_begin_column(table, acc, first_row, count, old);
+  if (hashes) dense_db_hashindex_begin_column(table, acc, first_row, count, old);
+
+  table_set_column(table, acc, first_row, count, in);
+
+  if (bitmaps) dense_db_bmindex_end_column(table, acc.field, first_row, count, old, in);
+  if (hashes) dense_db_hashindex_end_column(table, acc.field, first_row, count, old, in);
+
+  free(old);
+}
+
+static int codec_step_cmp(const void * a, const void * b)
+{
+  const dense_db_codec_step_t * x = a, * y = b;
+
+  if (x->byte != y->byte) return x->byte < y->byte ? -1 : 1;
+
+  return x->shift - y->shift;
+}
+
+dense_db_row_codec_t * dense_db_row_codec_new(dense_db_table_t * table, dense_db_accessor_t * accs, size_t n_accs)
+{
+  dense_db_row_codec_t * codec = calloc(sizeof(*codec), 1);
+
+  if (! accs) n_accs = table->n_fields;
+
+  codec->n_steps = n_accs;
+  codec->steps = calloc(sizeof(*codec->steps), n_accs);
+  codec->slots = calloc(sizeof(*codec->slots), n_accs);
+
+  int offset = 0;
+
+  int i;
+  for (i = 0; i < n_accs; i++) {
+    dense_db_accessor_t acc;
+
+    if (accs) {
+      acc = accs[i];
+    } else {
+      acc.offset = offset;
+      acc.size = table->fields[i].size;
+      acc.column = offset * table->block_rows;
+      acc.field = i;
+      offset += acc.size;
+    }
+
+    codec->slots[i] = codec->n_words;
+
+    codec->steps[i].byte = acc.offset / 8;
+    codec->steps[i].shift = acc.offset % 8;
+    codec->steps[i].size = acc.size;
+    codec->steps[i].column = acc.column;
+    codec->steps[i].field = acc.field;
+    codec->steps[i].slot = codec->n_words;
+
+    codec->n_words += (acc.size + 63) / 64;
+  }
+
+  qsort(codec->steps, codec->n_steps, sizeof(*codec->steps), codec_step_cmp);
+
+  return codec;
+}
+
+void dense_db_row_codec_destroy(dense_db_row_codec_t * codec)
+{
+  free(codec->steps);
+  free(codec->slots);
+  free(codec);
+}
+
+// Where a codec step's field starts for row, in either layout
+static inline uint8_t * step_data(dense_db_table_t * table, dense_db_codec_step_t * step, uint8_t * row_ptr, uint64_t row, int * shift)
+{
+  if (table->layout == DENSE_DB_LAYOUT_ROW) {
+    *shift = step->shift;
+    return row_ptr + step->byte;
+  }
+
+  uint64_t bit = field_bit(table, row, step->column, step->size);
+
+  *shift = bit % 8;
+  return table_base(table) + bit / 8;
+}
+
+static void pooled_get_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, uint64_t * out)
+{
+  int i;
+  for (i = 0; i < codec->n_steps; i++) {
+    dense_db_codec_step_t * step = codec->steps + i;
+
+    uint64_t bit = field_bit(table, row, step->column, step->size);
+
+    int k;
+    for (k = 0; k * 64 < step->size; k++) {
+      uint64_t val = pooled_get_int(table, bit + k * 64, MIN(step->size - k * 64, 64));
+
+      out[step->slot + k] = step->size <= 64 ? val : htole64(val);
+    }
+  }
+}
+
+static void pooled_set_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, const uint64_t * in)
+{
+  dense_db_bufpool_lock(table->pool);
+
+  int i;
+  for (i = 0; i < codec->n_steps; i++) {
+    dense_db_codec_step_t * step = codec->steps + i;
+
+    uint64_t bit = field_bit(table, row, step->column, step->size);
+
+    int k;
+    for (k = 0; k * 64 < step->size; k++) {
+      uint64_t val = step->size <= 64 ? in[step->slot] : le64toh(in[step->slot + k]);
+
+      pooled_put_int(table, bit + k * 64, MIN(step->size - k * 64, 64), val);
+    }
+  }
+
+  dense_db_bufpool_unlock(table->pool);
+}
+
+static void compact_get_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, uint64_t * out)
+{
+  int i;
+  for (i = 0; i < codec->n_steps; i++) {
+    dense_db_codec_step_t * step = codec->steps + i;
+
+    if (step->size <= 64) {
+      out[step->slot] = dense_db_compact_get_int(table, row, step->field);
+    } else {
+      // Whole words, as the other layouts fill them
+      memset(out + step->slot, 0, (step->size + 63) / 64 * 8);
+
+      dense_db_compact_get(table, row, step->field, out + step->slot);
+    }
+  }
+}
+
+static void table_get_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, uint64_t * out)
+{
+  if (table->compact) {
+    compact_get_row(table, codec, row, out);
+    return;
+  }
+
+  if (table->pool) {
+    pooled_get_row(table, codec, row, out);
+    return;
+  }
+
+  uint8_t * row_ptr = row_data(table, row);
+
+  int i;
+  for (i = 0; i < codec->n_steps; i++) {
+    dense_db_codec_step_t * step = codec->steps + i;
+
+    int shift;
+    uint8_t * data = step_data(table, step, row_ptr, row, &shift);
+
+    if (step->size <= 64) {
+      out[step->slot] = bits_get(data, shift, step->size);
+    } else {
+      // wide fields come out a word at a time, as raw bytes
+      int k;
+      for (k = 0; k * 64 < step->size; k++) {
+        out[step->slot + k] = htole64(bits_get(data + k * 8, shift, MIN(step->size - k * 64, 64)));
+      }
+    }
+  }
+}
+
+void dense_db_table_get_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, uint64_t * out)
+{
+  if (! table->seqlocks) {
+    table_get_row(table, codec, row, out);
+    return;
+  }
+
+  uint64_t seq;
+
+  do {
+    seq = dense_db_table_read_begin(table, row);
+    table_get_row(table, codec, row, out);
+  } while (dense_db_table_read_retry(table, row, seq));
+}
+
+static void zonemap_set_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, const uint64_t * in)
+{
+  if (! table->zones) return;
+
+  int i;
+  for (i = 0; i < codec->n_steps; i++) {
+    dense_db_codec_step_t * step = codec->steps + i;
+
+    if (step->size <= 64) dense_db_zonemap_set(table, step->field, row, in[step->slot] & bits_mask(step->size));
+  }
+}
+
+// Read the old values of the row's indexed fields, holding the indexes
+// (whose locks nest) until index_end_row.  Bitmap indexes lock each field,
+// so those are taken first and in field order, then the hash indexes.
+static void index_begin_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, uint64_t * old)
+{
+  int f, i;
+  for (f = 0; f < table->n_fields; f++) {
+    if (! dense_db_bmindex_has(table, f)) continue;
+
+    dense_db_accessor_t acc = dense_db_table_get_accessor(table, table->fields[f].name);
+
+    for (i = 0; i < codec->n_steps; i++) {
+      if (codec->steps[i].field == f) old[i] = dense_db_bmindex_begin(table, acc, row);
+    }
+  }
+
+  for (i = 0; i < codec->n_steps; i++) {
+    dense_db_codec_step_t * step = codec->steps + i;
+
+    if (dense_db_hashindex_has(table, step->field)) {
+      dense_db_accessor_t acc = dense_db_table_get_accessor(table, table->fields[step->field].name);
+
+      old[i] = dense_db_hashindex_begin(table, acc, row);
+    }
+  }
+}
+
+static void index_end_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, const uint64_t * old, const uint64_t * in)
+{
+  int i;
+  for (i = 0; i < codec->n_steps; i++) {
+    dense_db_codec_step_t * step = codec->steps + i;
+
+    if (field_indexed(table, step->field)) index_end(table, step->field, row, old[i], in[step->slot] & bits_mask(step->size));
+  }
+}
+
+void dense_db_table_set_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, const uint64_t * in)
+{
+  check_writable(table);
+  dense_db_zonemap_begin(table);
+
+  uint64_t old[codec->n_steps];
+
+  int indexed = table->bmindex || table->hashes;
+
+  if (indexed) index_begin_row(table, codec, row, old);
+
+  // Zones first, so they never miss a value a reader can already see
+  zonemap_set_row(table, codec, row, in);
+
+  if (table->pool) {
+    write_begin(table, row);
+    pooled_set_row(table, codec, row, in);
+    write_end(table, row);
+
+    if (indexed) index_end_row(table, codec, row, old, in);
+    return;
+  }
+
+  uint8_t * row_ptr = row_data(table, row);
+
+  write_begin(table, row);
+
+  int i;
+  for (i = 0; i < codec->n_steps; i++) {
+    dense_db_codec_step_t * step = codec->steps + i;
+
+    int shift;
+    uint8_t * data = step_data(table, step, row_ptr, row, &shift);
+
+    if (step->size <= 64) {
+      bits_put_atomic(data, shift, step->size, in[step->slot]);
+    } else {
+      int k;
+      for (k = 0; k * 64 < step->size; k++) {
+        bits_put_atomic(data + k * 8, shift, MIN(step->size - k * 64, 64), le64toh(in[step->slot + k]));
+      }
+    }
+
+    if (table->layout == DENSE_DB_LAYOUT_PAX) mark_field(table, row, step->column, step->size);
+  }
+
+  if (table->layout == DENSE_DB_LAYOUT_ROW) mark_dirty(table, row_ptr - (uint8_t *)table->data, row_ptr - (uint8_t *)table->data + table->row_size / 8);
+
+  write_end(table, row);
+
+  if (indexed) index_end_row(table, codec, row, old, in);
+}
+
+static void lru_unlink(dense_db_t * db, dense_db_table_t * table)
+{
+  if (table->lru_prev) {
+    table->lru_prev->lru_next = table->lru_next;
+  } else {
+    db->lru_head = table->lru_next;
+  }
+
+  if (table->lru_next) {
+    table->lru_next->lru_prev = table->lru_prev;
+  } else {
+    db->lru_tail = table->lru_prev;
+  }
+
+  table->lru_prev = table->lru_next = NULL;
+}
+
+// Unmap idle tables, least recently closed first, until n_new more
+// mappings of size bytes fit in the db's limits
+static void make_room(dense_db_t * db, int n_new, size_t size)
+{
+  while (db->lru_head && (db->n_mapped + n_new > db->max_fds || (db->max_mapped && db->mapped_bytes + size > db->max_mapped))) {
+    dense_db_table_t * table = db->lru_head;
+
+    lru_unlink(db, table);
+    table_unmap(table);
+  }
+}
+
+// Pass hints for bytes [from, to) of the mapping on to the kernel.  Failures
+// are ignored, as the hints are only advice.
+static void advise_bytes(dense_db_table_t * table, size_t from, size_t to, int hints)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  if (! table->data) return;
+
+  from -= from % page;
+  to = MIN(to, table->size);
+
+  if (from >= to) return;
+
+  char * addr = table->data + from;
+  size_t len = to - from;
+
+  if (hints & DENSE_DB_HINT_NORMAL) madvise(addr, len, MADV_NORMAL);
+  if (hints & DENSE_DB_HINT_SEQUENTIAL) madvise(addr, len, MADV_SEQUENTIAL);
+  if (hints & DENSE_DB_HINT_RANDOM) madvise(addr, len, MADV_RANDOM);
+  if (hints & DENSE_DB_HINT_HUGEPAGES) madvise(addr, len, MADV_HUGEPAGE);
+  if (hints & DENSE_DB_HINT_WILLNEED) madvise(addr, len, MADV_WILLNEED);
+
+  if (hints & DENSE_DB_HINT_POPULATE) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(addr, len, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    madvise(addr, len, MADV_WILLNEED);
+  }
+}
+
+void dense_db_table_advise(dense_db_table_t * table, uint64_t first_row, size_t count, int hints)
+{
+  if (! count) return;
+
+  // Compacted blocks vary in size, so the range can't be found cheaply
+  if (table->compact) {
+    advise_bytes(table, 0, table->size, hints);
+    return;
+  }
+
+  uint64_t first_block = first_row >> table->block_shift;
+  uint64_t end_block = ((first_row + count - 1) >> table->block_shift) + 1;
+
+  advise_bytes(table, table->header_size + first_block * table->block_bits / 8, table->header_size + (end_block * table->block_bits + 7) / 8, hints);
+}
+
+static void table_map(dense_db_t * db, dense_db_table_t * table)
+{
+  char * path;
+  assert(asprintf(&path, "%s/%s", db->storage_path, table->name) > 0);
+
+  int fd;
+  if ((fd = open(path, O_RDWR)) < 0) ERROR_AT_LINE("Error in open");
+
+  free(path);
+
+  size_t size = get_file_size(fd);
+
+  // Pooled tables take an fd but no address space
+  make_room(db, 1, table->pool ? 0 : size);
+
+  table->fd = fd;
+  table->size = size;
+
+  dirty_grow(table, size);
+
+  db->n_mapped++;
+
+  if (table->pool) return;
+
+  table->data = mmap_table(fd, size, table->hints);
+
+  advise_bytes(table, 0, size, table->hints & ~DENSE_DB_HINT_POPULATE);
+
+  db->mapped_bytes += size;
+}
+
+static void lru_append(dense_db_t * db, dense_db_table_t * table)
+{
+  table->lru_prev = db->lru_tail;
+  table->lru_next = NULL;
+
+  if (db->lru_tail) {
+    db->lru_tail->lru_next = table;
+  } else {
+    db->lru_head = table;
+  }
+
+  db->lru_tail = table;
+}
+
+void dense_db_set_map_budget(dense_db_t * db, size_t bytes)
+{
+  db->max_mapped = bytes;
+
+  make_room(db, 0, 0);
+}
+
+static void pread_all(int fd, void * buf, size_t len, uint64_t offset)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = pread(fd, (char *)buf + done, len - done, offset + done);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+
+      ERROR_AT_LINE("Error in read");
+    }
+
+    if (n == 0) break;
+
+    done += n;
+  }
+
+  memset((char *)buf + done, 0, len - done);
+}
+
+// A pooled table's header, read straight from the file
+static char * read_header(dense_db_table_t * table)
+{
+  char peek[24];
+  char * ptr = peek;
+
+  pread_all(table->fd, peek, sizeof(peek), 0);
+
+  size_t header_size;
+
+  if (memcmp(peek, HEADER_MAGIC, sizeof(HEADER_MAGIC)) == 0) {
+    ptr += 16;
+    header_size = get_be64(&ptr);
+  } else {
+    header_size = get_be32(&ptr);
+  }
+
+  header_size = MIN(header_size, table->size);
+
+  char * header = malloc(header_size);
+
+  pread_all(table->fd, header, header_size, 0);
+
+  return header;
+}
+
+// Open a table, through pool if given and mapped if not.  A table already
+// in the cache keeps how it was opened, unless pooled storage is asked for
+// and nobody holds it.
+static void pooled_resize(dense_db_table_t * table, size_t end, size_t size);
+static void mapped_resize(dense_db_table_t * table, size_t end, size_t size);
+
+static dense_db_table_t * table_open(dense_db_t * db, char * name, int hints, dense_db_bufpool_t * pool)
+{
+  dense_db_table_t * table = NULL;
+
+  HASH_FIND(hh, db->lookup, name, strlen(name), table);
+
+  // Switch the table between storages, except that a plain open of a pooled
+  // table in use shares it as it is
+  if (table && table->pool != pool && (pool || ! table->refcount)) {
+    if (table->compact) error_at_line(1, 0, __FILE__, __LINE__, "Compacted table %s can't be opened pooled", name);
+
+    if (table->refcount) error_at_line(1, 0, __FILE__, __LINE__, "Can't switch table %s to pooled storage while it's open", name);
+
+    if (table->fd >= 0) {
+      lru_unlink(db, table);
+      table_unmap(table);
+    }
+
+    table->pool = pool;
+  }
+
+  if (table) {
+    // An evicted table keeps its schema, so only the mapping comes back
+    if (table->fd >= 0) {
+      if (! table->refcount) lru_unlink(db, table);
+
+      if (hints & ~table->hints) advise_bytes(table, 0, table->size, hints & ~table->hints);
+
+      table->hints |= hints;
+    } else {
+      table->hints |= hints;
+
+      table_map(db, table);
+    }
+  } else {
+    int flags = 0;
+
+    table = calloc(sizeof(*table), 1);
+
+    table->name = strdup(name);
+    table->db = db;
+    table->hints = hints;
+    table->pool = pool;
+
+    pthread_mutex_init(&table->sync_lock, NULL);
+
+    table_map(db, table);
+
+    char * header = table->pool ? read_header(table) : table->data;
+    char * ptr = header;
+
+    if (memcmp(ptr, HEADER_MAGIC, sizeof(HEADER_MAGIC)) == 0) {
+      ptr += sizeof(HEADER_MAGIC);
+
+      table->version = get_be32(&ptr);
+
+      if (table->version != HEADER_VERSION) error_at_line(1, 0, __FILE__, __LINE__, "Table %s has unknown header version %d", name, table->version);
+
+      flags = get_be32(&ptr);
+
+      table->layout = flags & HEADER_LAYOUT_MASK;
+      table->compact = (flags & HEADER_COMPACT) != 0;
+      table->header_size = get_be64(&ptr);
+      table->rows = get_be64(&ptr);
+      table->n_fields = get_be32(&ptr);
+      table->block_rows = get_be32(&ptr);
+    } else {
+      table->version = 1;
+      table->header_size = get_be32(&ptr);
+      table->n_fields = get_be32(&ptr);
+      table->rows = get_be32(&ptr);
+    }
+
+    table->fields = calloc(sizeof(dense_db_field_t), table->n_fields);
+
+    int i;
+    for (i = 0; i < table->n_fields; i++) {
+      table->fields[i].name = strdup(ptr);
+
+      size_t len = strlen(ptr) + 1;
+
+      ptr += len;
+
+      table->fields[i].size = get_be32(&ptr);
+      table->row_size += table->fields[i].size;
+    }
+
+    if (table->version == 1) {
+      // The oldest tables end their header here, later v1 ones go on with
+      // the layout
+      table->layout = DENSE_DB_LAYOUT_ROW;
+      table->block_rows = 1;
+
+      if (ptr + 8 <= header + table->header_size) {
+        table->layout = get_be32(&ptr);
+        table->block_rows = get_be32(&ptr);
+      }
+    }
+
+    table->block_shift = __builtin_ctzll(table->block_rows);
+    table->block_bits = table->layout == DENSE_DB_LAYOUT_PAX ? table->block_rows * table->row_size : round_up_to_n(table->row_size, 8);
+
+    table->row_size = round_up_to_n(table->row_size, 8);
+
+    // Files from before the tail padding end right after their last row,
+    // where the 64 bit loads of its trailing fields would run off the
+    // mapping, so they get it now
+    size_t padded = round_up_to_n(table->header_size + data_bytes(table->block_rows, table->block_bits, table->rows) + TAIL_PAD, 8);
+
+    if (! table->compact && table->size < padded) {
+      if (table->pool) {
+        pooled_resize(table, table->size, padded);
+      } else {
+        mapped_resize(table, table->size, padded);
+        header = table->data;
+      }
+    }
+
+    // Appends leave room for more rows than the header's count
+    table->capacity = (table->size - MIN(table->size, table->header_size + TAIL_PAD)) * 8 / table->block_bits * table->block_rows;
+    table->capacity = MAX(table->capacity, table->rows);
+
+    if (table->compact) table->capacity = table->rows;
+
+    if (table->pool) free(header);
+
+    if (table->compact && table->pool) error_at_line(1, 0, __FILE__, __LINE__, "Compacted table %s can't be opened pooled", name);
+
+    HASH_ADD_KEYPTR(hh, db->lookup, table->name, strlen(table->name), table);
+
+    if (flags & HEADER_ZONEMAP) table->zones = dense_db_zonemap_new(table);
+    if (flags & HEADER_BITMAPS) dense_db_bmindex_load(table);
+    if (flags & HEADER_HASHES) dense_db_hashindex_load(table);
+  }
+
+  table->refcount++;
+
+  return table;
+}
+
+dense_db_table_t * dense_db_table_open(dense_db_t * db, char * name)
+{
+  return table_open(db, name, 0, NULL);
+}
+
+dense_db_table_t * dense_db_table_open_hinted(dense_db_t * db, char * name, int hints)
+{
+  return table_open(db, name, hints, NULL);
+}
+
+dense_db_table_t * dense_db_table_open_pooled(dense_db_t * db, char * name)
+{
+  if (! db->pool) db->pool = dense_db_bufpool_new(BUFPOOL_BYTES);
+
+  return table_open(db, name, 0, db->pool);
+}
+
+void dense_db_set_buffer_pool(dense_db_t * db, size_t bytes)
+{
+  dense_db_table_t * table, * temp;
+  dense_db_bufpool_t * old = db->pool;
+
+  if (old) {
+    HASH_ITER(hh, db->lookup, table, temp) {
+      if (table->pool && table->refcount) error_at_line(1, 0, __FILE__, __LINE__, "Can't replace the buffer pool while table %s uses it", table->name);
+    }
+  }
+
+  db->pool = dense_db_bufpool_new(bytes);
+
+  if (! old) return;
+
+  // Cached tables write their pages back and take the new pool with them
+  HASH_ITER(hh, db->lookup, table, temp) {
+    if (table->pool != old) continue;
+
+    if (table->fd >= 0) {
+      lru_unlink(db, table);
+      table_unmap(table);
+    }
+
+    table->pool = db->pool;
+  }
+
+  dense_db_bufpool_destroy(old);
+}
+
+static size_t header_bytes(dense_db_field_t * fields, size_t n_fields)
+{
+  // magic, version, flags, header length, rows, n_fields and rows per block
+  size_t header_size = sizeof(HEADER_MAGIC) + 4 + 4 + 8 + 8 + 4 + 4;
+
+  int i;
+  for (i = 0; i < n_fields; i++) {
+    header_size += strlen(fields[i].name) + 1;
+    header_size += 4;  // 32 bit field lengths;
+  }
+
+  return round_up_to_n(header_size, DATA_ALIGN);
+}
+
+static void put_header(uint8_t * ptr, int flags, size_t header_size, size_t rows, dense_db_field_t * fields, size_t n_fields, size_t block_rows)
+{
+  memcpy(ptr, HEADER_MAGIC, sizeof(HEADER_MAGIC));
+  ptr += sizeof(HEADER_MAGIC);
+
+  put_be32(&ptr, HEADER_VERSION);
+  put_be32(&ptr, flags);
+  put_be64(&ptr, header_size);
+  put_be64(&ptr, rows);
+  put_be32(&ptr, n_fields);
+  put_be32(&ptr, block_rows);
+
+  int i;
+  for (i = 0; i < n_fields; i++) {
+    size_t len = strlen(fields[i].name) + 1;
+    memcpy(ptr, fields[i].name, len);
+
+    ptr += len;
+
+    put_be32(&ptr, fields[i].size);
+  }
+}
+
+// Drop what's known of an old table before name is replaced by a new one
+// with the given fields
+static void forget_table(dense_db_t * db, char * name, dense_db_field_t * fields, size_t n_fields)
+{
+  dense_db_table_t * cached = NULL;
+
+  HASH_FIND(hh, db->lookup, name, strlen(name), cached);
+
+  // Whatever was cached under this name describes the old file
+  if (cached) {
+    if (cached->refcount) error_at_line(1, 0, __FILE__, __LINE__, "Can't create table %s while it's open", name);
+
+    if (cached->fd >= 0) lru_unlink(db, cached);
+    HASH_DEL(db->lookup, cached);
+
+    dense_db_table_destroy(cached);
+  }
+
+  // Nor do a zone map or indexes saved with the old table.  Only hash
+  // indexes named after the new table's fields could ever be loaded.
+  int i;
+  for (i = 0; i < n_fields; i++) {
+    char * hash;
+    assert(asprintf(&hash, "%s/.%s.%s.hash", db->storage_path, name, fields[i].name) > 0);
+
+    if (unlink(hash) < 0 && errno != ENOENT) ERROR_AT_LINE("Error in unlink");
+
+    free(hash);
+  }
+
+  char * zones, * bitmaps;
+  assert(asprintf(&zones, "%s/.%s.zones", db->storage_path, name) > 0);
+  assert(asprintf(&bitmaps, "%s/.%s.bitmaps", db->storage_path, name) > 0);
+
+  if (unlink(zones) < 0 && errno != ENOENT) ERROR_AT_LINE("Error in unlink");
+  if (unlink(bitmaps) < 0 && errno != ENOENT) ERROR_AT_LINE("Error in unlink");
+
+  free(zones);
+  free(bitmaps);
+}
+
+dense_db_table_t * dense_db_table_create(dense_db_t * db, char * name, dense_db_field_t * fields, size_t n_fields, size_t rows, int layout)
+{
+  size_t header_size = header_bytes(fields, n_fields);
+  size_t row_size = 0;
+
+  int i;
+  for (i = 0; i < n_fields; i++) {
+    row_size += fields[i].size;
+  }
+
+  size_t block_rows = 1;
+  size_t block_bits = round_up_to_n(row_size, 8);
+
+  if (layout == DENSE_DB_LAYOUT_PAX) {
+    block_rows = PAX_BLOCK_ROWS;
+    while (block_rows > PAX_MIN_BLOCK_ROWS && block_rows / 2 >= rows) block_rows /= 2;
+
+    block_bits = block_rows * row_size;
+  }
+
+  size_t data_size = data_bytes(block_rows, block_bits, rows);
+
+  forget_table(db, name, fields, n_fields);
+
+  char * fname;
+  assert(asprintf(&fname, "%s/%s", db->storage_path, name) > 0);
+
+  int fd;
+  if ((fd = open(fname, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) < 0) ERROR_AT_LINE("Error in creat");
+
+  free(fname);
+
+  size_t total_size = round_up_to_n(header_size + data_size + TAIL_PAD, 8);
+
+  if (ftruncate(fd, total_size) < 0) ERROR_AT_LINE("Error in reserving %zd bytes for the table with fd %d", total_size, fd);
+
+  void * data = mmap_table(fd, total_size, 0);
+
+  put_header(data, layout & HEADER_LAYOUT_MASK, header_size, rows, fields, n_fields, block_rows);
+
+  if (msync(data, total_size, MS_SYNC | MS_INVALIDATE) < 0) ERROR_AT_LINE("Error in sync");
+  if (munmap(data, total_size) < 0) ERROR_AT_LINE("Error in munmap");
+  if (close(fd) < 0) ERROR_AT_LINE("Error in close");
+
+  return dense_db_table_open(db, name);
+}
+
+dense_db_table_t * dense_db_table_load(dense_db_t * db, char * name, dense_db_field_t * fields, size_t n_fields, int layout, int n_threads, dense_db_load_read_t read, void * arg)
+{
+  // The rows are written in page aligned pieces, so the data starts on a
+  // page too.  With the row count unknown up front, PAX tables get full
+  // size blocks.
+  dense_db_table_t shape = { 0 };
+
+  shape.db = db;
+  shape.name = name;
+  shape.fields = fields;
+  shape.n_fields = n_fields;
+  shape.layout = layout & HEADER_LAYOUT_MASK;
+  shape.header_size = round_up_to_n(header_bytes(fields, n_fields), DENSE_DB_LOAD_ALIGN);
+
+  int i;
+  for (i = 0; i < n_fields; i++) {
+    shape.row_size += fields[i].size;
+  }
+
+  shape.block_rows = shape.layout == DENSE_DB_LAYOUT_PAX ? PAX_BLOCK_ROWS : 1;
+  shape.block_shift = __builtin_ctzll(shape.block_rows);
+  shape.block_bits = shape.layout == DENSE_DB_LAYOUT_PAX ? shape.block_rows * shape.row_size : round_up_to_n(shape.row_size, 8);
+  shape.row_size = round_up_to_n(shape.row_size, 8);
+
+  char * path, * tmp;
+  assert(asprintf(&path, "%s/%s", db->storage_path, name) > 0);
+  assert(asprintf(&tmp, "%s/.%s.load.XXXXXX", db->storage_path, name) > 0);
+
+  int fd = mkstemp(tmp);
+  if (fd < 0) ERROR_AT_LINE("Error in loading table %s", name);
+
+  shape.rows = dense_db_loader_write(&shape, tmp, n_threads, read, arg);
+
+  uint8_t * header = calloc(shape.header_size, 1);
+
+  put_header(header, shape.layout, shape.header_size, shape.rows, fields, n_fields, shape.block_rows);
+
+  if (pwrite(fd, header, shape.header_size, 0) != shape.header_size) ERROR_AT_LINE("Error in writing the header of %s", name);
+
+  free(header);
+
+  size_t total_size = round_up_to_n(shape.header_size + data_bytes(shape.block_rows, shape.block_bits, shape.rows) + TAIL_PAD, 8);
+
+  if (ftruncate(fd, total_size) < 0) ERROR_AT_LINE("Error in sizing loaded table %s", name);
+  if (fdatasync(fd) < 0) ERROR_AT_LINE("Error in fdatasync");
+  if (close(fd) < 0) ERROR_AT_LINE("Error in close");
+
+  forget_table(db, name, fields, n_fields);
+
+  if (rename(tmp, path) < 0) ERROR_AT_LINE("Error in replacing table %s", name);
+
+  free(tmp);
+  free(path);
+
+  return dense_db_table_open(db, name);
+}
+
+// Zero bits [from, to) of the data region
+static void clear_bits(uint8_t * base, uint64_t from, uint64_t to)
+{
+  while (from < to && from % 8) {
+    base[from / 8] &= ~(1u << (from % 8));
+    from++;
+  }
+
+  if (to - from >= 8) {
+    memset(base + from / 8, 0, (to - from) / 8);
+    from += (to - from) / 8 * 8;
+  }
+
+  while (from < to) {
+    base[from / 8] &= ~(1u << (from % 8));
+    from++;
+  }
+}
+
+static void clear_table_bits(dense_db_table_t * table, uint64_t from, uint64_t to)
+{
+  if (! table->pool) {
+    clear_bits(table_base(table), from, to);
+    return;
+  }
+
+  window_t w;
+
+  dense_db_bufpool_lock(table->pool);
+
+  uint8_t * data = window_load(table, &w, from, to);
+
+  clear_bits(data, from % 8, from % 8 + (to - from));
+  window_store(table, &w);
+
+  dense_db_bufpool_unlock(table->pool);
+
+  window_free(&w);
+}
+
+static void write_rows(dense_db_table_t * table)
+{
+  uint8_t buf[8];
+  uint8_t * ptr = buf;
+  size_t offset = HEADER_ROWS_OFFSET;
+
+  if (table->version >= 2) {
+    put_be64(&ptr, table->rows);
+  } else if (table->rows <= UINT32_MAX) {
+    offset = 8;
+    put_be32(&ptr, table->rows);
+  } else {
+    error_at_line(1, 0, __FILE__, __LINE__, "Table %s has a v1 header, which can't hold %zd rows", table->name, table->rows);
+  }
+
+  if (table->pool) {
+    dense_db_bufpool_write(table->pool, table->fd, offset, buf, ptr - buf);
+  } else {
+    memcpy(table->data + offset, buf, ptr - buf);
+    mark_dirty(table, offset, offset + (ptr - buf));
+  }
+}
+
+static int header_flags(dense_db_table_t * table)
+{
+  return table->layout | (table->compact ? HEADER_COMPACT : 0) | (table->zones ? HEADER_ZONEMAP : 0) | (table->bmindex ? HEADER_BITMAPS : 0) | (table->hashes ? HEADER_HASHES : 0);
+}
+
+// Record the table's flags in its header, so every later open keeps its
+// zone map and indexes up to date
+static void write_flags(dense_db_table_t * table)
+{
+  if (table->version < 2 || table->snapshot) return;
+
+  uint8_t buf[4];
+  uint8_t * ptr = buf;
+  size_t offset = sizeof(HEADER_MAGIC) + 4;
+
+  put_be32(&ptr, header_flags(table));
+
+  if (table->pool) {
+    dense_db_bufpool_write(table->pool, table->fd, offset, buf, sizeof(buf));
+  } else {
+    memcpy(table->data + offset, buf, sizeof(buf));
+    mark_dirty(table, offset, offset + sizeof(buf));
+  }
+}
+
+void dense_db_table_enable_zonemap(dense_db_table_t * table)
+{
+  if (table->zones) return;
+
+  table->zones = dense_db_zonemap_new(table);
+
+  write_flags(table);
+}
+
+void dense_db_table_create_bitmap_index(dense_db_table_t * table, char * field)
+{
+  dense_db_accessor_t acc = dense_db_table_get_accessor(table, field);
+
+  if (acc.field == table->n_fields) error_at_line(1, 0, __FILE__, __LINE__, "No field %s in table %s", field, table->name);
+  if (acc.size > DENSE_DB_BMINDEX_MAX_BITS) error_at_line(1, 0, __FILE__, __LINE__, "Field %s of table %s is too wide for a bitmap index", field, table->name);
+
+  // The saved indexes list the field before the header points at them
+  dense_db_bmindex_add(table, acc.field);
+
+  write_flags(table);
+}
+
+void dense_db_table_create_hash_index(dense_db_table_t * table, char * field)
+{
+  dense_db_accessor_t acc = dense_db_table_get_accessor(table, field);
+
+  if (acc.field == table->n_fields) error_at_line(1, 0, __FILE__, __LINE__, "No field %s in table %s", field, table->name);
+  if (acc.size > 64) error_at_line(1, 0, __FILE__, __LINE__, "Field %s of table %s is too wide for a hash index", field, table->name);
+
+  // The index's file is there, marked dirty, before the header points at it
+  dense_db_hashindex_add(table, acc.field);
+
+  write_flags(table);
+}
+
+// Bring a pooled table's file to size bytes, with end the end of its data
+static void pooled_resize(dense_db_table_t * table, size_t end, size_t size)
+{
+  // Cached pages past the new end of the file would come back on write
+  dense_db_bufpool_forget(table->pool, table->fd);
+
+  if (ftruncate(table->fd, MIN(size, end)) < 0) ERROR_AT_LINE("Error in resizing table %s to %zd bytes", table->name, size);
+  if (ftruncate(table->fd, size) < 0) ERROR_AT_LINE("Error in resizing table %s to %zd bytes", table->name, size);
+
+  table->size = size;
+
+  dirty_grow(table, size);
+}
+
+static void mapped_resize(dense_db_table_t * table, size_t end, size_t size)
+{
+  // The padding kept past the data when shrinking holds dropped rows
+  if (size < table->size) memset(table->data + end, 0, size - end);
+
+  if (ftruncate(table->fd, size) < 0) ERROR_AT_LINE("Error in resizing table %s to %zd bytes", table->name, size);
+
+  void * data = mremap(table->data, table->size, size, MREMAP_MAYMOVE);
+
+  // Range hints split the mapping into pieces mremap won't take together
+  if (data == MAP_FAILED && errno == EFAULT) {
+    data = mmap_table(table->fd, size, 0);
+
+    if (munmap(table->data, table->size) < 0) ERROR_AT_LINE("Error in munmap");
+  }
+
+  if (data == MAP_FAILED) ERROR_AT_LINE("Error in mremap");
+
+  table->db->mapped_bytes += size - table->size;
+
+  table->data = data;
+  table->size = size;
+
+  advise_bytes(table, 0, size, table->hints);
+
+  dirty_grow(table, size);
+}
+
+// Change the file and mapping to hold capacity rows
+static void remap_table(dense_db_table_t * table, size_t capacity)
+{
+  size_t end = table->header_size + data_bytes(table->block_rows, table->block_bits, capacity);
+  size_t size = round_up_to_n(end + TAIL_PAD, 8);
+
+  // Keep the flusher off the mapping while it moves
+  pthread_mutex_lock(&table->sync_lock);
+
+  if (table->pool) {
+    pooled_resize(table, end, size);
+  } else {
+    mapped_resize(table, end, size);
+  }
+
+  pthread_mutex_unlock(&table->sync_lock);
+
+  if (table->seqlocks) {
+    size_t old_locks = (table->capacity >> table->seqlock_shift) + 1;
+    size_t locks = (capacity >> table->seqlock_shift) + 1;
+
+    table->seqlocks = realloc(table->seqlocks, sizeof(*table->seqlocks) * MAX(locks, old_locks));
+
+    if (locks > old_locks) memset(table->seqlocks + old_locks, 0, sizeof(*table->seqlocks) * (locks - old_locks));
+  }
+
+  table->capacity = capacity;
+}
+
+void dense_db_table_resize(dense_db_table_t * table, size_t rows)
+{
+  size_t old_rows = table->rows;
+
+  check_writable(table);
+  dense_db_zonemap_begin(table);
+
+  if (rows > table->capacity) {
+    remap_table(table, rows);
+  } else if (rows < table->rows) {
+    // Rows past the new end that stay in the file have to read back as
+    // zeroes if the table grows again
+    size_t i;
+
+    if (table->layout == DENSE_DB_LAYOUT_ROW) {
+      uint64_t from = rows * table->row_size, to = table->rows * table->row_size;
+
+      // Pooled files are truncated past the new end, which leaves only the
+      // byte the old rows share with the new last one
+      if (table->pool) to = MIN(to, round_up_to_n(from, 8));
+
+      clear_table_bits(table, from, to);
+    } else if (rows & (table->block_rows - 1)) {
+      uint64_t column = 0;
+
+      for (i = 0; i < table->n_fields; i++) {
+        uint64_t block = field_bit(table, rows & ~(table->block_rows - 1), column, table->fields[i].size);
+
+        clear_table_bits(table, field_bit(table, rows, column, table->fields[i].size), block + table->block_rows * table->fields[i].size);
+
+        column += table->block_rows * table->fields[i].size;
+      }
+    }
+
+    remap_table(table, rows);
+
+    mark_dirty(table, table->header_size + (rows >> table->block_shift) * table->block_bits / 8, table->size);
+  }
+
+  table->rows = rows;
+  write_rows(table);
+
+  dense_db_zonemap_resize(table, old_rows, rows);
+  dense_db_bmindex_resize(table, old_rows, rows);
+  dense_db_hashindex_resize(table, old_rows, rows);
+}
+
+uint64_t dense_db_table_append_rows(dense_db_table_t * table, size_t n)
+{
+  check_writable(table);
+  dense_db_zonemap_begin(table);
+
+  uint64_t first = table->rows;
+
+  // Grow geometrically so a run of appends costs few remaps
+  if (first + n > table->capacity) remap_table(table, MAX(first + n, table->capacity * 2));
+
+  table->rows = first + n;
+  write_rows(table);
+
+  dense_db_zonemap_resize(table, first, first + n);
+  dense_db_bmindex_resize(table, first, first + n);
+  dense_db_hashindex_resize(table, first, first + n);
+
+  return first;
+}
+
+// Fill fd with the table's current contents, sharing its extents where the
+// filesystem can reflink, copying from the mapping (or the file, for pooled
+// tables) where it can't
+static void copy_table(dense_db_table_t * table, int fd)
+{
+  // Pooled writes have to reach the file before it's cloned or read
+  if (table->pool) dense_db_bufpool_flush(table->pool, table->fd);
+
+  if (ioctl(fd, FICLONE, table->fd) == 0) return;
+
+  char * buf = table->pool ? malloc(1 << 24) : NULL;
+
+  size_t done = 0;
+  while (done < table->size) {
+    size_t len = MIN(table->size - done, 1 << 24);
+    char * src = table->data + done;
+
+    if (buf) {
+      pread_all(table->fd, buf, len, done);
+      src = buf;
+    }
+
+    ssize_t n = pwrite(fd, src, len, done);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+
+      ERROR_AT_LINE("Error in copying table %s", table->name);
+    }
+
+    done += n;
+  }
+
+  free(buf);
+}
+
+dense_db_table_t * dense_db_table_snapshot(dense_db_table_t * table)
+{
+  // An unnamed file in the db's directory, so a reflink stays on the same
+  // filesystem and the copy goes away with its last fd
+  int fd = open(table->db->storage_path, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+
+  if (fd < 0) {
+    char * path;
+    assert(asprintf(&path, "%s/.%s.snapshot.XXXXXX", table->db->storage_path, table->name) > 0);
+
+    if ((fd = mkstemp(path)) < 0) ERROR_AT_LINE("Error in creating a snapshot of %s", table->name);
+    if (unlink(path) < 0) ERROR_AT_LINE("Error in unlink");
+
+    free(path);
+  }
+
+  copy_table(table, fd);
+
+  // Only the shape of the table carries over, everything it owns (locks,
+  // dirty pages, indexes, its place in the db's cache) stays behind
+  dense_db_table_t * snap = calloc(sizeof(*snap), 1);
+
+  snap->db = table->db;
+  snap->name = strdup(table->name);
+  snap->size = table->size;
+  snap->rows = table->rows;
+  snap->capacity = table->capacity;
+  snap->n_fields = table->n_fields;
+  snap->version = table->version;
+  snap->header_size = table->header_size;
+  snap->row_size = table->row_size;
+  snap->layout = table->layout;
+  snap->block_rows = table->block_rows;
+  snap->block_shift = table->block_shift;
+  snap->block_bits = table->block_bits;
+  snap->compact = table->compact;
+  snap->hints = table->hints;
+
+  snap->fields = calloc(sizeof(dense_db_field_t), table->n_fields);
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    snap->fields[i].name = strdup(table->fields[i].name);
+    snap->fields[i].size = table->fields[i].size;
+  }
+
+  pthread_mutex_init(&snap->sync_lock, NULL);
+
+  snap->fd = fd;
+  snap->data = mmap(NULL, table->size, PROT_READ, MAP_SHARED, fd, 0);
+
+  if (snap->data == MAP_FAILED) ERROR_AT_LINE("failed to mmap snapshot");
+
+  snap->snapshot = 1;
+  snap->refcount = 1;
+
+  return snap;
+}
+
+void dense_db_table_compact(dense_db_table_t * table)
+{
+  dense_db_t * db = table->db;
+
+  if (table->compact) return;
+
+  if (table->snapshot) error_at_line(1, 0, __FILE__, __LINE__, "Can't compact a snapshot of table %s", table->name);
+  if (table->refcount > 1) error_at_line(1, 0, __FILE__, __LINE__, "Can't compact table %s while others hold it", table->name);
+
+  char * path, * tmp;
+  assert(asprintf(&path, "%s/%s", db->storage_path, table->name) > 0);
+  assert(asprintf(&tmp, "%s/.%s.compact.XXXXXX", db->storage_path, table->name) > 0);
+
+  int fd = mkstemp(tmp);
+  if (fd < 0) ERROR_AT_LINE("Error in compacting table %s", table->name);
+
+  size_t header_size = header_bytes(table->fields, table->n_fields);
+  uint8_t * header = calloc(header_size, 1);
+
+  put_header(header, (header_flags(table) & ~HEADER_LAYOUT_MASK) | DENSE_DB_LAYOUT_PAX | HEADER_COMPACT, header_size, table->rows, table->fields, table->n_fields, COMPACT_BLOCK_ROWS);
+
+  if (pwrite(fd, header, header_size, 0) != header_size) ERROR_AT_LINE("Error in writing the header of %s", table->name);
+
+  free(header);
+
+  size_t end = dense_db_compact_write(table, fd, header_size);
+
+  if (ftruncate(fd, round_up_to_n(end + TAIL_PAD, 8)) < 0) ERROR_AT_LINE("Error in sizing compacted table %s", table->name);
+  if (fdatasync(fd) < 0) ERROR_AT_LINE("Error in fdatasync");
+  if (close(fd) < 0) ERROR_AT_LINE("Error in close");
+
+  // Readers of the old file keep it until it's unmapped
+  if (rename(tmp, path) < 0) ERROR_AT_LINE("Error in replacing table %s", table->name);
+
+  free(tmp);
+  free(path);
+
+  table_unmap(table);
+
+  // Nothing of the old file is left to sync
+  memset(table->dirty, 0, sizeof(*table->dirty) * table->dirty_words);
+  table->unsynced = 0;
+
+  table->pool = NULL;
+  table->compact = 1;
+  table->version = HEADER_VERSION;
+  table->layout = DENSE_DB_LAYOUT_PAX;
+  table->header_size = header_size;
+  table->block_rows = COMPACT_BLOCK_ROWS;
+  table->block_shift = __builtin_ctzll(COMPACT_BLOCK_ROWS);
+  table->block_bits = COMPACT_BLOCK_ROWS * table->row_size;
+  table->capacity = table->rows;
+
+  table_map(db, table);
+}
+
+static void snapshot_destroy(dense_db_table_t * snap)
+{
+  int i;
+  for (i = 0; i < snap->n_fields; i++) {
+    free(snap->fields[i].name);
+  }
+
+  if (snap->zones) dense_db_zonemap_destroy(snap->zones);
+
+  if (munmap(snap->data, snap->size) < 0) ERROR_AT_LINE("Error in munmap");
+  if (close(snap->fd) < 0) ERROR_AT_LINE("Error in close");
+
+  pthread_mutex_destroy(&snap->sync_lock);
+
+  free(snap->name);
+  free(snap->fields);
+  free(snap);
+}
+
+void dense_db_table_close(dense_db_table_t * table)
+{
+  table->refcount--;
+
+  if (table->snapshot) {
+    if (! table->refcount) snapshot_destroy(table);
+    return;
+  }
+
+  if (! table->refcount) {
+    lru_append(table->db, table);
+
+    make_room(table->db, 0, 0);
+  }
+}
+
+void dense_db_destroy(dense_db_t * db)
+{
+  dense_db_table_t * ele, * temp;
+
+  dense_db_wal_close(db);
+
+  HASH_ITER(hh, db->lookup, ele, temp) {
+    HASH_DEL(db->lookup, ele);
+
+    assert(! ele->refcount);
+
+    if (ele->fd >= 0) lru_unlink(db, ele);
+
+    dense_db_table_destroy(ele);
+  }
+
+  if (db->pool) dense_db_bufpool_destroy(db->pool);
 
   free(db->storage_path);
   free(db);
@@ -10,8 +10,12 @@ Redistribution and use in source and binary forms, with or without modification,
 THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifndef DENSE_DB_H
+#define DENSE_DB_H
+
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 #include "uthash.h"
 
 struct dense_db_table;
@@ -19,9 +23,30 @@ struct dense_db_table;
 typedef struct dense_db {
   char * storage_path;
 
+  // Limits on mapped tables (and so open fds) and the bytes they map, 0
+  // for no byte limit.  Tables in use are never unmapped, so these can be
+  // exceeded while they're held.
   int max_fds;
+  size_t max_mapped;
+
+  int n_mapped;
+  size_t mapped_bytes;
 
+  // Every table opened so far, with its schema
   struct dense_db_table * lookup;
+
+  // Mapped tables nobody holds, unmapped from the head to stay in the limits
+  struct dense_db_table * lru_head;
+  struct dense_db_table * lru_tail;
+
+  // How many rows ahead dense_db_table_multi_get prefetches
+  size_t prefetch_distance;
+
+  // Set by dense_db_enable_wal
+  struct dense_db_wal * wal;
+
+  // Caches the pages of tables opened with dense_db_table_open_pooled
+  struct dense_db_bufpool * pool;
 } dense_db_t;
 
 typedef struct dense_db_field {
@@ -30,46 +55,288 @@ typedef struct dense_db_field {
   size_t size;
 } dense_db_field_t;
 
+// How rows are laid out in the data region of a table
+enum {
+  // Each row's fields next to each other, one row after the other
+  DENSE_DB_LAYOUT_ROW,
+
+  // Rows grouped in blocks, with each field's values for the block stored
+  // back to back (PAX).  Scans of narrow fields only touch their own bits.
+  DENSE_DB_LAYOUT_PAX,
+};
+
+// Access pattern hints, for dense_db_table_open_hinted (whole table, kept
+// across remaps) and dense_db_table_advise (a range of rows).  They're only
+// advice: whatever the kernel or filesystem doesn't support is ignored.
+enum {
+  DENSE_DB_HINT_NORMAL     = 1 << 0, // undo SEQUENTIAL and RANDOM
+  DENSE_DB_HINT_SEQUENTIAL = 1 << 1, // scans, read ahead aggressively
+  DENSE_DB_HINT_RANDOM     = 1 << 2, // point lookups, don't read ahead
+  DENSE_DB_HINT_WILLNEED   = 1 << 3, // start reading it in now
+  DENSE_DB_HINT_POPULATE   = 1 << 4, // fault it all in before returning
+  DENSE_DB_HINT_HUGEPAGES  = 1 << 5, // back it with huge pages if possible
+};
+
+// How dense_db_table_get_accessor decided a field is best reached
+enum {
+  DENSE_DB_ACC_WORD,      // up to 64 bits, inside one unaligned 64 bit load
+  DENSE_DB_ACC_STRADDLE,  // up to 64 bits, spilling into a ninth byte
+  DENSE_DB_ACC_BYTES,     // wider, but starting and ending on a byte
+  DENSE_DB_ACC_GENERIC,   // anything else
+};
+
 typedef struct dense_db_accessor {
   int offset;
   int size;
+
+  // Precomputed from offset and size so accesses don't have to
+  int kind;
+  int byte;
+  int shift;
+  uint64_t mask;
+
+  // Bit offset of the field's values within a block (see dense_db_table_t)
+  uint64_t column;
+
+  // Index of the field in the table
+  int field;
 } dense_db_accessor_t;
 
+// One field of a row codec, kept in row order so a row is decoded in a
+// single forward sweep
+typedef struct dense_db_codec_step {
+  size_t byte;
+  int shift;
+  int size;
+  uint64_t column;
+  int field;
+
+  size_t slot;
+} dense_db_codec_step_t;
+
+// A precompiled set of accessors for reading and writing whole rows.  Each
+// accessor gets (size + 63) / 64 words of the caller's buffer starting at
+// slots[i]: fields of up to 64 bits as integers, wider ones as raw bytes as
+// they'd come out of dense_db_table_get.  A codec only works with the table
+// it was built for.
+typedef struct dense_db_row_codec {
+  dense_db_codec_step_t * steps;
+  size_t n_steps;
+
+  size_t * slots;
+  size_t n_words;
+} dense_db_row_codec_t;
+
+typedef struct dense_db_seqlock {
+  uint64_t begin;
+  uint64_t end;
+} dense_db_seqlock_t;
+
 typedef struct dense_db_table {
   dense_db_t * db;
 
   char * name;
 
+  // -1 and NULL while unmapped, see dense_db_t
   int fd;
   char * data;
 
   size_t size;
 
   size_t rows;
+  size_t capacity;
 
   dense_db_field_t * fields;
   size_t n_fields;
 
+  // On disk header format, 1 for tables from before 64 bit row counts
+  int version;
   size_t header_size;
   size_t row_size;
 
+  // Row layout is the degenerate case of a single row per block, so the bit
+  // offset of any field is always:
+  //   (row / block_rows) * block_bits + column + (row % block_rows) * size
+  int layout;
+  size_t block_rows;
+  int block_shift;
+  size_t block_bits;
+
+  // Optional, one per 1 << seqlock_shift rows
+  dense_db_seqlock_t * seqlocks;
+  int seqlock_shift;
+
+  // One bit per 4k page of the file written since the last sync
+  uint64_t * dirty;
+  size_t dirty_words;
+
+  // Set when unmapping a pooled table wrote pages back that no sync has
+  // waited for yet
+  int unsynced;
+
+  // Serializes syncs, and keeps the flusher out while the mapping moves
+  pthread_mutex_t sync_lock;
+
+  pthread_t flusher;
+  pthread_cond_t flusher_cond;
+  int flusher_running;
+  int flush_interval_ms;
+
   int refcount;
 
+  // Made by dense_db_table_snapshot, outside the db's cache
+  int snapshot;
+
+  // Rewritten by dense_db_table_compact, read only (see dense_db_compact.h)
+  int compact;
+
+  // Set by dense_db_table_enable_zonemap, see dense_db_zonemap.h
+  struct dense_db_zonemap * zones;
+
+  // Set by dense_db_table_create_bitmap_index, see dense_db_bmindex.h
+  struct dense_db_bmindex * bmindex;
+
+  // Set by dense_db_table_create_hash_index, see dense_db_hashindex.h
+  struct dense_db_hashindex * hashes;
+
+  // DENSE_DB_HINT_* given when opening, applied to every mapping
+  int hints;
+
+  // Set for tables read and written through the db's buffer pool instead
+  // of a mapping, which leaves data NULL
+  struct dense_db_bufpool * pool;
+
+  struct dense_db_table * lru_prev;
+  struct dense_db_table * lru_next;
+
   UT_hash_handle hh;
 } dense_db_table_t;
 
 dense_db_t * dense_db_new(char * storage_path, int max_fds);
+void dense_db_set_map_budget(dense_db_t * db, size_t bytes);
+void dense_db_set_prefetch_distance(dense_db_t * db, size_t rows);
+
+// Size the buffer pool pooled tables share (64MB unless set).  No pooled
+// table may be open, cached ones are written back and move to the new pool.
+void dense_db_set_buffer_pool(dense_db_t * db, size_t bytes);
+
+// Write back the pages changed through the setters since the last sync,
+// waiting for them.  The async variant only starts writing them.
 void dense_table_sync(dense_db_table_t * table);
+void dense_table_sync_async(dense_db_table_t * table);
+
+// Sync every table the db has written to, mapped or not
+void dense_db_sync(dense_db_t * db);
+
+// Sync the table every interval_ms from a background thread.  The flusher
+// holds a reference to the table until it's stopped.
+void dense_db_table_start_flusher(dense_db_table_t * table, int interval_ms);
+void dense_db_table_stop_flusher(dense_db_table_t * table);
 
 dense_db_accessor_t dense_db_table_get_accessor(dense_db_table_t * table, char * field);
 void dense_db_table_get(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, void * out);
 uint64_t dense_db_table_get_int(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc);
 
+// Decode one field (of at most 64 bits) of each of n rows, in any order and
+// possibly repeated, into out in the same order.  Larger requests are
+// visited in roughly address order, prefetching ahead.
+void dense_db_table_multi_get(dense_db_table_t * table, dense_db_accessor_t acc, const uint64_t * rows, size_t n, uint64_t * out);
+
+// Decode count consecutive rows of one field (of at most 64 bits) into out
+void dense_db_table_get_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, uint64_t * out);
+
+// The single row setters (these two and dense_db_table_set_row) may be called
+// concurrently for different fields, even ones sharing a 64 bit word
 void dense_db_table_set(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, void * in);
 void dense_db_table_set_int(dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, uint64_t in);
 
-dense_db_table_t * dense_db_table_create(dense_db_t * db, char * name, dense_db_field_t * fields, size_t n_fields, size_t rows);
+// Store count consecutive rows of one field (of at most 64 bits) from in.
+// Not atomic: nobody else may write to those rows meanwhile (see
+// dense_db_table_scan for splitting a table between writers).
+void dense_db_table_set_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, const uint64_t * in);
+
+// Give every 1 << shift rows a sequence lock, bumped by all the setters.
+// Readers can then get a consistent view of several fields of a row without
+// blocking writers:
+//
+//   do {
+//     seq = dense_db_table_read_begin(table, row);
+//     ... dense_db_table_get* calls for row ...
+//   } while (dense_db_table_read_retry(table, row, seq));
+//
+// dense_db_table_get_row does this by itself.  Enable it before the table
+// is shared between threads.
+void dense_db_table_enable_seqlock(dense_db_table_t * table, int shift);
+uint64_t dense_db_table_read_begin(dense_db_table_t * table, uint64_t row);
+int dense_db_table_read_retry(dense_db_table_t * table, uint64_t row, uint64_t seq);
+
+// accs may be NULL to select every field of the table in order
+dense_db_row_codec_t * dense_db_row_codec_new(dense_db_table_t * table, dense_db_accessor_t * accs, size_t n_accs);
+void dense_db_row_codec_destroy(dense_db_row_codec_t * codec);
+
+void dense_db_table_get_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, uint64_t * out);
+void dense_db_table_set_row(dense_db_table_t * table, dense_db_row_codec_t * codec, uint64_t row, const uint64_t * in);
+
+dense_db_table_t * dense_db_table_create(dense_db_t * db, char * name, dense_db_field_t * fields, size_t n_fields, size_t rows, int layout);
+
+// Fill rows with up to max_rows rows, each laid out like a row codec over
+// every field of the table, returning how many it filled and 0 at the end
+typedef size_t (* dense_db_load_read_t)(void * arg, uint64_t * rows, size_t max_rows);
+
+// Create a table from every row read, packing them in n_threads threads
+// and writing them straight to the file (see dense_db_loader.h) instead of
+// through a mapping.  read is called from those threads, one at a time.
+// The new table replaces any old one under its name once it's complete.
+dense_db_table_t * dense_db_table_load(dense_db_t * db, char * name, dense_db_field_t * fields, size_t n_fields, int layout, int n_threads, dense_db_load_read_t read, void * arg);
 dense_db_table_t * dense_db_table_open(dense_db_t * db, char * name);
+dense_db_table_t * dense_db_table_open_hinted(dense_db_t * db, char * name, int hints);
+
+// Open a table without mapping it: fields are read and written with
+// pread/pwrite through the db's buffer pool, so only the pages in use take
+// memory.  The accessors work the same; hints and dense_db_table_advise
+// don't apply.  A table can only change storage while nobody holds it,
+// though dense_db_table_open gets a pooled table in use as it is.
+dense_db_table_t * dense_db_table_open_pooled(dense_db_t * db, char * name);
+
+// Hint how count rows from first_row will be used.  For PAX tables this
+// covers whole blocks, every field included.  Resizing the table may drop
+// these, the hints it was opened with are reapplied.
+void dense_db_table_advise(dense_db_table_t * table, uint64_t first_row, size_t count, int hints);
 void dense_db_table_close(dense_db_table_t * table);
 
+// Grow or shrink a table in place.  New rows read as zero.  The table
+// handle stays valid, but the mapping may move, so these mustn't run
+// alongside other calls on the same table.
+void dense_db_table_resize(dense_db_table_t * table, size_t rows);
+
+// Add n rows at the end, returning the first one.  The file grows
+// geometrically, keeping spare capacity for later appends.
+uint64_t dense_db_table_append_rows(dense_db_table_t * table, size_t n);
+
+// A read only copy of the table as it is now, for scans that shouldn't see
+// later writes.  The copy is a reflink where the filesystem supports them
+// and a full copy otherwise, and goes away when the snapshot is closed.
+// Writes racing the call may or may not make it in.
+dense_db_table_t * dense_db_table_snapshot(dense_db_table_t * table);
+
+// Rewrite the table into a smaller, read only file: each field of each block
+// of rows is stored as offsets from a base, deltas or runs, whichever is
+// smallest.  Gets, column reads and row reads keep working (a get decodes
+// one block of one field at most), writes and resizes fail.  The caller
+// must be the table's only holder; later opens get the compacted file.
+void dense_db_table_compact(dense_db_table_t * table);
+
 void dense_db_destroy(dense_db_t * db);
+
+#include "dense_db_agg.h"
+#include "dense_db_filter.h"
+#include "dense_db_scan.h"
+#include "dense_db_wal.h"
+#include "dense_db_bufpool.h"
+#include "dense_db_compact.h"
+#include "dense_db_zonemap.h"
+#include "dense_db_bmindex.h"
+#include "dense_db_hashindex.h"
+#include "dense_db_loader.h"
+
+#endif
@@ -0,0 +1,180 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <error.h>
+#include "dense_db.h"
+#include "dense_db_agg.h"
+#include "dense_db_scan.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+// Values are decoded this many at a time into a buffer on the stack
+#define BATCH 1024
+
+// Don't bother waking the pool for less than this many rows a worker
+#define MIN_ROWS_PER_THREAD (64 * 1024)
+
+// Per worker state
+typedef struct agg_job {
+  dense_db_accessor_t acc;
+
+  dense_db_agg_t agg;
+
+  uint64_t lo;
+  uint64_t width;
+  size_t n_buckets;
+  uint64_t * buckets;
+} agg_job_t;
+
+// Plain loops the compiler can vectorize, built once per instruction set
+__attribute__((target_clones("avx2", "default")))
+static void agg_batch(const uint64_t * v, size_t n, dense_db_agg_t * agg)
+{
+  uint64_t nonzero = 0, sum = 0, min = agg->min, max = agg->max;
+
+  size_t i;
+  for (i = 0; i < n; i++) {
+    nonzero += v[i] != 0;
+    sum += v[i];
+    min = v[i] < min ? v[i] : min;
+    max = v[i] > max ? v[i] : max;
+  }
+
+  agg->count += n;
+  agg->nonzero += nonzero;
+  agg->sum += sum;
+  agg->min = min;
+  agg->max = max;
+}
+
+static void histogram_batch(const uint64_t * v, size_t n, agg_job_t * job)
+{
+  uint64_t last = job->n_buckets - 1;
+
+  size_t i;
+  for (i = 0; i < n; i++) {
+    uint64_t b = v[i] < job->lo ? 0 : (v[i] - job->lo) / job->width;
+
+    job->buckets[MIN(b, last)]++;
+  }
+}
+
+// Scan callback, folds a chunk of rows into its worker's job
+static void agg_chunk(dense_db_table_t * table, uint64_t row, size_t left, int worker, void * arg)
+{
+  agg_job_t * job = (agg_job_t *)arg + worker;
+
+  uint64_t buf[BATCH];
+
+  while (left) {
+    size_t n = MIN(left, BATCH);
+
+    dense_db_table_get_column(table, job->acc, row, n, buf);
+
+    if (job->buckets) {
+      histogram_batch(buf, n, job);
+    } else {
+      agg_batch(buf, n, &job->agg);
+    }
+
+    row += n;
+    left -= n;
+  }
+}
+
+// Run the jobs over the rows, on the pool with a job per worker
+static void run_jobs(dense_db_pool_t * pool, dense_db_table_t * table, agg_job_t * jobs, int n_jobs, uint64_t first_row, size_t count)
+{
+  int i;
+  for (i = 0; i < n_jobs; i++) {
+    jobs[i].agg.min = UINT64_MAX;
+  }
+
+  if (n_jobs == 1) {
+    agg_chunk(table, first_row, count, 0, jobs);
+    return;
+  }
+
+  dense_db_table_scan(pool, table, first_row, count, 0, agg_chunk, jobs);
+}
+
+// One job per worker, or one on the calling thread
+static int job_count(dense_db_pool_t * pool, size_t count)
+{
+  if (! pool || dense_db_pool_size(pool) == 1 || count / MIN_ROWS_PER_THREAD < 2) return 1;
+
+  return dense_db_pool_size(pool);
+}
+
+void dense_db_table_aggregate(dense_db_pool_t * pool, dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, dense_db_agg_t * out)
+{
+  int n_jobs = job_count(pool, count);
+
+  agg_job_t jobs[n_jobs];
+  memset(jobs, 0, sizeof(jobs));
+
+  int i;
+  for (i = 0; i < n_jobs; i++) {
+    jobs[i].acc = acc;
+  }
+
+  run_jobs(pool, table, jobs, n_jobs, first_row, count);
+
+  memset(out, 0, sizeof(*out));
+  out->min = UINT64_MAX;
+
+  for (i = 0; i < n_jobs; i++) {
+    out->count += jobs[i].agg.count;
+    out->nonzero += jobs[i].agg.nonzero;
+    out->sum += jobs[i].agg.sum;
+    out->min = MIN(out->min, jobs[i].agg.min);
+    out->max = MAX(out->max, jobs[i].agg.max);
+  }
+}
+
+void dense_db_table_histogram(dense_db_pool_t * pool, dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, uint64_t lo, uint64_t width, size_t n_buckets, uint64_t * buckets)
+{
+  if (! width || ! n_buckets) error_at_line(1, 0, __FILE__, __LINE__, "Histogram of table %s needs buckets of non zero width", table->name);
+
+  int n_jobs = job_count(pool, count);
+
+  agg_job_t jobs[n_jobs];
+  memset(jobs, 0, sizeof(jobs));
+
+  // Each job counts into its own buckets, merged at the end
+  uint64_t * partial = calloc(sizeof(*partial), n_buckets * n_jobs);
+
+  int i;
+  for (i = 0; i < n_jobs; i++) {
+    jobs[i].acc = acc;
+    jobs[i].lo = lo;
+    jobs[i].width = width;
+    jobs[i].n_buckets = n_buckets;
+    jobs[i].buckets = partial + n_buckets * i;
+  }
+
+  run_jobs(pool, table, jobs, n_jobs, first_row, count);
+
+  memset(buckets, 0, sizeof(*buckets) * n_buckets);
+
+  size_t j;
+  for (i = 0; i < n_jobs; i++) {
+    for (j = 0; j < n_buckets; j++) {
+      buckets[j] += jobs[i].buckets[j];
+    }
+  }
+
+  free(partial);
+}
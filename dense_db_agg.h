@@ -0,0 +1,37 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DENSE_DB_AGG_H
+#define DENSE_DB_AGG_H
+
+#include "dense_db.h"
+#include "dense_db_scan.h"
+
+typedef struct dense_db_agg {
+  uint64_t count;
+  uint64_t nonzero;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+} dense_db_agg_t;
+
+// Aggregates over count rows of one field (of at most 64 bits), split over
+// the pool's workers (NULL, or too few rows to be worth it, runs them on the
+// calling thread).  The sum wraps at 64 bits.
+void dense_db_table_aggregate(dense_db_pool_t * pool, dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, dense_db_agg_t * out);
+
+// Counts values into n_buckets buckets of width values each, starting at
+// lo.  Values below lo or past the last bucket land in the first or last
+// bucket.  width and n_buckets must be non zero.  pool is used as above.
+void dense_db_table_histogram(dense_db_pool_t * pool, dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, uint64_t lo, uint64_t width, size_t n_buckets, uint64_t * buckets);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include "dense_db_bits.h"
+
+#if defined(__x86_64__) && __BYTE_ORDER == __LITTLE_ENDIAN
+#define BITS_HAVE_AVX2 1
+#include <immintrin.h>
+#else
+#define BITS_HAVE_AVX2 0
+#endif
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+static void unpack_strided_scalar(const uint8_t * p, size_t stride, int shift, uint64_t mask, size_t count, uint64_t * out)
+{
+  size_t i;
+  for (i = 0; i < count; i++, p += stride) {
+    out[i] = (bits_load(p) >> shift) & mask;
+  }
+}
+
+// Fields that spill into a 9th byte: only possible for shift + size > 64
+static void unpack_strided_wide(const uint8_t * p, size_t stride, int shift, int size, size_t count, uint64_t * out)
+{
+  size_t i;
+  for (i = 0; i < count; i++, p += stride) {
+    out[i] = bits_get(p, shift, size);
+  }
+}
+
+#define UNPACK_ALIGNED(type, conv) \
+do { \
+  size_t i; \
+  for (i = 0; i < count; i++, p += stride) { \
+    type v; \
+    memcpy(&v, p, sizeof(v)); \
+    out[i] = conv(v); \
+  } \
+} while (0)
+
+static void pack_strided_scalar(uint8_t * p, size_t stride, int shift, uint64_t mask, size_t count, const uint64_t * in)
+{
+  uint64_t keep = ~(mask << shift);
+
+  size_t i;
+  for (i = 0; i < count; i++, p += stride) {
+    bits_store(p, (bits_load(p) & keep) | ((in[i] & mask) << shift));
+  }
+}
+
+static void pack_strided_wide(uint8_t * p, size_t stride, int shift, int size, size_t count, const uint64_t * in)
+{
+  size_t i;
+  for (i = 0; i < count; i++, p += stride) {
+    bits_put(p, shift, size, in[i]);
+  }
+}
+
+#define PACK_ALIGNED(type, conv) \
+do { \
+  size_t i; \
+  for (i = 0; i < count; i++, p += stride) { \
+    type v = conv((type)in[i]); \
+    memcpy(p, &v, sizeof(v)); \
+  } \
+} while (0)
+
+static void unpack_packed_scalar(const uint8_t * base, uint64_t bit, int size, size_t count, uint64_t * out)
+{
+  size_t i;
+  for (i = 0; i < count; i++, bit += size) {
+    out[i] = bits_get(base + bit / 8, bit % 8, size);
+  }
+}
+
+#if BITS_HAVE_AVX2
+__attribute__((target("avx2")))
+static void unpack_strided_avx2(const uint8_t * p, size_t stride, int shift, uint64_t mask, size_t count, uint64_t * out)
+{
+  const __m256i index = _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+  const __m256i vmask = _mm256_set1_epi64x(mask);
+  const __m128i vshift = _mm_cvtsi32_si128(shift);
+
+  size_t i;
+  for (i = 0; i + 4 <= count; i += 4, p += 4 * stride) {
+    __m256i v = _mm256_i64gather_epi64((const long long *)p, index, 1);
+
+    v = _mm256_and_si256(_mm256_srl_epi64(v, vshift), vmask);
+
+    _mm256_storeu_si256((__m256i *)(out + i), v);
+  }
+
+  unpack_strided_scalar(p, stride, shift, mask, count - i, out + i);
+}
+
+// Four rows at a time: gather the words holding them, merge the new values
+// in register and write each word back.  Only valid when stride >= 8, so
+// that the words of neighbouring rows don't overlap.
+__attribute__((target("avx2")))
+static void pack_strided_avx2(uint8_t * p, size_t stride, int shift, uint64_t mask, size_t count, const uint64_t * in)
+{
+  const __m256i index = _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+  const __m256i vmask = _mm256_set1_epi64x(mask);
+  const __m256i keep = _mm256_set1_epi64x(~(mask << shift));
+  const __m128i vshift = _mm_cvtsi32_si128(shift);
+
+  size_t i;
+  for (i = 0; i + 4 <= count; i += 4, p += 4 * stride) {
+    __m256i w = _mm256_i64gather_epi64((const long long *)p, index, 1);
+    __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+
+    v = _mm256_sll_epi64(_mm256_and_si256(v, vmask), vshift);
+    w = _mm256_or_si256(_mm256_and_si256(w, keep), v);
+
+    __m128i lo = _mm256_castsi256_si128(w);
+    __m128i hi = _mm256_extracti128_si256(w, 1);
+
+    _mm_storel_epi64((__m128i *)p, lo);
+    _mm_storel_epi64((__m128i *)(p + stride), _mm_unpackhi_epi64(lo, lo));
+    _mm_storel_epi64((__m128i *)(p + 2 * stride), hi);
+    _mm_storel_epi64((__m128i *)(p + 3 * stride), _mm_unpackhi_epi64(hi, hi));
+  }
+
+  pack_strided_scalar(p, stride, shift, mask, count - i, in + i);
+}
+
+// Four neighbouring values per gather, each lane with its own byte index and
+// shift.  Needs size <= 57 so a value never leaves its 64 bit load.
+__attribute__((target("avx2")))
+static void unpack_packed_avx2(const uint8_t * base, uint64_t bit, int size, size_t count, uint64_t * out)
+{
+  const __m256i vmask = _mm256_set1_epi64x(bits_mask(size));
+  const __m256i seven = _mm256_set1_epi64x(7);
+  const __m256i step = _mm256_set1_epi64x(4 * size);
+
+  __m256i vbit = _mm256_set_epi64x(bit + 3 * size, bit + 2 * size, bit + size, bit);
+
+  size_t i;
+  for (i = 0; i + 4 <= count; i += 4) {
+    __m256i v = _mm256_i64gather_epi64((const long long *)base, _mm256_srli_epi64(vbit, 3), 1);
+
+    v = _mm256_and_si256(_mm256_srlv_epi64(v, _mm256_and_si256(vbit, seven)), vmask);
+
+    _mm256_storeu_si256((__m256i *)(out + i), v);
+
+    vbit = _mm256_add_epi64(vbit, step);
+  }
+
+  unpack_packed_scalar(base, bit + i * size, size, count - i, out + i);
+}
+
+// Unsigned v - lo <= span, four values per compare.  AVX2 only has signed
+// compares, so both sides get their sign bit flipped first.
+__attribute__((target("avx2")))
+static size_t match_range_avx2(const uint64_t * v, size_t n, uint64_t lo, uint64_t span, uint64_t * out)
+{
+  const __m256i sign = _mm256_set1_epi64x(1ull << 63);
+  const __m256i vlo = _mm256_set1_epi64x(lo);
+  const __m256i vspan = _mm256_xor_si256(_mm256_set1_epi64x(span), sign);
+
+  size_t w;
+  for (w = 0; (w + 1) * 64 <= n; w++) {
+    uint64_t bits = 0;
+
+    int j;
+    for (j = 0; j < 64; j += 4) {
+      __m256i x = _mm256_loadu_si256((const __m256i *)(v + w * 64 + j));
+
+      x = _mm256_xor_si256(_mm256_sub_epi64(x, vlo), sign);
+
+      uint64_t over = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, vspan)));
+
+      bits |= (~over & 0xf) << j;
+    }
+
+    out[w] = bits;
+  }
+
+  return w * 64;
+}
+#endif
+
+void bits_unpack_strided(const uint8_t * p, size_t stride, int shift, int size, size_t count, uint64_t * out)
+{
+  // Byte aligned widths don't need shifting or masking, and don't read past
+  // the end of the field either
+  if (shift == 0) {
+    switch (size) {
+      case 8:  UNPACK_ALIGNED(uint8_t, );        return;
+      case 16: UNPACK_ALIGNED(uint16_t, le16toh); return;
+      case 32: UNPACK_ALIGNED(uint32_t, le32toh); return;
+      case 64: UNPACK_ALIGNED(uint64_t, le64toh); return;
+    }
+  }
+
+  if (shift + size > 64) {
+    unpack_strided_wide(p, stride, shift, size, count, out);
+    return;
+  }
+
+#if BITS_HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    unpack_strided_avx2(p, stride, shift, bits_mask(size), count, out);
+    return;
+  }
+#endif
+
+  unpack_strided_scalar(p, stride, shift, bits_mask(size), count, out);
+}
+
+void bits_pack_strided(uint8_t * p, size_t stride, int shift, int size, size_t count, const uint64_t * in)
+{
+  if (shift == 0) {
+    switch (size) {
+      case 8:  PACK_ALIGNED(uint8_t, );        return;
+      case 16: PACK_ALIGNED(uint16_t, htole16); return;
+      case 32: PACK_ALIGNED(uint32_t, htole32); return;
+      case 64: PACK_ALIGNED(uint64_t, htole64); return;
+    }
+  }
+
+  if (! count) return;
+
+  // The fast paths rewrite a whole unaligned 64 bit word per row.  Keep them
+  // to the rows whose word ends inside the last row's field, the words of
+  // the last few rows could reach into rows we weren't asked to touch.
+  size_t end = (count - 1) * stride + (shift + size + 7) / 8;
+  size_t fast = end < 8 ? 0 : MIN(count, (end - 8) / stride + 1);
+
+  if (shift + size > 64) {
+    fast = 0;
+  } else {
+#if BITS_HAVE_AVX2
+    if (stride >= 8 && __builtin_cpu_supports("avx2")) {
+      pack_strided_avx2(p, stride, shift, bits_mask(size), fast, in);
+    } else
+#endif
+    pack_strided_scalar(p, stride, shift, bits_mask(size), fast, in);
+  }
+
+  pack_strided_wide(p + fast * stride, stride, shift, size, count - fast, in + fast);
+}
+
+void bits_unpack_packed(const uint8_t * base, uint64_t bit, int size, size_t count, uint64_t * out)
+{
+  // Whole byte widths keep the same shift for every value
+  if (size % 8 == 0) {
+    bits_unpack_strided(base + bit / 8, size / 8, bit % 8, size, count, out);
+    return;
+  }
+
+#if BITS_HAVE_AVX2
+  if (size <= 57 && __builtin_cpu_supports("avx2")) {
+    unpack_packed_avx2(base, bit, size, count, out);
+    return;
+  }
+#endif
+
+  unpack_packed_scalar(base, bit, size, count, out);
+}
+
+// Values are accumulated in a register and written out a whole 64 bit word
+// at a time, only the first and last words are merged with what's there.
+void bits_pack_packed(uint8_t * base, uint64_t bit, int size, size_t count, const uint64_t * in)
+{
+  if (size % 8 == 0) {
+    bits_pack_strided(base + bit / 8, size / 8, bit % 8, size, count, in);
+    return;
+  }
+
+  if (! count) return;
+
+  uint64_t mask = bits_mask(size);
+
+  uint8_t * p = base + bit / 64 * 8;
+  int fill = bit % 64;
+
+  uint64_t acc = bits_load(p) & bits_mask(fill);
+
+  size_t i;
+  for (i = 0; i < count; i++) {
+    uint64_t v = in[i] & mask;
+
+    acc |= v << fill;
+    fill += size;
+
+    if (fill >= 64) {
+      bits_store(p, acc);
+      p += 8;
+
+      fill -= 64;
+      acc = fill ? v >> (size - fill) : 0;
+    }
+  }
+
+  if (fill) bits_store(p, (bits_load(p) & ~bits_mask(fill)) | acc);
+}
+
+void bits_match_range(const uint64_t * v, size_t n, uint64_t lo, uint64_t span, uint64_t * out)
+{
+  size_t i = 0;
+
+#if BITS_HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) i = match_range_avx2(v, n, lo, span, out);
+#endif
+
+  for (; i < n; i += 64) {
+    uint64_t bits = 0;
+
+    size_t j;
+    for (j = 0; j < 64 && i + j < n; j++) {
+      bits |= (uint64_t)(v[i + j] - lo <= span) << j;
+    }
+
+    out[i / 64] = bits;
+  }
+}
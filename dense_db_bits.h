@@ -0,0 +1,127 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DENSE_DB_BITS_H
+#define DENSE_DB_BITS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+
+// The data region of a table is one little endian bit stream: bit n lives in
+// byte n / 8 at position n % 8.  Rows are byte aligned, so any field can be
+// reached with an unaligned 64 bit load from the byte it starts in.
+
+static inline uint64_t bits_load(const uint8_t * p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return le64toh(v);
+}
+
+static inline void bits_store(uint8_t * p, uint64_t v)
+{
+  v = htole64(v);
+  memcpy(p, &v, 8);
+}
+
+static inline uint64_t bits_mask(int size)
+{
+  return size >= 64 ? ~0ull : (1ull << size) - 1ull;
+}
+
+// Read a field of up to 64 bits starting shift (< 8) bits into the byte at p
+static inline uint64_t bits_get(const uint8_t * p, int shift, int size)
+{
+  uint64_t v = bits_load(p) >> shift;
+
+  if (shift + size > 64) v |= (uint64_t)p[8] << (64 - shift);
+
+  return v & bits_mask(size);
+}
+
+// Write the low size (<= 64) bits of v at shift (< 8) bits into the byte at
+// p, leaving the bits around it alone.  This works on the naturally aligned
+// 64 bit words holding the field, so it never writes to a word the field
+// doesn't touch.
+static inline void bits_put(uint8_t * p, int shift, int size, uint64_t v)
+{
+  uint64_t * word = (uint64_t *)((uintptr_t)p & ~(uintptr_t)7);
+  int offset = ((uintptr_t)p & 7) * 8 + shift;
+
+  uint64_t mask = bits_mask(size);
+
+  v &= mask;
+
+  word[0] = htole64((le64toh(word[0]) & ~(mask << offset)) | (v << offset));
+
+  if (offset + size > 64) {
+    uint64_t spill = bits_mask(offset + size - 64);
+
+    word[1] = htole64((le64toh(word[1]) & ~spill) | (v >> (64 - offset)));
+  }
+}
+
+// Replace the bits under mask of the little endian word at word with bits,
+// retrying if another thread changes the word in between
+static inline void bits_merge_atomic(uint64_t * word, uint64_t mask, uint64_t bits)
+{
+  if (mask == ~0ull) {
+    __atomic_store_n(word, htole64(bits), __ATOMIC_RELEASE);
+    return;
+  }
+
+  uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+  uint64_t new;
+
+  do {
+    new = htole64((le64toh(old) & ~mask) | bits);
+  } while (! __atomic_compare_exchange_n(word, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// bits_put for concurrent writers: other threads may be writing other fields
+// sharing the same words.  A field straddling two words is written one word
+// at a time, so while nothing is lost a reader can see it half written.
+static inline void bits_put_atomic(uint8_t * p, int shift, int size, uint64_t v)
+{
+  uint64_t * word = (uint64_t *)((uintptr_t)p & ~(uintptr_t)7);
+  int offset = ((uintptr_t)p & 7) * 8 + shift;
+
+  uint64_t mask = bits_mask(size);
+
+  v &= mask;
+
+  bits_merge_atomic(word, mask << offset, v << offset);
+
+  if (offset + size > 64) bits_merge_atomic(word + 1, bits_mask(offset + size - 64), v >> (64 - offset));
+}
+
+// Decode count values of size (<= 64) bits, the first starting shift bits
+// into p and each following one stride bytes further on
+void bits_unpack_strided(const uint8_t * p, size_t stride, int shift, int size, size_t count, uint64_t * out);
+
+// The inverse of bits_unpack_strided, values wider than size are truncated
+void bits_pack_strided(uint8_t * p, size_t stride, int shift, int size, size_t count, const uint64_t * in);
+
+// Decode count values of size (<= 64) bits packed back to back, the first
+// starting bit bits into base
+void bits_unpack_packed(const uint8_t * base, uint64_t bit, int size, size_t count, uint64_t * out);
+
+// The inverse of bits_unpack_packed, values wider than size are truncated
+void bits_pack_packed(uint8_t * base, uint64_t bit, int size, size_t count, const uint64_t * in);
+
+// Set bit i of the bitmap at out (clearing the rest) when lo <= v[i] <= lo +
+// span, for i < n.  out holds (n + 63) / 64 words.
+void bits_match_range(const uint64_t * v, size_t n, uint64_t lo, uint64_t span, uint64_t * out);
+
+#endif
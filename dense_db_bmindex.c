@@ -0,0 +1,904 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <error.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "dense_db.h"
+#include "dense_db_bits.h"
+#include "dense_db_bmindex.h"
+
+#define ERROR_AT_LINE(fmt, ...) error_at_line(1, errno, __FILE__, __LINE__, fmt , ##__VA_ARGS__)
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+#define CHUNK_ROWS (1 << DENSE_DB_BMINDEX_CHUNK_SHIFT)
+#define CHUNK_WORDS (CHUNK_ROWS / 64)
+
+// Arrays past this many rows become bitmaps, which go back to arrays below
+// half of it, so a container hovering around the limit isn't converted on
+// every write
+#define ARRAY_MAX 4096
+#define ARRAY_MIN (ARRAY_MAX / 2)
+
+// The saved indexes are:
+//   magic[8] state:32 n_indexed:32 rows:64
+// then each indexed field's number and size, both 32 bits, and for each of
+// those fields, each chunk and each value, a container: n:32 followed by n
+// 16 bit rows if n <= ARRAY_MAX, a bitmap of the chunk's rows otherwise.
+// Header numbers are big endian like the table headers, containers little
+// endian.  state works as for zone maps.
+#define BITMAPS_MAGIC "DBBMIDX"
+#define BITMAPS_STATE_OFFSET 8
+#define BITMAPS_DIRTY 0
+#define BITMAPS_CLEAN 1
+
+static char * bitmaps_path(dense_db_table_t * table)
+{
+  char * path;
+  assert(asprintf(&path, "%s/.%s.bitmaps", table->db->storage_path, table->name) > 0);
+
+  return path;
+}
+
+// Containers
+
+static size_t lower_bound(const uint16_t * array, size_t n, uint32_t lo)
+{
+  size_t first = 0;
+
+  while (n) {
+    size_t half = n / 2;
+
+    if (array[first + half] < lo) {
+      first += half + 1;
+      n -= half + 1;
+    } else {
+      n = half;
+    }
+  }
+
+  return first;
+}
+
+static void to_bits(dense_db_bmcontainer_t * c)
+{
+  c->bits = calloc(sizeof(*c->bits), CHUNK_WORDS);
+
+  uint32_t i;
+  for (i = 0; i < c->n; i++) {
+    c->bits[c->array[i] / 64] |= 1ull << (c->array[i] % 64);
+  }
+
+  free(c->array);
+  c->array = NULL;
+  c->alloc = 0;
+}
+
+static void to_array(dense_db_bmcontainer_t * c)
+{
+  c->alloc = MAX(c->n, 4);
+  c->array = malloc(sizeof(*c->array) * c->alloc);
+
+  uint32_t n = 0, i;
+  for (i = 0; i < CHUNK_WORDS; i++) {
+    uint64_t word = c->bits[i];
+
+    while (word) {
+      c->array[n++] = i * 64 + __builtin_ctzll(word);
+      word &= word - 1;
+    }
+  }
+
+  free(c->bits);
+  c->bits = NULL;
+}
+
+static void container_add(dense_db_bmcontainer_t * c, uint32_t lo)
+{
+  if (c->bits) {
+    uint64_t bit = 1ull << (lo % 64);
+
+    if (! (c->bits[lo / 64] & bit)) {
+      c->bits[lo / 64] |= bit;
+      c->n++;
+    }
+
+    return;
+  }
+
+  size_t i = lower_bound(c->array, c->n, lo);
+
+  if (i < c->n && c->array[i] == lo) return;
+
+  if (c->n == ARRAY_MAX) {
+    to_bits(c);
+    container_add(c, lo);
+    return;
+  }
+
+  if (c->n == c->alloc) {
+    c->alloc = MAX(c->alloc * 2, 4);
+    c->array = realloc(c->array, sizeof(*c->array) * c->alloc);
+  }
+
+  memmove(c->array + i + 1, c->array + i, sizeof(*c->array) * (c->n - i));
+
+  c->array[i] = lo;
+  c->n++;
+}
+
+static void container_remove(dense_db_bmcontainer_t * c, uint32_t lo)
+{
+  if (c->bits) {
+    uint64_t bit = 1ull << (lo % 64);
+
+    if (c->bits[lo / 64] & bit) {
+      c->bits[lo / 64] &= ~bit;
+      c->n--;
+    }
+
+    if (c->n < ARRAY_MIN) to_array(c);
+    return;
+  }
+
+  size_t i = lower_bound(c->array, c->n, lo);
+
+  if (i == c->n || c->array[i] != lo) return;
+
+  memmove(c->array + i, c->array + i + 1, sizeof(*c->array) * (c->n - i - 1));
+  c->n--;
+}
+
+// Drop the rows from lo on
+static void container_truncate(dense_db_bmcontainer_t * c, uint32_t lo)
+{
+  if (! c->bits) {
+    c->n = lower_bound(c->array, c->n, lo);
+    return;
+  }
+
+  if (lo % 64) c->bits[lo / 64] &= bits_mask(lo % 64);
+
+  memset(c->bits + (lo + 63) / 64, 0, sizeof(*c->bits) * (CHUNK_WORDS - (lo + 63) / 64));
+
+  uint32_t i;
+  for (c->n = 0, i = 0; i < CHUNK_WORDS; i++) {
+    c->n += __builtin_popcountll(c->bits[i]);
+  }
+
+  if (c->n < ARRAY_MIN) to_array(c);
+}
+
+static void container_free(dense_db_bmcontainer_t * c)
+{
+  free(c->array);
+  free(c->bits);
+}
+
+static inline dense_db_bmcontainer_t * container_for(dense_db_field_bmindex_t * fi, uint64_t chunk, uint64_t value)
+{
+  return fi->containers + chunk * fi->n_values + value;
+}
+
+// Indexes
+
+static void chunks_grow(dense_db_table_t * table, size_t n_chunks)
+{
+  dense_db_bmindex_t * index = table->bmindex;
+
+  if (n_chunks > index->alloc_chunks) {
+    size_t alloc = MAX(n_chunks, index->alloc_chunks * 2);
+
+    int i;
+    for (i = 0; i < table->n_fields; i++) {
+      dense_db_field_bmindex_t * fi = index->fields[i];
+
+      if (! fi) continue;
+
+      fi->containers = realloc(fi->containers, sizeof(*fi->containers) * fi->n_values * alloc);
+      memset(fi->containers + fi->n_values * index->alloc_chunks, 0, sizeof(*fi->containers) * fi->n_values * (alloc - index->alloc_chunks));
+    }
+
+    index->alloc_chunks = alloc;
+  }
+
+  index->n_chunks = MAX(index->n_chunks, n_chunks);
+}
+
+static dense_db_field_bmindex_t * field_new(dense_db_table_t * table, int field)
+{
+  dense_db_field_bmindex_t * fi = calloc(sizeof(*fi), 1);
+
+  fi->size = table->fields[field].size;
+  fi->n_values = 1ull << fi->size;
+  fi->containers = calloc(sizeof(*fi->containers), fi->n_values * MAX(table->bmindex->alloc_chunks, 1));
+
+  // Recursive, as a row written with the same field twice begins it twice
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&fi->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  return fi;
+}
+
+static void field_free(dense_db_field_bmindex_t * fi, size_t n_chunks)
+{
+  size_t i;
+  for (i = 0; i < n_chunks * fi->n_values; i++) {
+    container_free(fi->containers + i);
+  }
+
+  pthread_mutex_destroy(&fi->lock);
+
+  free(fi->containers);
+  free(fi);
+}
+
+static void field_build(dense_db_table_t * table, int field)
+{
+  dense_db_field_bmindex_t * fi = table->bmindex->fields[field];
+  dense_db_accessor_t acc = dense_db_table_get_accessor(table, table->fields[field].name);
+
+  uint64_t * buf = malloc(sizeof(*buf) * CHUNK_ROWS);
+  uint32_t * counts = malloc(sizeof(*counts) * fi->n_values);
+
+  size_t chunk;
+  for (chunk = 0; chunk < table->bmindex->n_chunks; chunk++) {
+    uint64_t first = chunk << DENSE_DB_BMINDEX_CHUNK_SHIFT;
+    size_t n = MIN(CHUNK_ROWS, table->rows - first);
+    size_t i;
+
+    dense_db_table_get_column(table, acc, first, n, buf);
+
+    memset(counts, 0, sizeof(*counts) * fi->n_values);
+
+    for (i = 0; i < n; i++) counts[buf[i]]++;
+
+    for (i = 0; i < fi->n_values; i++) {
+      dense_db_bmcontainer_t * c = container_for(fi, chunk, i);
+
+      container_free(c);
+      memset(c, 0, sizeof(*c));
+
+      if (counts[i] > ARRAY_MAX) {
+        c->bits = calloc(sizeof(*c->bits), CHUNK_WORDS);
+      } else {
+        c->alloc = MAX(counts[i], 4);
+        c->array = malloc(sizeof(*c->array) * c->alloc);
+      }
+    }
+
+    for (i = 0; i < n; i++) {
+      dense_db_bmcontainer_t * c = container_for(fi, chunk, buf[i]);
+
+      if (c->bits) {
+        c->bits[i / 64] |= 1ull << (i % 64);
+        c->n++;
+      } else {
+        c->array[c->n++] = i;
+      }
+    }
+  }
+
+  free(buf);
+  free(counts);
+}
+
+static dense_db_bmindex_t * index_new(dense_db_table_t * table)
+{
+  dense_db_bmindex_t * index = calloc(sizeof(*index), 1);
+
+  index->fields = calloc(sizeof(*index->fields), table->n_fields);
+  index->n_chunks = (table->rows + CHUNK_ROWS - 1) >> DENSE_DB_BMINDEX_CHUNK_SHIFT;
+  index->alloc_chunks = MAX(index->n_chunks, 1);
+
+  // Only tables whose header can say they have indexes get them saved
+  index->persist = table->version >= 2 && ! table->snapshot;
+  index->dirty = 1;
+
+  pthread_mutex_init(&index->lock, NULL);
+
+  return index;
+}
+
+// Saving and loading
+
+typedef struct out_buf {
+  uint8_t * data;
+  size_t len;
+  size_t alloc;
+} out_buf_t;
+
+static void out_put(out_buf_t * out, const void * data, size_t len)
+{
+  if (out->len + len > out->alloc) {
+    out->alloc = MAX(out->alloc * 2, out->len + len);
+    out->data = realloc(out->data, out->alloc);
+  }
+
+  memcpy(out->data + out->len, data, len);
+  out->len += len;
+}
+
+static void out_be32(out_buf_t * out, uint32_t v)
+{
+  v = htobe32(v);
+  out_put(out, &v, 4);
+}
+
+static void write_all(int fd, const void * buf, size_t len, off_t offset)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = pwrite(fd, (const char *)buf + done, len - done, offset + done);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+
+      ERROR_AT_LINE("Error in writing a bitmap index");
+    }
+
+    done += n;
+  }
+}
+
+// Write every index out, marked clean if asked to once it's synced
+static void write_indexes(dense_db_table_t * table, int clean)
+{
+  dense_db_bmindex_t * index = table->bmindex;
+  out_buf_t out = { 0 };
+  uint32_t n_indexed = 0;
+  uint64_t rows = htobe64(table->rows);
+  int i;
+
+  for (i = 0; i < table->n_fields; i++) n_indexed += index->fields[i] != NULL;
+
+  out_put(&out, BITMAPS_MAGIC, sizeof(BITMAPS_MAGIC));
+  out_be32(&out, BITMAPS_DIRTY);
+  out_be32(&out, n_indexed);
+  out_put(&out, &rows, 8);
+
+  for (i = 0; i < table->n_fields; i++) {
+    if (! index->fields[i]) continue;
+
+    out_be32(&out, i);
+    out_be32(&out, index->fields[i]->size);
+  }
+
+  for (i = 0; i < table->n_fields; i++) {
+    dense_db_field_bmindex_t * fi = index->fields[i];
+
+    if (! fi) continue;
+
+    size_t k;
+    for (k = 0; k < index->n_chunks * fi->n_values; k++) {
+      dense_db_bmcontainer_t * c = fi->containers + k;
+      uint32_t n = htole32(c->n), j;
+
+      out_put(&out, &n, 4);
+
+      // Arrays never pass ARRAY_MAX, so these are always bitmaps
+      if (c->n > ARRAY_MAX) {
+        for (j = 0; j < CHUNK_WORDS; j++) {
+          uint64_t word = htole64(c->bits[j]);
+
+          out_put(&out, &word, 8);
+        }
+      } else if (c->bits) {
+        for (j = 0; j < CHUNK_WORDS; j++) {
+          uint64_t word = c->bits[j];
+
+          while (word) {
+            uint16_t lo = htole16(j * 64 + __builtin_ctzll(word));
+
+            out_put(&out, &lo, 2);
+            word &= word - 1;
+          }
+        }
+      } else {
+        for (j = 0; j < c->n; j++) {
+          uint16_t lo = htole16(c->array[j]);
+
+          out_put(&out, &lo, 2);
+        }
+      }
+    }
+  }
+
+  char * path = bitmaps_path(table);
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+
+  if (fd < 0) ERROR_AT_LINE("Error in saving the bitmap indexes of %s", table->name);
+
+  free(path);
+
+  write_all(fd, out.data, out.len, 0);
+
+  free(out.data);
+
+  if (fdatasync(fd) < 0) ERROR_AT_LINE("Error in sync");
+
+  if (clean) {
+    uint32_t state = htobe32(BITMAPS_CLEAN);
+
+    write_all(fd, &state, sizeof(state), BITMAPS_STATE_OFFSET);
+
+    if (fdatasync(fd) < 0) ERROR_AT_LINE("Error in sync");
+  }
+
+  if (close(fd) < 0) ERROR_AT_LINE("Error in close");
+}
+
+// Read the whole saved file, NULL if there's none
+static uint8_t * read_file(dense_db_table_t * table, size_t * len)
+{
+  char * path = bitmaps_path(table);
+  int fd = open(path, O_RDONLY);
+
+  free(path);
+
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) ERROR_AT_LINE("Error in fstat");
+
+  uint8_t * data = malloc(st.st_size + 1);
+  size_t done = 0;
+
+  while (done < st.st_size) {
+    ssize_t n = pread(fd, data + done, st.st_size - done, done);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) ERROR_AT_LINE("Error in reading the bitmap indexes of %s", table->name);
+    if (n == 0) break;
+
+    done += n;
+  }
+
+  if (close(fd) < 0) ERROR_AT_LINE("Error in close");
+
+  *len = done;
+
+  return data;
+}
+
+typedef struct in_buf {
+  const uint8_t * data;
+  size_t len;
+  size_t pos;
+} in_buf_t;
+
+static int in_get(in_buf_t * in, void * out, size_t len)
+{
+  if (in->len - in->pos < len) return 0;
+
+  memcpy(out, in->data + in->pos, len);
+  in->pos += len;
+
+  return 1;
+}
+
+// Parse the containers of every indexed field, failing on a short file
+static int read_containers(dense_db_table_t * table, in_buf_t * in)
+{
+  dense_db_bmindex_t * index = table->bmindex;
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    dense_db_field_bmindex_t * fi = index->fields[i];
+
+    if (! fi) continue;
+
+    size_t k;
+    for (k = 0; k < index->n_chunks * fi->n_values; k++) {
+      dense_db_bmcontainer_t * c = fi->containers + k;
+      uint32_t n, j;
+
+      if (! in_get(in, &n, 4)) return 0;
+
+      c->n = le32toh(n);
+
+      if (c->n > ARRAY_MAX) {
+        c->bits = malloc(sizeof(*c->bits) * CHUNK_WORDS);
+
+        if (! in_get(in, c->bits, sizeof(*c->bits) * CHUNK_WORDS)) return 0;
+
+        for (j = 0; j < CHUNK_WORDS; j++) c->bits[j] = le64toh(c->bits[j]);
+      } else {
+        c->alloc = MAX(c->n, 4);
+        c->array = malloc(sizeof(*c->array) * c->alloc);
+
+        if (! in_get(in, c->array, sizeof(*c->array) * c->n)) return 0;
+
+        for (j = 0; j < c->n; j++) c->array[j] = le16toh(c->array[j]);
+      }
+    }
+  }
+
+  return 1;
+}
+
+dense_db_bmindex_t * dense_db_bmindex_load(dense_db_table_t * table)
+{
+  dense_db_bmindex_t * index = index_new(table);
+  size_t len = 0;
+  uint8_t * data = read_file(table, &len);
+
+  table->bmindex = index;
+
+  // Without the file there's no telling which fields were indexed
+  if (! data) error_at_line(1, 0, __FILE__, __LINE__, "Table %s has bitmap indexes, but their file is missing", table->name);
+
+  in_buf_t in = { data, len, 0 };
+  char magic[sizeof(BITMAPS_MAGIC)];
+  uint32_t state = 0, n_indexed = 0;
+  uint64_t rows = 0;
+
+  int ok = in_get(&in, magic, sizeof(magic)) && memcmp(magic, BITMAPS_MAGIC, sizeof(magic)) == 0;
+  ok = ok && in_get(&in, &state, 4) && in_get(&in, &n_indexed, 4) && in_get(&in, &rows, 8);
+
+  uint32_t i;
+  for (i = 0; ok && i < be32toh(n_indexed); i++) {
+    uint32_t field, size;
+
+    ok = in_get(&in, &field, 4) && in_get(&in, &size, 4);
+    field = be32toh(field);
+
+    if (ok && field < table->n_fields && table->fields[field].size == be32toh(size) && be32toh(size) <= DENSE_DB_BMINDEX_MAX_BITS) {
+      index->fields[field] = field_new(table, field);
+    }
+  }
+
+  if (ok && be32toh(state) == BITMAPS_CLEAN && be64toh(rows) == table->rows && read_containers(table, &in)) {
+    index->dirty = 0;
+  } else {
+    // Stale or damaged, so start over from the table
+    for (i = 0; i < table->n_fields; i++) {
+      if (index->fields[i]) field_build(table, i);
+    }
+  }
+
+  free(data);
+
+  return index;
+}
+
+void dense_db_bmindex_add(dense_db_table_t * table, int field)
+{
+  if (! table->bmindex) table->bmindex = index_new(table);
+
+  dense_db_bmindex_t * index = table->bmindex;
+
+  if (index->fields[field]) return;
+
+  pthread_mutex_lock(&index->lock);
+
+  index->fields[field] = field_new(table, field);
+  field_build(table, field);
+
+  // The saved file has to list the field before the header says the table
+  // has indexes, but stays dirty until the table is synced with it
+  if (index->persist) write_indexes(table, 0);
+
+  index->dirty = 1;
+
+  pthread_mutex_unlock(&index->lock);
+}
+
+void dense_db_bmindex_save(dense_db_table_t * table)
+{
+  dense_db_bmindex_t * index = table->bmindex;
+
+  if (! index->persist || ! index->dirty) return;
+
+  write_indexes(table, 1);
+
+  index->dirty = 0;
+}
+
+void dense_db_bmindex_destroy(dense_db_table_t * table)
+{
+  dense_db_bmindex_t * index = table->bmindex;
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    if (index->fields[i]) field_free(index->fields[i], index->n_chunks);
+  }
+
+  pthread_mutex_destroy(&index->lock);
+
+  free(index->fields);
+  free(index);
+
+  table->bmindex = NULL;
+}
+
+// Writers
+
+// The saved indexes have to be known stale before the table changes
+static void mark_stale(dense_db_table_t * table)
+{
+  dense_db_bmindex_t * index = table->bmindex;
+
+  if (__atomic_load_n(&index->dirty, __ATOMIC_ACQUIRE)) return;
+
+  pthread_mutex_lock(&index->lock);
+
+  if (index->dirty) {
+    pthread_mutex_unlock(&index->lock);
+    return;
+  }
+
+  char * path = bitmaps_path(table);
+  int fd = open(path, O_WRONLY);
+
+  free(path);
+
+  if (fd >= 0) {
+    uint32_t state = htobe32(BITMAPS_DIRTY);
+
+    write_all(fd, &state, sizeof(state), BITMAPS_STATE_OFFSET);
+
+    if (fdatasync(fd) < 0) ERROR_AT_LINE("Error in sync");
+    if (close(fd) < 0) ERROR_AT_LINE("Error in close");
+  }
+
+  __atomic_store_n(&index->dirty, 1, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&index->lock);
+}
+
+// Every field's lock, in field order, as a writer of whole rows takes them
+static void lock_fields(dense_db_bmindex_t * index, int n_fields)
+{
+  int i;
+  for (i = 0; i < n_fields; i++) {
+    if (index->fields[i]) pthread_mutex_lock(&index->fields[i]->lock);
+  }
+}
+
+static void unlock_fields(dense_db_bmindex_t * index, int n_fields)
+{
+  int i;
+  for (i = 0; i < n_fields; i++) {
+    if (index->fields[i]) pthread_mutex_unlock(&index->fields[i]->lock);
+  }
+}
+
+static void move_row(dense_db_field_bmindex_t * fi, uint64_t row, uint64_t old, uint64_t v)
+{
+  if (old == v) return;
+
+  uint64_t chunk = row >> DENSE_DB_BMINDEX_CHUNK_SHIFT;
+  uint32_t lo = row & (CHUNK_ROWS - 1);
+
+  container_remove(container_for(fi, chunk, old), lo);
+  container_add(container_for(fi, chunk, v), lo);
+}
+
+uint64_t dense_db_bmindex_begin(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t row)
+{
+  pthread_mutex_lock(&table->bmindex->fields[acc.field]->lock);
+
+  mark_stale(table);
+
+  return dense_db_table_get_int(table, row, acc);
+}
+
+void dense_db_bmindex_end(dense_db_table_t * table, int field, uint64_t row, uint64_t old, uint64_t v)
+{
+  move_row(table->bmindex->fields[field], row, old, v);
+
+  pthread_mutex_unlock(&table->bmindex->fields[field]->lock);
+}
+
+void dense_db_bmindex_begin_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, uint64_t * old)
+{
+  pthread_mutex_lock(&table->bmindex->fields[acc.field]->lock);
+
+  mark_stale(table);
+
+  dense_db_table_get_column(table, acc, first_row, count, old);
+}
+
+void dense_db_bmindex_end_column(dense_db_table_t * table, int field, uint64_t first_row, size_t count, const uint64_t * old, const uint64_t * in)
+{
+  dense_db_field_bmindex_t * fi = table->bmindex->fields[field];
+
+  size_t i;
+  for (i = 0; i < count; i++) {
+    move_row(fi, first_row + i, old[i], in[i] & bits_mask(fi->size));
+  }
+
+  pthread_mutex_unlock(&fi->lock);
+}
+
+void dense_db_bmindex_resize(dense_db_table_t * table, size_t old_rows, size_t rows)
+{
+  dense_db_bmindex_t * index = table->bmindex;
+
+  if (! index) return;
+
+  lock_fields(index, table->n_fields);
+  mark_stale(table);
+
+  size_t n_chunks = (rows + CHUNK_ROWS - 1) >> DENSE_DB_BMINDEX_CHUNK_SHIFT;
+  uint64_t row;
+  size_t chunk, v;
+
+  chunks_grow(table, n_chunks);
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    dense_db_field_bmindex_t * fi = index->fields[i];
+
+    if (! fi) continue;
+
+    if (rows < old_rows) {
+      for (chunk = rows >> DENSE_DB_BMINDEX_CHUNK_SHIFT; chunk < index->n_chunks; chunk++) {
+        uint64_t from = chunk << DENSE_DB_BMINDEX_CHUNK_SHIFT;
+
+        for (v = 0; v < fi->n_values; v++) {
+          dense_db_bmcontainer_t * c = container_for(fi, chunk, v);
+
+          if (from < rows) {
+            container_truncate(c, rows - from);
+          } else {
+            // Dropped chunks start out empty if the table grows again
+            container_free(c);
+            memset(c, 0, sizeof(*c));
+          }
+        }
+      }
+    }
+
+    // New rows read as zero
+    for (row = old_rows; row < rows; row++) {
+      container_add(container_for(fi, row >> DENSE_DB_BMINDEX_CHUNK_SHIFT, 0), row & (CHUNK_ROWS - 1));
+    }
+  }
+
+  index->n_chunks = n_chunks;
+
+  unlock_fields(index, table->n_fields);
+}
+
+// Readers
+
+static int pred_matches(const dense_db_pred_t * pred, uint64_t v)
+{
+  size_t i;
+
+  switch (pred->op) {
+    case DENSE_DB_PRED_EQ:
+      return v == pred->lo;
+    case DENSE_DB_PRED_RANGE:
+      return v >= pred->lo && v <= pred->hi;
+    case DENSE_DB_PRED_IN:
+      for (i = 0; i < pred->n_set; i++) {
+        if (pred->set[i] == v) return 1;
+      }
+  }
+
+  return 0;
+}
+
+int dense_db_table_index_count(dense_db_table_t * table, dense_db_accessor_t acc, const dense_db_pred_t * pred, size_t * count)
+{
+  if (acc.field >= table->n_fields || ! dense_db_bmindex_has(table, acc.field)) return 0;
+
+  dense_db_bmindex_t * index = table->bmindex;
+  dense_db_field_bmindex_t * fi = index->fields[acc.field];
+
+  pthread_mutex_lock(&fi->lock);
+
+  *count = 0;
+
+  size_t v, chunk;
+  for (v = 0; v < fi->n_values; v++) {
+    if (! pred_matches(pred, v)) continue;
+
+    for (chunk = 0; chunk < index->n_chunks; chunk++) {
+      *count += container_for(fi, chunk, v)->n;
+    }
+  }
+
+  pthread_mutex_unlock(&fi->lock);
+
+  return 1;
+}
+
+// Or the bits of word, standing for rows from row on, into the bitmap of
+// count rows from first_row
+static void or_word(uint64_t * bitmap, uint64_t first_row, size_t count, uint64_t row, uint64_t word)
+{
+  uint64_t end = first_row + count;
+
+  if (row + 64 <= first_row || row >= end) return;
+
+  if (row < first_row) {
+    word >>= first_row - row;
+    row = first_row;
+  }
+
+  if (end - row < 64) word &= bits_mask(end - row);
+
+  if (! word) return;
+
+  uint64_t pos = row - first_row;
+  int shift = pos % 64;
+
+  bitmap[pos / 64] |= word << shift;
+
+  if (shift && word >> (64 - shift)) bitmap[pos / 64 + 1] |= word >> (64 - shift);
+}
+
+int dense_db_table_index_filter(dense_db_table_t * table, dense_db_accessor_t acc, const dense_db_pred_t * pred, uint64_t first_row, size_t count, uint64_t * bitmap)
+{
+  if (acc.field >= table->n_fields || ! dense_db_bmindex_has(table, acc.field)) return 0;
+
+  dense_db_bmindex_t * index = table->bmindex;
+  dense_db_field_bmindex_t * fi = index->fields[acc.field];
+
+  memset(bitmap, 0, sizeof(*bitmap) * ((count + 63) / 64));
+
+  if (! count) return 1;
+
+  pthread_mutex_lock(&fi->lock);
+
+  size_t first_chunk = first_row >> DENSE_DB_BMINDEX_CHUNK_SHIFT;
+  size_t end_chunk = MIN(((first_row + count - 1) >> DENSE_DB_BMINDEX_CHUNK_SHIFT) + 1, index->n_chunks);
+
+  size_t v, chunk;
+  for (v = 0; v < fi->n_values; v++) {
+    if (! pred_matches(pred, v)) continue;
+
+    for (chunk = first_chunk; chunk < end_chunk; chunk++) {
+      dense_db_bmcontainer_t * c = container_for(fi, chunk, v);
+      uint64_t base = chunk << DENSE_DB_BMINDEX_CHUNK_SHIFT;
+      uint32_t i;
+
+      if (c->bits) {
+        uint32_t end = MIN(first_row + count - base, CHUNK_ROWS);
+
+        for (i = first_row > base ? (first_row - base) / 64 : 0; i < (end + 63) / 64; i++) {
+          if (c->bits[i]) or_word(bitmap, first_row, count, base + i * 64, c->bits[i]);
+        }
+      } else {
+        for (i = lower_bound(c->array, c->n, first_row > base ? MIN(first_row - base, CHUNK_ROWS) : 0); i < c->n; i++) {
+          uint64_t row = base + c->array[i];
+
+          if (row >= first_row + count) break;
+
+          bitmap[(row - first_row) / 64] |= 1ull << ((row - first_row) % 64);
+        }
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&fi->lock);
+
+  return 1;
+}
@@ -0,0 +1,98 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DENSE_DB_BMINDEX_H
+#define DENSE_DB_BMINDEX_H
+
+#include <pthread.h>
+#include "dense_db.h"
+#include "dense_db_filter.h"
+
+// Bitmap indexes keep, for each value of a narrow field, the set of rows
+// holding it.  Rows are split into chunks of 1 << DENSE_DB_BMINDEX_CHUNK_SHIFT,
+// and each value's rows in a chunk are a container: a sorted array of the
+// low 16 bits of the rows while there are few of them, a bitmap of the
+// whole chunk once there are many.
+#define DENSE_DB_BMINDEX_CHUNK_SHIFT 16
+#define DENSE_DB_BMINDEX_MAX_BITS 8
+
+typedef struct dense_db_bmcontainer {
+  uint32_t n;
+
+  // Sorted row numbers within the chunk, or NULL once bits is used
+  uint16_t * array;
+  uint32_t alloc;
+
+  uint64_t * bits;
+} dense_db_bmcontainer_t;
+
+typedef struct dense_db_field_bmindex {
+  int size;
+  size_t n_values;
+
+  // n_chunks * n_values of them, by chunk then value
+  dense_db_bmcontainer_t * containers;
+
+  // Held by writers of the field from reading the old value until the
+  // index is updated, and by readers of the index
+  pthread_mutex_t lock;
+} dense_db_field_bmindex_t;
+
+typedef struct dense_db_bmindex {
+  // One per field of the table, NULL for fields without an index
+  dense_db_field_bmindex_t ** fields;
+
+  size_t n_chunks;
+  size_t alloc_chunks;
+
+  // Guards dirty, and adding fields.  Taken after any field's lock.
+  pthread_mutex_t lock;
+
+  // As for zone maps: set once the table has changed since the index was
+  // loaded or saved, after marking the saved copy stale
+  int dirty;
+  int persist;
+} dense_db_bmindex_t;
+
+// Index every value of a field of at most DENSE_DB_BMINDEX_MAX_BITS bits.
+// The table's header records that it has indexes, so every later open keeps
+// them up to date, and they're saved as .<name>.bitmaps in the db's
+// directory (loaded back unless the table may have changed since).  Create
+// indexes before sharing the table between threads.
+void dense_db_table_create_bitmap_index(dense_db_table_t * table, char * field);
+
+// Answer an EQ, RANGE or IN predicate on an indexed field from its index
+// alone: count the matching rows of the whole table, or fill bitmap for
+// count rows from first_row like dense_db_table_filter.  Both return 0,
+// doing nothing, when the field has no index.
+int dense_db_table_index_count(dense_db_table_t * table, dense_db_accessor_t acc, const dense_db_pred_t * pred, size_t * count);
+int dense_db_table_index_filter(dense_db_table_t * table, dense_db_accessor_t acc, const dense_db_pred_t * pred, uint64_t first_row, size_t count, uint64_t * bitmap);
+
+// Used by the table itself.  Writers of an indexed field call begin before
+// writing, getting the value it held, and end after.  Writers of several
+// fields begin them in field order, before any other index of the row.
+void dense_db_bmindex_add(dense_db_table_t * table, int field);
+dense_db_bmindex_t * dense_db_bmindex_load(dense_db_table_t * table);
+uint64_t dense_db_bmindex_begin(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t row);
+void dense_db_bmindex_end(dense_db_table_t * table, int field, uint64_t row, uint64_t old, uint64_t v);
+void dense_db_bmindex_begin_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, uint64_t * old);
+void dense_db_bmindex_end_column(dense_db_table_t * table, int field, uint64_t first_row, size_t count, const uint64_t * old, const uint64_t * in);
+void dense_db_bmindex_resize(dense_db_table_t * table, size_t old_rows, size_t rows);
+void dense_db_bmindex_save(dense_db_table_t * table);
+void dense_db_bmindex_destroy(dense_db_table_t * table);
+
+static inline int dense_db_bmindex_has(dense_db_table_t * table, int field)
+{
+  return table->bmindex && table->bmindex->fields[field];
+}
+
+#endif
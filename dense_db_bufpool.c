@@ -0,0 +1,299 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <error.h>
+#include <errno.h>
+#include "dense_db_bufpool.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+#define ERROR_AT_LINE(fmt, ...) error_at_line(1, errno, __FILE__, __LINE__, fmt , ##__VA_ARGS__)
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+
+#define NO_FRAME -1
+
+typedef struct frame {
+  int fd;
+  uint64_t page;
+
+  // Bytes of the page inside the file, only those are written back
+  size_t len;
+
+  int dirty;
+
+  // Set on use, cleared as the clock hand passes
+  int referenced;
+
+  // Next frame in the same hash bucket
+  int next;
+
+  uint8_t * data;
+} frame_t;
+
+struct dense_db_bufpool {
+  pthread_mutex_t lock;
+
+  frame_t * frames;
+  int n_frames;
+  int hand;
+
+  int * buckets;
+  int n_buckets;
+};
+
+static inline size_t bucket_of(dense_db_bufpool_t * pool, int fd, uint64_t page)
+{
+  return ((page * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)fd) % pool->n_buckets;
+}
+
+dense_db_bufpool_t * dense_db_bufpool_new(size_t bytes)
+{
+  dense_db_bufpool_t * pool = calloc(sizeof(*pool), 1);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&pool->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  pool->n_frames = MAX(bytes / PAGE_SIZE, 2);
+  pool->frames = calloc(sizeof(*pool->frames), pool->n_frames);
+
+  if (posix_memalign((void **)&pool->frames[0].data, PAGE_SIZE, (size_t)pool->n_frames * PAGE_SIZE)) ERROR_AT_LINE("Error in allocating the buffer pool");
+
+  int i;
+  for (i = 0; i < pool->n_frames; i++) {
+    pool->frames[i].fd = -1;
+    pool->frames[i].next = NO_FRAME;
+    pool->frames[i].data = pool->frames[0].data + (size_t)i * PAGE_SIZE;
+  }
+
+  pool->n_buckets = pool->n_frames * 2;
+  pool->buckets = malloc(sizeof(*pool->buckets) * pool->n_buckets);
+
+  for (i = 0; i < pool->n_buckets; i++) {
+    pool->buckets[i] = NO_FRAME;
+  }
+
+  return pool;
+}
+
+void dense_db_bufpool_destroy(dense_db_bufpool_t * pool)
+{
+  pthread_mutex_destroy(&pool->lock);
+
+  free(pool->frames[0].data);
+  free(pool->frames);
+  free(pool->buckets);
+  free(pool);
+}
+
+void dense_db_bufpool_lock(dense_db_bufpool_t * pool)
+{
+  pthread_mutex_lock(&pool->lock);
+}
+
+void dense_db_bufpool_unlock(dense_db_bufpool_t * pool)
+{
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void frame_write_back(frame_t * frame)
+{
+  size_t done = 0;
+
+  while (done < frame->len) {
+    ssize_t n = pwrite(frame->fd, frame->data + done, frame->len - done, (frame->page << PAGE_SHIFT) + done);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+
+      ERROR_AT_LINE("Error in writing back a page");
+    }
+
+    done += n;
+  }
+
+  frame->dirty = 0;
+}
+
+static void frame_unlink(dense_db_bufpool_t * pool, int idx)
+{
+  frame_t * frame = pool->frames + idx;
+  int * link = pool->buckets + bucket_of(pool, frame->fd, frame->page);
+
+  while (*link != idx) link = &pool->frames[*link].next;
+
+  *link = frame->next;
+
+  frame->fd = -1;
+  frame->next = NO_FRAME;
+}
+
+// Find a frame for a new page: the first one the clock hand reaches that
+// hasn't been used since it last came by
+static int frame_victim(dense_db_bufpool_t * pool)
+{
+  for (;;) {
+    int idx = pool->hand;
+    frame_t * frame = pool->frames + idx;
+
+    pool->hand = (pool->hand + 1) % pool->n_frames;
+
+    if (frame->fd >= 0 && frame->referenced) {
+      frame->referenced = 0;
+      continue;
+    }
+
+    if (frame->fd >= 0) {
+      if (frame->dirty) frame_write_back(frame);
+
+      frame_unlink(pool, idx);
+    }
+
+    return idx;
+  }
+}
+
+static frame_t * frame_get(dense_db_bufpool_t * pool, int fd, uint64_t page)
+{
+  size_t bucket = bucket_of(pool, fd, page);
+
+  int idx;
+  for (idx = pool->buckets[bucket]; idx != NO_FRAME; idx = pool->frames[idx].next) {
+    frame_t * frame = pool->frames + idx;
+
+    if (frame->fd == fd && frame->page == page) {
+      frame->referenced = 1;
+      return frame;
+    }
+  }
+
+  idx = frame_victim(pool);
+
+  frame_t * frame = pool->frames + idx;
+
+  frame->fd = fd;
+  frame->page = page;
+  frame->dirty = 0;
+  frame->referenced = 1;
+  frame->len = 0;
+
+  while (frame->len < PAGE_SIZE) {
+    ssize_t n = pread(fd, frame->data + frame->len, PAGE_SIZE - frame->len, (page << PAGE_SHIFT) + frame->len);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+
+      ERROR_AT_LINE("Error in reading a page");
+    }
+
+    if (n == 0) break;
+
+    frame->len += n;
+  }
+
+  memset(frame->data + frame->len, 0, PAGE_SIZE - frame->len);
+
+  frame->next = pool->buckets[bucket];
+  pool->buckets[bucket] = idx;
+
+  return frame;
+}
+
+void dense_db_bufpool_read(dense_db_bufpool_t * pool, int fd, uint64_t offset, void * buf, size_t len)
+{
+  uint8_t * out = buf;
+
+  pthread_mutex_lock(&pool->lock);
+
+  while (len) {
+    size_t in_page = offset & (PAGE_SIZE - 1);
+    size_t n = MIN(len, PAGE_SIZE - in_page);
+
+    memcpy(out, frame_get(pool, fd, offset >> PAGE_SHIFT)->data + in_page, n);
+
+    offset += n;
+    out += n;
+    len -= n;
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void dense_db_bufpool_write(dense_db_bufpool_t * pool, int fd, uint64_t offset, const void * buf, size_t len)
+{
+  const uint8_t * in = buf;
+
+  pthread_mutex_lock(&pool->lock);
+
+  while (len) {
+    size_t in_page = offset & (PAGE_SIZE - 1);
+    size_t n = MIN(len, PAGE_SIZE - in_page);
+
+    frame_t * frame = frame_get(pool, fd, offset >> PAGE_SHIFT);
+
+    memcpy(frame->data + in_page, in, n);
+
+    frame->dirty = 1;
+    frame->len = MAX(frame->len, in_page + n);
+
+    offset += n;
+    in += n;
+    len -= n;
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static int flush(dense_db_bufpool_t * pool, int fd, int forget)
+{
+  int wrote = 0;
+
+  pthread_mutex_lock(&pool->lock);
+
+  int i;
+  for (i = 0; i < pool->n_frames; i++) {
+    frame_t * frame = pool->frames + i;
+
+    if (frame->fd != fd) continue;
+
+    if (frame->dirty) {
+      frame_write_back(frame);
+      wrote = 1;
+    }
+
+    if (forget) frame_unlink(pool, i);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  return wrote;
+}
+
+int dense_db_bufpool_flush(dense_db_bufpool_t * pool, int fd)
+{
+  return flush(pool, fd, 0);
+}
+
+int dense_db_bufpool_forget(dense_db_bufpool_t * pool, int fd)
+{
+  return flush(pool, fd, 1);
+}
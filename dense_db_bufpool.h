@@ -0,0 +1,43 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DENSE_DB_BUFPOOL_H
+#define DENSE_DB_BUFPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A bounded cache of file pages, read and written with pread/pwrite, for
+// tables opened with dense_db_table_open_pooled.  Pages are evicted by the
+// clock algorithm, dirty ones written back as they go.
+typedef struct dense_db_bufpool dense_db_bufpool_t;
+
+dense_db_bufpool_t * dense_db_bufpool_new(size_t bytes);
+void dense_db_bufpool_destroy(dense_db_bufpool_t * pool);
+
+// Reads and writes take the pool's lock themselves.  Bracketing several of
+// them with lock and unlock (which nest) makes them atomic together, for
+// read-modify-writes.
+void dense_db_bufpool_lock(dense_db_bufpool_t * pool);
+void dense_db_bufpool_unlock(dense_db_bufpool_t * pool);
+
+// Bytes past the end of the file read as zero
+void dense_db_bufpool_read(dense_db_bufpool_t * pool, int fd, uint64_t offset, void * buf, size_t len);
+void dense_db_bufpool_write(dense_db_bufpool_t * pool, int fd, uint64_t offset, const void * buf, size_t len);
+
+// Write back fd's dirty pages, returning whether there were any.  Forget
+// also drops its pages, and must be called before fd is closed or the file
+// changes size.
+int dense_db_bufpool_flush(dense_db_bufpool_t * pool, int fd);
+int dense_db_bufpool_forget(dense_db_bufpool_t * pool, int fd);
+
+#endif
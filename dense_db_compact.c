@@ -0,0 +1,411 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <error.h>
+#include <errno.h>
+#include "dense_db.h"
+#include "dense_db_bits.h"
+#include "dense_db_compact.h"
+
+#define ERROR_AT_LINE(fmt, ...) error_at_line(1, errno, __FILE__, __LINE__, fmt , ##__VA_ARGS__)
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+// The data region of a compacted table starts with a directory holding an
+// entry for each field of each block, in block order:
+//   offset:64 base:64 aux:64 codec:8 width:8 then 6 bytes of padding
+// all little endian, offset being where the block's values start in the
+// data region (always on a byte).  Those are encoded as one of:
+//   FOR    each value less base, in width bits
+//   DELTA  the first value is base, each following one the one before plus
+//          aux (as a signed delta) plus the next width bit number
+//   RLE    aux runs: each run's value less base in width bits, followed by
+//          the last row of each run in the block, in block_shift bits
+//   RAW    fields wider than 64 bits, packed as they are.  Their stride is
+//          the field's size, which width can't hold, so width is 0.
+// A block whose values are all the same is FOR with width 0, and takes no
+// space past its entry.
+#define ENTRY_BYTES 32
+
+enum {
+  CODEC_FOR,
+  CODEC_DELTA,
+  CODEC_RLE,
+  CODEC_RAW,
+};
+
+typedef struct entry {
+  uint64_t offset;
+  uint64_t base;
+  uint64_t aux;
+  int codec;
+  int width;
+} entry_t;
+
+static int width_of(uint64_t v)
+{
+  return v ? 64 - __builtin_clzll(v) : 0;
+}
+
+static inline uint8_t * compact_base(dense_db_table_t * table)
+{
+  return (uint8_t *)table->data + table->header_size;
+}
+
+static inline entry_t load_entry(dense_db_table_t * table, uint64_t block, int field)
+{
+  uint8_t * p = compact_base(table) + (block * table->n_fields + field) * ENTRY_BYTES;
+
+  entry_t e = { bits_load(p), bits_load(p + 8), bits_load(p + 16), p[24], p[25] };
+
+  return e;
+}
+
+// The index of the run holding row idx of an RLE block
+static size_t find_run(const uint8_t * values, const entry_t * e, int shift, size_t idx)
+{
+  uint64_t bit = e->aux * e->width;
+  size_t lo = 0, hi = e->aux - 1;
+
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    uint64_t last = bits_get(values + (bit + mid * shift) / 8, (bit + mid * shift) % 8, shift);
+
+    if (last < idx) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+static inline uint64_t packed_get(const uint8_t * values, uint64_t i, int width)
+{
+  return bits_get(values + i * width / 8, i * width % 8, width);
+}
+
+// Sum of the first n width bit numbers at values
+static uint64_t packed_sum(const uint8_t * values, size_t n, int width)
+{
+  uint64_t buf[64], sum = 0;
+  size_t i, k;
+
+  if (! width) return 0;
+
+  for (i = 0; i < n; i += 64) {
+    size_t m = MIN(n - i, 64);
+
+    bits_unpack_packed(values, i * width, width, m, buf);
+
+    for (k = 0; k < m; k++) sum += buf[k];
+  }
+
+  return sum;
+}
+
+uint64_t dense_db_compact_get_int(dense_db_table_t * table, uint64_t row, int field)
+{
+  entry_t e = load_entry(table, row >> table->block_shift, field);
+  uint8_t * values = compact_base(table) + e.offset;
+  size_t idx = row & (table->block_rows - 1);
+
+  switch (e.codec) {
+    case CODEC_FOR:
+      return e.base + packed_get(values, idx, e.width);
+    case CODEC_DELTA:
+      return e.base + idx * e.aux + packed_sum(values, idx, e.width);
+    case CODEC_RLE:
+      return e.base + packed_get(values, find_run(values, &e, table->block_shift, idx), e.width);
+  }
+
+  // Only the low word of a wide field
+  uint64_t bit = idx * table->fields[field].size;
+
+  return bits_get(values + bit / 8, bit % 8, 64);
+}
+
+void dense_db_compact_get(dense_db_table_t * table, uint64_t row, int field, void * out)
+{
+  int size = table->fields[field].size;
+  uint8_t * ptr = out;
+
+  if (size <= 64) {
+    uint64_t val = htole64(dense_db_compact_get_int(table, row, field));
+
+    memcpy(out, &val, (size + 7) / 8);
+    return;
+  }
+
+  entry_t e = load_entry(table, row >> table->block_shift, field);
+  uint64_t bit = (row & (table->block_rows - 1)) * size;
+  uint8_t * data = compact_base(table) + e.offset + bit / 8;
+
+  // As raw little endian bytes, like dense_db_table_get
+  for (; size > 0; size -= 64, data += 8, ptr += 8) {
+    uint64_t val = htole64(bits_get(data, bit % 8, MIN(size, 64)));
+
+    memcpy(ptr, &val, (MIN(size, 64) + 7) / 8);
+  }
+}
+
+// Decode rows [idx, idx + n) of one block
+static void decode_block(dense_db_table_t * table, const entry_t * e, size_t idx, size_t n, uint64_t * out)
+{
+  uint8_t * values = compact_base(table) + e->offset;
+  size_t i;
+
+  switch (e->codec) {
+    case CODEC_FOR:
+      if (e->width) {
+        bits_unpack_packed(values, idx * e->width, e->width, n, out);
+      } else {
+        memset(out, 0, n * sizeof(*out));
+      }
+
+      for (i = 0; i < n; i++) out[i] += e->base;
+      break;
+
+    case CODEC_DELTA:
+      out[0] = e->base + idx * e->aux + packed_sum(values, idx, e->width);
+
+      if (e->width) {
+        bits_unpack_packed(values, idx * e->width, e->width, n - 1, out + 1);
+      } else {
+        memset(out + 1, 0, (n - 1) * sizeof(*out));
+      }
+
+      for (i = 1; i < n; i++) out[i] += out[i - 1] + e->aux;
+      break;
+
+    case CODEC_RLE: {
+      int shift = table->block_shift;
+      uint64_t ends = e->aux * e->width;
+      size_t run = find_run(values, e, shift, idx);
+
+      for (i = 0; i < n; run++) {
+        uint64_t val = e->base + packed_get(values, run, e->width);
+        uint64_t last = bits_get(values + (ends + run * shift) / 8, (ends + run * shift) % 8, shift);
+
+        for (; i < n && idx + i <= last; i++) out[i] = val;
+      }
+      break;
+    }
+  }
+}
+
+void dense_db_compact_get_column(dense_db_table_t * table, int field, uint64_t first_row, size_t count, uint64_t * out)
+{
+  while (count) {
+    size_t idx = first_row & (table->block_rows - 1);
+    size_t n = MIN(count, table->block_rows - idx);
+
+    entry_t e = load_entry(table, first_row >> table->block_shift, field);
+
+    decode_block(table, &e, idx, n, out);
+
+    first_row += n;
+    out += n;
+    count -= n;
+  }
+}
+
+// Pick the cheapest encoding for the n values of a block, leaving the
+// values to store in out and returning how many there are
+static size_t encode_block(const uint64_t * vals, size_t n, int shift, entry_t * e, uint64_t * out)
+{
+  uint64_t min = vals[0], max = vals[0];
+  int64_t dmin = 0, dmax = 0;
+  size_t runs = 1;
+  size_t i;
+
+  for (i = 1; i < n; i++) {
+    int64_t delta = vals[i] - vals[i - 1];
+
+    if (vals[i] < min) min = vals[i];
+    if (vals[i] > max) max = vals[i];
+
+    if (i == 1 || delta < dmin) dmin = delta;
+    if (i == 1 || delta > dmax) dmax = delta;
+
+    runs += vals[i] != vals[i - 1];
+  }
+
+  int width = width_of(max - min);
+  int delta_width = width_of((uint64_t)dmax - (uint64_t)dmin);
+
+  uint64_t for_bits = n * width;
+  uint64_t delta_bits = n > 1 ? (n - 1) * delta_width : for_bits;
+  uint64_t rle_bits = runs * (width + shift);
+
+  e->base = min;
+  e->width = width;
+
+  if (for_bits <= delta_bits && for_bits <= rle_bits) {
+    e->codec = CODEC_FOR;
+
+    for (i = 0; i < n; i++) out[i] = vals[i] - min;
+
+    return n;
+  }
+
+  if (rle_bits < delta_bits) {
+    size_t run = 0;
+
+    e->codec = CODEC_RLE;
+    e->aux = runs;
+
+    for (i = 0; i < n; i++) {
+      if (i + 1 == n || vals[i + 1] != vals[i]) {
+        out[run] = vals[i] - min;
+        out[runs + run] = i;
+        run++;
+      }
+    }
+
+    return runs;
+  }
+
+  e->codec = CODEC_DELTA;
+  e->base = vals[0];
+  e->aux = dmin;
+  e->width = delta_width;
+
+  for (i = 1; i < n; i++) out[i - 1] = vals[i] - vals[i - 1] - dmin;
+
+  return n - 1;
+}
+
+static void pwrite_all(int fd, const void * buf, size_t len, size_t offset)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = pwrite(fd, (const char *)buf + done, len - done, offset + done);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+
+      ERROR_AT_LINE("Error in writing a compacted table");
+    }
+
+    done += n;
+  }
+}
+
+size_t dense_db_compact_write(dense_db_table_t * table, int fd, size_t offset)
+{
+  size_t block_rows = COMPACT_BLOCK_ROWS;
+  int shift = __builtin_ctzll(block_rows);
+  size_t n_blocks = (table->rows + block_rows - 1) / block_rows;
+
+  size_t widest = 64;
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    if (table->fields[i].size > widest) widest = table->fields[i].size;
+  }
+
+  size_t dir_bytes = n_blocks * table->n_fields * ENTRY_BYTES;
+  uint8_t * dir = calloc(dir_bytes + 1, 1);
+
+  uint64_t * vals = malloc(sizeof(*vals) * block_rows);
+  uint64_t * enc = malloc(sizeof(*enc) * block_rows * 2);
+
+  // Room for the widest field at full width, RLE never being chosen when
+  // it's larger than that
+  size_t buf_bytes = block_rows * widest / 8 + 16;
+  uint8_t * buf = malloc(buf_bytes);
+  uint8_t * wide = malloc((widest + 63) / 64 * 8);
+
+  size_t pos = dir_bytes;
+  size_t b;
+
+  for (b = 0; b < n_blocks; b++) {
+    uint64_t first = b * block_rows;
+    size_t n = MIN(block_rows, table->rows - first);
+
+    uint64_t bit = 0;
+
+    for (i = 0; i < table->n_fields; i++) {
+      dense_db_accessor_t acc = dense_db_table_get_accessor(table, table->fields[i].name);
+      entry_t e = { 0 };
+      size_t k;
+
+      memset(buf, 0, buf_bytes);
+
+      if (acc.size <= 64) {
+        dense_db_table_get_column(table, acc, first, n, vals);
+
+        size_t m = encode_block(vals, n, shift, &e, enc);
+
+        if (e.width) bits_pack_packed(buf, 0, e.width, m, enc);
+
+        bit = m * e.width;
+
+        if (e.codec == CODEC_RLE) {
+          bits_pack_packed(buf, bit, shift, m, enc + m);
+          bit += m * shift;
+        }
+      } else {
+        e.codec = CODEC_RAW;
+        e.width = 0;
+
+        for (k = 0, bit = 0; k < n; k++) {
+          dense_db_table_get(table, first + k, acc, wide);
+
+          int done;
+          for (done = 0; done < acc.size; done += 64, bit += 64) {
+            uint64_t word = 0;
+
+            memcpy(&word, wide + done / 8, (MIN(acc.size - done, 64) + 7) / 8);
+
+            bits_put(buf + bit / 8, bit % 8, MIN(acc.size - done, 64), le64toh(word));
+          }
+
+          bit -= done - acc.size;
+        }
+      }
+
+      e.offset = pos;
+
+      uint8_t * p = dir + (b * table->n_fields + i) * ENTRY_BYTES;
+
+      bits_store(p, e.offset);
+      bits_store(p + 8, e.base);
+      bits_store(p + 16, e.aux);
+      p[24] = e.codec;
+      p[25] = e.width;
+
+      pwrite_all(fd, buf, (bit + 7) / 8, offset + pos);
+
+      pos += (bit + 7) / 8;
+    }
+  }
+
+  pwrite_all(fd, dir, dir_bytes, offset);
+
+  free(dir);
+  free(vals);
+  free(enc);
+  free(buf);
+  free(wide);
+
+  return offset + pos;
+}
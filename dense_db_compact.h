@@ -0,0 +1,31 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DENSE_DB_COMPACT_H
+#define DENSE_DB_COMPACT_H
+
+#include "dense_db.h"
+
+// Rows per block of a compacted table.  Each field of each block is encoded
+// on its own, so reaching a row decodes at most one block of one field.
+#define COMPACT_BLOCK_ROWS 1024
+
+// Encode the rows of table into fd, as the data region of a compacted
+// table starting offset bytes in, returning where it ends
+size_t dense_db_compact_write(dense_db_table_t * table, int fd, size_t offset);
+
+// Readers for compacted tables, field being the index of the field
+uint64_t dense_db_compact_get_int(dense_db_table_t * table, uint64_t row, int field);
+void dense_db_compact_get(dense_db_table_t * table, uint64_t row, int field, void * out);
+void dense_db_compact_get_column(dense_db_table_t * table, int field, uint64_t first_row, size_t count, uint64_t * out);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "dense_db.h"
+#include "dense_db_bits.h"
+#include "dense_db_filter.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+// Values are decoded this many at a time, a multiple of 64 so every batch
+// fills whole bitmap words
+#define BATCH 1024
+
+// IN predicates on fields up to this wide are answered from a lookup bitmap
+// indexed by value, wider ones by binary search of the sorted set
+#define IN_LOOKUP_BITS 16
+
+typedef struct in_set {
+  uint64_t * lookup;
+
+  uint64_t * sorted;
+  size_t n;
+} in_set_t;
+
+static int u64_cmp(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void in_set_init(in_set_t * in, const dense_db_pred_t * pred, int size)
+{
+  memset(in, 0, sizeof(*in));
+
+  size_t i;
+
+  if (size <= IN_LOOKUP_BITS) {
+    in->lookup = calloc(sizeof(uint64_t), ((1ull << size) + 63) / 64);
+
+    for (i = 0; i < pred->n_set; i++) {
+      if (pred->set[i] >> size) continue;
+
+      in->lookup[pred->set[i] / 64] |= 1ull << (pred->set[i] % 64);
+    }
+  } else {
+    in->sorted = malloc(sizeof(uint64_t) * pred->n_set);
+    in->n = pred->n_set;
+
+    memcpy(in->sorted, pred->set, sizeof(uint64_t) * pred->n_set);
+    qsort(in->sorted, in->n, sizeof(uint64_t), u64_cmp);
+  }
+}
+
+static void in_set_match(in_set_t * in, const uint64_t * v, size_t n, uint64_t * out)
+{
+  memset(out, 0, sizeof(uint64_t) * ((n + 63) / 64));
+
+  size_t i;
+  for (i = 0; i < n; i++) {
+    int hit;
+
+    if (in->lookup) {
+      hit = (in->lookup[v[i] / 64] >> (v[i] % 64)) & 1;
+    } else {
+      hit = bsearch(v + i, in->sorted, in->n, sizeof(uint64_t), u64_cmp) != NULL;
+    }
+
+    out[i / 64] |= (uint64_t)hit << (i % 64);
+  }
+}
+
+static void in_set_destroy(in_set_t * in)
+{
+  free(in->lookup);
+  free(in->sorted);
+}
+
+void dense_db_table_filter(dense_db_table_t * table, dense_db_accessor_t acc, const dense_db_pred_t * pred, uint64_t first_row, size_t count, uint64_t * bitmap)
+{
+  uint64_t lo = pred->lo;
+  uint64_t span = 0;
+
+  // Indexed fields are answered without reading the rows
+  if (dense_db_table_index_filter(table, acc, pred, first_row, count, bitmap)) return;
+
+  in_set_t in;
+
+  if (pred->op == DENSE_DB_PRED_RANGE) {
+    span = pred->hi - pred->lo;
+
+    // an empty range, nothing can match
+    if (pred->hi < pred->lo) {
+      memset(bitmap, 0, sizeof(uint64_t) * ((count + 63) / 64));
+      return;
+    }
+  } else if (pred->op == DENSE_DB_PRED_IN) {
+    in_set_init(&in, pred, acc.size);
+  }
+
+  uint64_t buf[BATCH];
+
+  while (count) {
+    size_t n = MIN(count, BATCH);
+
+    if (! dense_db_table_zone_may_match(table, acc, pred, first_row, n)) {
+      // Ruled out by the zone map without reading the rows
+      memset(bitmap, 0, sizeof(uint64_t) * ((n + 63) / 64));
+    } else {
+      dense_db_table_get_column(table, acc, first_row, n, buf);
+
+      if (pred->op == DENSE_DB_PRED_IN) {
+        in_set_match(&in, buf, n, bitmap);
+      } else {
+        bits_match_range(buf, n, lo, span, bitmap);
+      }
+    }
+
+    first_row += n;
+    count -= n;
+    bitmap += n / 64;
+  }
+
+  if (pred->op == DENSE_DB_PRED_IN) in_set_destroy(&in);
+}
+
+void dense_db_bitmap_and(uint64_t * dst, const uint64_t * src, size_t count)
+{
+  size_t i;
+  for (i = 0; i < (count + 63) / 64; i++) {
+    dst[i] &= src[i];
+  }
+}
+
+void dense_db_bitmap_or(uint64_t * dst, const uint64_t * src, size_t count)
+{
+  size_t i;
+  for (i = 0; i < (count + 63) / 64; i++) {
+    dst[i] |= src[i];
+  }
+}
+
+size_t dense_db_bitmap_count(const uint64_t * bitmap, size_t count)
+{
+  size_t total = 0;
+
+  size_t i;
+  for (i = 0; i < (count + 63) / 64; i++) {
+    total += __builtin_popcountll(bitmap[i]);
+  }
+
+  return total;
+}
+
+size_t dense_db_bitmap_rows(const uint64_t * bitmap, size_t count, uint64_t first_row, uint64_t * rows)
+{
+  size_t n = 0;
+
+  size_t i;
+  for (i = 0; i < (count + 63) / 64; i++) {
+    uint64_t word = bitmap[i];
+
+    while (word) {
+      rows[n++] = first_row + i * 64 + __builtin_ctzll(word);
+      word &= word - 1;
+    }
+  }
+
+  return n;
+}
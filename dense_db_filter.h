@@ -0,0 +1,47 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DENSE_DB_FILTER_H
+#define DENSE_DB_FILTER_H
+
+#include "dense_db.h"
+
+enum {
+  DENSE_DB_PRED_EQ,     // field == lo
+  DENSE_DB_PRED_RANGE,  // lo <= field <= hi
+  DENSE_DB_PRED_IN,     // field is one of set[0 .. n_set)
+};
+
+typedef struct dense_db_pred {
+  int op;
+
+  uint64_t lo;
+  uint64_t hi;
+
+  const uint64_t * set;
+  size_t n_set;
+} dense_db_pred_t;
+
+// Bitmaps hold one bit per row of a range, bit i of word i / 64 standing for
+// first_row + i, so they take (count + 63) / 64 words.
+
+// Evaluate a predicate on one field (of at most 64 bits) over count rows
+void dense_db_table_filter(dense_db_table_t * table, dense_db_accessor_t acc, const dense_db_pred_t * pred, uint64_t first_row, size_t count, uint64_t * bitmap);
+
+void dense_db_bitmap_and(uint64_t * dst, const uint64_t * src, size_t count);
+void dense_db_bitmap_or(uint64_t * dst, const uint64_t * src, size_t count);
+size_t dense_db_bitmap_count(const uint64_t * bitmap, size_t count);
+
+// Write the row ids of the set bits to rows, returning how many there were
+size_t dense_db_bitmap_rows(const uint64_t * bitmap, size_t count, uint64_t first_row, uint64_t * rows);
+
+#endif
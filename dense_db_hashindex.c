@@ -0,0 +1,549 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <error.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dense_db.h"
+#include "dense_db_bits.h"
+#include "dense_db_hashindex.h"
+
+#define ERROR_AT_LINE(fmt, ...) error_at_line(1, errno, __FILE__, __LINE__, fmt , ##__VA_ARGS__)
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+#define BATCH 1024
+
+// Slots are grown once more than 7 in 10 are used
+#define MIN_SLOTS 64
+#define LOAD_NUM 7
+#define LOAD_DEN 10
+
+// The files start with a header of
+//   magic[8] state:32 size:32 rows:64 n_slots:64 n_entries:64
+// in big endian like the table headers, padded to HEADER_SIZE, with the
+// slots after it.  state works as for zone maps, but as a new file is all
+// zeroes, 0 is dirty here.
+#define HASH_MAGIC "DBHASH"
+#define HASH_STATE_OFFSET 8
+#define HASH_DIRTY 0
+#define HASH_CLEAN 1
+#define HEADER_SIZE 64
+
+static char * hash_path(dense_db_table_t * table, int field)
+{
+  char * path;
+  assert(asprintf(&path, "%s/.%s.%s.hash", table->db->storage_path, table->name, table->fields[field].name) > 0);
+
+  return path;
+}
+
+static inline uint64_t slot_home(dense_db_field_hashindex_t * fi, uint64_t key)
+{
+  return (key * 0x9e3779b97f4a7c15ull) >> (64 - __builtin_ctzll(fi->n_slots));
+}
+
+static inline uint64_t slot_key(dense_db_field_hashindex_t * fi, uint64_t i)
+{
+  return le64toh(fi->slots[i * 2]);
+}
+
+static inline uint64_t slot_row(dense_db_field_hashindex_t * fi, uint64_t i)
+{
+  return le64toh(fi->slots[i * 2 + 1]);
+}
+
+static inline void slot_put(dense_db_field_hashindex_t * fi, uint64_t i, uint64_t key, uint64_t row)
+{
+  fi->slots[i * 2] = htole64(key);
+  fi->slots[i * 2 + 1] = htole64(row);
+}
+
+// Map (or remap) the file, or anonymous memory for indexes never saved, to
+// hold n_slots empty slots
+static void map_slots(dense_db_field_hashindex_t * fi, uint64_t n_slots)
+{
+  size_t size = HEADER_SIZE + n_slots * 16;
+
+  if (fi->fd >= 0) {
+    // Dropping the old slots first means the file doesn't keep stale ones
+    if (ftruncate(fi->fd, HEADER_SIZE) < 0 || ftruncate(fi->fd, size) < 0) ERROR_AT_LINE("Error in resizing a hash index");
+  }
+
+  if (fi->map) {
+    fi->map = mremap(fi->map, fi->map_size, size, MREMAP_MAYMOVE);
+
+    if (fi->fd < 0) memset(fi->map + HEADER_SIZE, 0, size - HEADER_SIZE);
+  } else if (fi->fd >= 0) {
+    fi->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fi->fd, 0);
+  } else {
+    fi->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+
+  if (fi->map == MAP_FAILED) ERROR_AT_LINE("Error in mapping a hash index");
+
+  fi->map_size = size;
+  fi->slots = (uint64_t *)(fi->map + HEADER_SIZE);
+  fi->n_slots = n_slots;
+  fi->n_entries = 0;
+}
+
+static void slot_insert(dense_db_field_hashindex_t * fi, uint64_t key, uint64_t row)
+{
+  uint64_t mask = fi->n_slots - 1;
+  uint64_t i = slot_home(fi, key);
+
+  while (slot_row(fi, i)) i = (i + 1) & mask;
+
+  slot_put(fi, i, key, row + 1);
+  fi->n_entries++;
+}
+
+static void slot_remove(dense_db_field_hashindex_t * fi, uint64_t key, uint64_t row)
+{
+  uint64_t mask = fi->n_slots - 1;
+  uint64_t i = slot_home(fi, key), j;
+
+  for (; slot_row(fi, i); i = (i + 1) & mask) {
+    if (slot_key(fi, i) == key && slot_row(fi, i) == row + 1) break;
+  }
+
+  if (! slot_row(fi, i)) return;
+
+  // Shift back later slots of the run that could have gone here, so every
+  // slot stays reachable from its home without tombstones
+  for (j = (i + 1) & mask; slot_row(fi, j); j = (j + 1) & mask) {
+    uint64_t home = slot_home(fi, slot_key(fi, j));
+
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      slot_put(fi, i, slot_key(fi, j), slot_row(fi, j));
+      i = j;
+    }
+  }
+
+  slot_put(fi, i, 0, 0);
+  fi->n_entries--;
+}
+
+// Rehash into enough slots for n entries, dropping rows from rows on
+static void rehash(dense_db_field_hashindex_t * fi, uint64_t n, uint64_t rows)
+{
+  uint64_t n_slots = MIN_SLOTS;
+
+  while (n_slots * LOAD_NUM < n * LOAD_DEN) n_slots *= 2;
+
+  uint64_t old_slots = fi->n_slots;
+  uint64_t * old = malloc(old_slots * 16);
+
+  if (old_slots) memcpy(old, fi->slots, old_slots * 16);
+
+  map_slots(fi, n_slots);
+
+  uint64_t i;
+  for (i = 0; i < old_slots; i++) {
+    uint64_t row = le64toh(old[i * 2 + 1]);
+
+    if (row && row <= rows) slot_insert(fi, le64toh(old[i * 2]), row - 1);
+  }
+
+  free(old);
+}
+
+static void index_insert(dense_db_field_hashindex_t * fi, uint64_t key, uint64_t row)
+{
+  if (! key) return;
+
+  if ((fi->n_entries + 1) * LOAD_DEN > fi->n_slots * LOAD_NUM) rehash(fi, fi->n_entries + 1, UINT64_MAX);
+
+  slot_insert(fi, key, row);
+}
+
+static void field_build(dense_db_table_t * table, int field)
+{
+  dense_db_field_hashindex_t * fi = table->hashes->fields[field];
+  dense_db_accessor_t acc = dense_db_table_get_accessor(table, table->fields[field].name);
+
+  uint64_t * buf = malloc(sizeof(*buf) * BATCH);
+  uint64_t row, n = 0;
+  size_t i;
+
+  // Size the slots for every value that's set up front
+  for (row = 0; row < table->rows; row += BATCH) {
+    size_t count = MIN(BATCH, table->rows - row);
+
+    dense_db_table_get_column(table, acc, row, count, buf);
+
+    for (i = 0; i < count; i++) n += buf[i] != 0;
+  }
+
+  // Nothing in a stale file is kept
+  fi->n_slots = 0;
+  rehash(fi, n, 0);
+
+  for (row = 0; row < table->rows; row += BATCH) {
+    size_t count = MIN(BATCH, table->rows - row);
+
+    dense_db_table_get_column(table, acc, row, count, buf);
+
+    for (i = 0; i < count; i++) {
+      if (buf[i]) slot_insert(fi, buf[i], row + i);
+    }
+  }
+
+  free(buf);
+}
+
+static void put_be32_at(uint8_t * p, uint32_t v)
+{
+  v = htobe32(v);
+  memcpy(p, &v, 4);
+}
+
+static void put_be64_at(uint8_t * p, uint64_t v)
+{
+  v = htobe64(v);
+  memcpy(p, &v, 8);
+}
+
+static uint64_t get_be64_at(const uint8_t * p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+
+  return be64toh(v);
+}
+
+static uint32_t get_be32_at(const uint8_t * p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+
+  return be32toh(v);
+}
+
+static void put_state(dense_db_field_hashindex_t * fi, uint32_t state)
+{
+  put_be32_at(fi->map + HASH_STATE_OFFSET, state);
+
+  if (msync(fi->map, HEADER_SIZE, MS_SYNC) < 0) ERROR_AT_LINE("Error in msync");
+}
+
+static dense_db_hashindex_t * hashes_new(dense_db_table_t * table)
+{
+  dense_db_hashindex_t * hashes = calloc(sizeof(*hashes), 1);
+
+  hashes->fields = calloc(sizeof(*hashes->fields), table->n_fields);
+
+  // Indexes that are never saved never need marking either
+  hashes->persist = table->version >= 2 && ! table->snapshot;
+  hashes->dirty = 1;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&hashes->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  return hashes;
+}
+
+// Open the field's index, returning whether its file could be used as is
+static int field_open(dense_db_table_t * table, int field, int create)
+{
+  dense_db_field_hashindex_t * fi = calloc(sizeof(*fi), 1);
+
+  fi->fd = -1;
+
+  table->hashes->fields[field] = fi;
+
+  if (! table->hashes->persist) return 0;
+
+  char * path = hash_path(table, field);
+
+  fi->fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), S_IRUSR | S_IWUSR);
+
+  if (fi->fd < 0) ERROR_AT_LINE("Error in opening hash index %s", path);
+
+  free(path);
+
+  struct stat st;
+  if (fstat(fi->fd, &st) < 0) ERROR_AT_LINE("Error in fstat");
+
+  if (st.st_size < HEADER_SIZE) return 0;
+
+  fi->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fi->fd, 0);
+  if (fi->map == MAP_FAILED) ERROR_AT_LINE("Error in mapping a hash index");
+
+  fi->map_size = st.st_size;
+  fi->slots = (uint64_t *)(fi->map + HEADER_SIZE);
+  fi->n_slots = get_be64_at(fi->map + 24);
+  fi->n_entries = get_be64_at(fi->map + 32);
+
+  return memcmp(fi->map, HASH_MAGIC, sizeof(HASH_MAGIC)) == 0
+    && get_be32_at(fi->map + HASH_STATE_OFFSET) == HASH_CLEAN
+    && get_be32_at(fi->map + 12) == table->fields[field].size
+    && get_be64_at(fi->map + 16) == table->rows
+    && fi->n_slots >= MIN_SLOTS && ! (fi->n_slots & (fi->n_slots - 1))
+    && fi->map_size == HEADER_SIZE + fi->n_slots * 16;
+}
+
+void dense_db_hashindex_load(dense_db_table_t * table)
+{
+  table->hashes = hashes_new(table);
+
+  int clean = 1, any = 0;
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    if (table->fields[i].size > 64) continue;
+
+    // Only fields with a file were indexed
+    char * path = hash_path(table, i);
+    int exists = access(path, F_OK) == 0;
+
+    free(path);
+
+    if (! exists) continue;
+
+    any = 1;
+
+    if (! field_open(table, i, 0)) {
+      clean = 0;
+      field_build(table, i);
+    }
+  }
+
+  table->hashes->dirty = ! (clean && any);
+
+  // Whatever was rebuilt is only in the page cache so far
+  if (table->hashes->dirty) {
+    for (i = 0; i < table->n_fields; i++) {
+      if (table->hashes->fields[i] && table->hashes->fields[i]->fd >= 0) put_state(table->hashes->fields[i], HASH_DIRTY);
+    }
+  }
+}
+
+void dense_db_hashindex_add(dense_db_table_t * table, int field)
+{
+  if (! table->hashes) table->hashes = hashes_new(table);
+
+  dense_db_hashindex_t * hashes = table->hashes;
+
+  if (hashes->fields[field]) return;
+
+  pthread_mutex_lock(&hashes->lock);
+
+  field_open(table, field, 1);
+  field_build(table, field);
+
+  // A new file reads as dirty until saved, so the rest can follow
+  if (! hashes->dirty) {
+    int i;
+    for (i = 0; i < table->n_fields; i++) {
+      if (hashes->fields[i] && hashes->fields[i]->fd >= 0) put_state(hashes->fields[i], HASH_DIRTY);
+    }
+  }
+
+  hashes->dirty = 1;
+
+  pthread_mutex_unlock(&hashes->lock);
+}
+
+void dense_db_hashindex_save(dense_db_table_t * table)
+{
+  dense_db_hashindex_t * hashes = table->hashes;
+
+  if (! hashes->persist || ! hashes->dirty) return;
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    dense_db_field_hashindex_t * fi = hashes->fields[i];
+
+    if (! fi) continue;
+
+    memcpy(fi->map, HASH_MAGIC, sizeof(HASH_MAGIC));
+    put_be32_at(fi->map + 12, table->fields[i].size);
+    put_be64_at(fi->map + 16, table->rows);
+    put_be64_at(fi->map + 24, fi->n_slots);
+    put_be64_at(fi->map + 32, fi->n_entries);
+
+    if (msync(fi->map, fi->map_size, MS_SYNC) < 0) ERROR_AT_LINE("Error in msync");
+
+    put_state(fi, HASH_CLEAN);
+  }
+
+  hashes->dirty = 0;
+}
+
+void dense_db_hashindex_destroy(dense_db_table_t * table)
+{
+  dense_db_hashindex_t * hashes = table->hashes;
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    dense_db_field_hashindex_t * fi = hashes->fields[i];
+
+    if (! fi) continue;
+
+    if (fi->map && munmap(fi->map, fi->map_size) < 0) ERROR_AT_LINE("Error in munmap");
+    if (fi->fd >= 0 && close(fi->fd) < 0) ERROR_AT_LINE("Error in close");
+
+    free(fi);
+  }
+
+  pthread_mutex_destroy(&hashes->lock);
+
+  free(hashes->fields);
+  free(hashes);
+
+  table->hashes = NULL;
+}
+
+// Writers
+
+static void lock_for_write(dense_db_table_t * table)
+{
+  dense_db_hashindex_t * hashes = table->hashes;
+
+  pthread_mutex_lock(&hashes->lock);
+
+  if (hashes->dirty) return;
+
+  // The saved indexes have to be known stale before the table changes
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    if (hashes->fields[i] && hashes->fields[i]->fd >= 0) put_state(hashes->fields[i], HASH_DIRTY);
+  }
+
+  hashes->dirty = 1;
+}
+
+static void move_row(dense_db_field_hashindex_t * fi, uint64_t row, uint64_t old, uint64_t v)
+{
+  if (old == v) return;
+
+  if (old) slot_remove(fi, old, row);
+
+  index_insert(fi, v, row);
+}
+
+uint64_t dense_db_hashindex_begin(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t row)
+{
+  lock_for_write(table);
+
+  return dense_db_table_get_int(table, row, acc);
+}
+
+void dense_db_hashindex_end(dense_db_table_t * table, int field, uint64_t row, uint64_t old, uint64_t v)
+{
+  move_row(table->hashes->fields[field], row, old, v);
+
+  pthread_mutex_unlock(&table->hashes->lock);
+}
+
+void dense_db_hashindex_begin_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, uint64_t * old)
+{
+  lock_for_write(table);
+
+  dense_db_table_get_column(table, acc, first_row, count, old);
+}
+
+void dense_db_hashindex_end_column(dense_db_table_t * table, int field, uint64_t first_row, size_t count, const uint64_t * old, const uint64_t * in)
+{
+  dense_db_field_hashindex_t * fi = table->hashes->fields[field];
+  uint64_t mask = bits_mask(table->fields[field].size);
+
+  size_t i;
+  for (i = 0; i < count; i++) {
+    move_row(fi, first_row + i, old[i], in[i] & mask);
+  }
+
+  pthread_mutex_unlock(&table->hashes->lock);
+}
+
+void dense_db_hashindex_resize(dense_db_table_t * table, size_t old_rows, size_t rows)
+{
+  dense_db_hashindex_t * hashes = table->hashes;
+
+  // New rows hold 0, which isn't indexed, so only dropped rows matter
+  if (! hashes || rows >= old_rows) return;
+
+  lock_for_write(table);
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    dense_db_field_hashindex_t * fi = hashes->fields[i];
+
+    if (fi) rehash(fi, fi->n_entries, rows);
+  }
+
+  pthread_mutex_unlock(&hashes->lock);
+}
+
+// Readers
+
+static size_t scan_lookup(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t key, uint64_t * rows, size_t max_rows)
+{
+  uint64_t buf[BATCH];
+  uint64_t row;
+  size_t n = 0, i;
+
+  for (row = 0; row < table->rows; row += BATCH) {
+    size_t count = MIN(BATCH, table->rows - row);
+
+    dense_db_table_get_column(table, acc, row, count, buf);
+
+    for (i = 0; i < count; i++) {
+      if (buf[i] != key) continue;
+
+      if (n < max_rows) rows[n] = row + i;
+      n++;
+    }
+  }
+
+  return n;
+}
+
+size_t dense_db_table_hash_lookup(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t key, uint64_t * rows, size_t max_rows)
+{
+  if (acc.field >= table->n_fields || ! dense_db_hashindex_has(table, acc.field) || ! key) return scan_lookup(table, acc, key, rows, max_rows);
+
+  dense_db_hashindex_t * hashes = table->hashes;
+  dense_db_field_hashindex_t * fi = hashes->fields[acc.field];
+  size_t n = 0;
+
+  pthread_mutex_lock(&hashes->lock);
+
+  uint64_t mask = fi->n_slots - 1;
+  uint64_t i;
+
+  for (i = slot_home(fi, key); slot_row(fi, i); i = (i + 1) & mask) {
+    if (slot_key(fi, i) != key) continue;
+
+    if (n < max_rows) rows[n] = slot_row(fi, i) - 1;
+    n++;
+  }
+
+  pthread_mutex_unlock(&hashes->lock);
+
+  return n;
+}
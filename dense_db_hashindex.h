@@ -0,0 +1,81 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DENSE_DB_HASHINDEX_H
+#define DENSE_DB_HASHINDEX_H
+
+#include <pthread.h>
+#include "dense_db.h"
+
+// Hash indexes map the values of a field back to the rows holding them.
+// Each is an open addressing table with linear probing, of a power of two
+// number of slots each holding a value and its row (plus one, so empty
+// slots are all zero), memory mapped from .<name>.<field>.hash in the db's
+// directory.  Rows holding 0, which every new row starts with, aren't
+// indexed.  They're meant for mostly distinct values such as ids: all the
+// rows holding a value share one run of slots, so a value held by many rows
+// slows down lookups of the values hashing near it.
+typedef struct dense_db_field_hashindex {
+  int fd;
+
+  // The file's header followed by n_slots slots of two little endian words
+  uint8_t * map;
+  size_t map_size;
+  uint64_t * slots;
+
+  uint64_t n_slots;
+  uint64_t n_entries;
+} dense_db_field_hashindex_t;
+
+typedef struct dense_db_hashindex {
+  // One per field of the table, NULL for fields without an index
+  dense_db_field_hashindex_t ** fields;
+
+  // Held by writers of indexed fields from reading the old value until
+  // the index is updated, and by lookups
+  pthread_mutex_t lock;
+
+  // As for zone maps: set once the table has changed since the indexes
+  // were loaded or saved, after marking the saved copies stale
+  int dirty;
+  int persist;
+} dense_db_hashindex_t;
+
+// Index the values of a field of at most 64 bits.  As with bitmap indexes
+// the table's header records that it has hash indexes, so every later open
+// maps them back in (rebuilding them if the table may have changed since
+// they were saved).  Create indexes before sharing the table between
+// threads.
+void dense_db_table_create_hash_index(dense_db_table_t * table, char * field);
+
+// Find the rows whose field holds key, storing the first max_rows of them
+// (in no particular order) in rows and returning how many there are.
+// Fields without an index, and key 0, are answered by scanning the field.
+size_t dense_db_table_hash_lookup(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t key, uint64_t * rows, size_t max_rows);
+
+// Used by the table itself, like the dense_db_bmindex_* calls
+void dense_db_hashindex_add(dense_db_table_t * table, int field);
+void dense_db_hashindex_load(dense_db_table_t * table);
+uint64_t dense_db_hashindex_begin(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t row);
+void dense_db_hashindex_end(dense_db_table_t * table, int field, uint64_t row, uint64_t old, uint64_t v);
+void dense_db_hashindex_begin_column(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t first_row, size_t count, uint64_t * old);
+void dense_db_hashindex_end_column(dense_db_table_t * table, int field, uint64_t first_row, size_t count, const uint64_t * old, const uint64_t * in);
+void dense_db_hashindex_resize(dense_db_table_t * table, size_t old_rows, size_t rows);
+void dense_db_hashindex_save(dense_db_table_t * table);
+void dense_db_hashindex_destroy(dense_db_table_t * table);
+
+static inline int dense_db_hashindex_has(dense_db_table_t * table, int field)
+{
+  return table->hashes && table->hashes->fields[field];
+}
+
+#endif
@@ -0,0 +1,189 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <error.h>
+#include <errno.h>
+#include "dense_db.h"
+#include "dense_db_bits.h"
+
+#define ERROR_AT_LINE(fmt, ...) error_at_line(1, errno, __FILE__, __LINE__, fmt , ##__VA_ARGS__)
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+// Rows come from stdin, as either comma separated lines of one value per
+// field, or binary rows laid out like a row codec over every field with
+// little endian words.  Values of fields up to 64 bits are integers (in C
+// notation, so 0x for hex), wider ones are their raw text.
+typedef struct input {
+  dense_db_field_t * fields;
+  size_t n_fields;
+  size_t n_words;
+
+  int binary;
+
+  char * line;
+  size_t line_alloc;
+  size_t line_no;
+} input_t;
+
+static void usage(char * name)
+{
+  printf("Usage - %s [-b] [-p] [-j THREADS] DIR TABLE FIELD:BITS [FIELD:BITS ...] < ROWS\n", name);
+  printf("  -b  read binary rows instead of CSV\n");
+  printf("  -p  use the PAX layout instead of rows\n");
+  printf("  -j  pack and write from THREADS threads\n");
+
+  exit(1);
+}
+
+static void parse_row(input_t * input, char * line, uint64_t * row)
+{
+  memset(row, 0, sizeof(*row) * input->n_words);
+
+  line[strcspn(line, "\r\n")] = '\0';
+
+  char * field = line;
+
+  int i;
+  for (i = 0; i < input->n_fields; i++) {
+    if (! field) error_at_line(1, 0, __FILE__, __LINE__, "Line %zu has %d values, wanted %zu", input->line_no, i, input->n_fields);
+
+    char * next = strchr(field, ',');
+    if (next) *next++ = '\0';
+
+    int size = input->fields[i].size;
+
+    if (size > 64) {
+      memcpy(row, field, MIN(strlen(field), (size + 7) / 8));
+    } else {
+      char * end;
+
+      errno = 0;
+      *row = strtoull(field, &end, 0);
+
+      if (errno || end == field || *end) error_at_line(1, 0, __FILE__, __LINE__, "Line %zu has a bad value for %s: '%s'", input->line_no, input->fields[i].name, field);
+      if (*row & ~bits_mask(size)) error_at_line(1, 0, __FILE__, __LINE__, "Line %zu has %s too big for %d bits", input->line_no, input->fields[i].name, size);
+    }
+
+    row += (size + 63) / 64;
+    field = next;
+  }
+
+  if (field) error_at_line(1, 0, __FILE__, __LINE__, "Line %zu has more than %zu values", input->line_no, input->n_fields);
+}
+
+static size_t read_rows(void * arg, uint64_t * rows, size_t max_rows)
+{
+  input_t * input = arg;
+  size_t n = 0;
+
+  if (input->binary) {
+    size_t row_bytes = sizeof(*rows) * input->n_words;
+    size_t want = row_bytes * max_rows, got = 0, k;
+
+    // Pipes can hand over part of a row at a time
+    while (got < want && (k = fread((uint8_t *)rows + got, 1, want - got, stdin))) got += k;
+
+    if (ferror(stdin)) ERROR_AT_LINE("Error in reading rows");
+    if (got % row_bytes) error_at_line(1, 0, __FILE__, __LINE__, "Input ends partway through a row");
+
+    n = got / row_bytes;
+
+    // Only the integers need swapping, wider fields are bytes already
+    size_t r;
+    for (r = 0; r < n; r++) {
+      uint64_t * row = rows + r * input->n_words;
+
+      int i;
+      for (i = 0; i < input->n_fields; i++) {
+        if (input->fields[i].size <= 64) *row = le64toh(*row);
+
+        row += (input->fields[i].size + 63) / 64;
+      }
+    }
+
+    return n;
+  }
+
+  while (n < max_rows && getline(&input->line, &input->line_alloc, stdin) >= 0) {
+    input->line_no++;
+
+    if (input->line[strspn(input->line, " \t\r\n")] == '\0') continue;
+
+    parse_row(input, input->line, rows + n * input->n_words);
+    n++;
+  }
+
+  if (ferror(stdin)) ERROR_AT_LINE("Error in reading rows");
+
+  return n;
+}
+
+int main(int argc, char ** argv)
+{
+  input_t input = { 0 };
+  int layout = DENSE_DB_LAYOUT_ROW;
+  int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "bpj:")) != -1) {
+    switch (opt) {
+      case 'b': input.binary = 1; break;
+      case 'p': layout = DENSE_DB_LAYOUT_PAX; break;
+      case 'j': n_threads = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (argc - optind < 3 || n_threads < 1) usage(argv[0]);
+
+  char * dir = argv[optind];
+  char * name = argv[optind + 1];
+
+  input.n_fields = argc - optind - 2;
+  input.fields = calloc(sizeof(*input.fields), input.n_fields);
+
+  int i;
+  for (i = 0; i < input.n_fields; i++) {
+    char * spec = argv[optind + 2 + i];
+    char * colon = strrchr(spec, ':');
+
+    if (! colon || atoi(colon + 1) < 1) usage(argv[0]);
+
+    *colon = '\0';
+
+    input.fields[i].name = spec;
+    input.fields[i].size = atoi(colon + 1);
+
+    input.n_words += (input.fields[i].size + 63) / 64;
+  }
+
+  dense_db_t * db = dense_db_new(dir, 1);
+
+  dense_db_table_t * table = dense_db_table_load(db, name, input.fields, input.n_fields, layout, n_threads, read_rows, &input);
+
+  printf("Loaded %zu rows into %s\n", table->rows, table->name);
+
+  dense_db_table_close(table);
+  dense_db_destroy(db);
+
+  free(input.line);
+  free(input.fields);
+
+  return 0;
+}
@@ -0,0 +1,241 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <error.h>
+#include <errno.h>
+#include <pthread.h>
+#include "dense_db.h"
+#include "dense_db_bits.h"
+#include "dense_db_loader.h"
+
+#define ERROR_AT_LINE(fmt, ...) error_at_line(1, errno, __FILE__, __LINE__, fmt , ##__VA_ARGS__)
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+#define round_up_to_n(x, n) ((((x) % (n)) == 0) ? (x) : ((x) + (n) - ((x) % (n))))
+
+// About how many rows each thread packs at once
+#define CHUNK_ROWS (64 * 1024)
+
+typedef struct loader {
+  dense_db_table_t * table;
+
+  int fd;
+
+  dense_db_load_read_t read;
+  void * arg;
+
+  // Rows of each chunk, whose packed size is a multiple of
+  // DENSE_DB_LOAD_ALIGN, and where each field starts in the caller's rows
+  size_t chunk_rows;
+  size_t chunk_bytes;
+  size_t n_words;
+  size_t * slots;
+
+  // Guards everything below, and read
+  pthread_mutex_t lock;
+  uint64_t next_chunk;
+  size_t rows;
+  int done;
+} loader_t;
+
+static size_t gcd(size_t a, size_t b)
+{
+  while (b) {
+    size_t t = a % b;
+    a = b;
+    b = t;
+  }
+
+  return a;
+}
+
+static size_t packed_bytes(dense_db_table_t * table, size_t rows)
+{
+  return (rows + table->block_rows - 1) / table->block_rows * table->block_bits / 8;
+}
+
+// Pack n rows into out, which starts at a block boundary and is zeroed
+static void pack_rows(loader_t * l, const uint64_t * in, size_t n, uint64_t * column, uint8_t * out)
+{
+  dense_db_table_t * table = l->table;
+  uint64_t offset = 0;
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    int size = table->fields[i].size;
+    int k;
+
+    // Fields wider than 64 bits go in 64 bit pieces, from raw bytes
+    for (k = 0; k * 64 < size; k++) {
+      int piece = MIN(size - k * 64, 64);
+      size_t r;
+
+      for (r = 0; r < n; r++) {
+        uint64_t v = in[r * l->n_words + l->slots[i] + k];
+
+        column[r] = size <= 64 ? v : le64toh(v);
+      }
+
+      if (table->layout == DENSE_DB_LAYOUT_ROW) {
+        uint64_t bit = offset + k * 64;
+
+        bits_pack_strided(out + bit / 8, table->block_bits / 8, bit % 8, piece, n, column);
+        continue;
+      }
+
+      size_t first;
+      for (first = 0; first < n; first += table->block_rows) {
+        size_t count = MIN(n - first, table->block_rows);
+        uint64_t bit = first / table->block_rows * table->block_bits + offset * table->block_rows;
+
+        if (size <= 64) {
+          bits_pack_packed(out, bit, size, count, column + first);
+        } else {
+          for (r = 0; r < count; r++) {
+            uint64_t at = bit + r * size + k * 64;
+
+            bits_put(out + at / 8, at % 8, piece, column[first + r]);
+          }
+        }
+      }
+    }
+
+    offset += size;
+  }
+}
+
+static void write_chunk(loader_t * l, const uint8_t * buf, size_t len, off_t offset)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = pwrite(l->fd, buf + done, len - done, offset + done);
+
+    if (n < 0 && errno == EINTR) continue;
+
+    // Some filesystems take O_DIRECT opens but not the writes
+    if (n < 0 && errno == EINVAL && (fcntl(l->fd, F_GETFL) & O_DIRECT)) {
+      if (fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) & ~O_DIRECT) < 0) ERROR_AT_LINE("Error in fcntl");
+      continue;
+    }
+
+    if (n < 0) ERROR_AT_LINE("Error in writing rows of table %s", l->table->name);
+
+    done += n;
+  }
+}
+
+static void * load_thread(void * arg)
+{
+  loader_t * l = arg;
+
+  uint64_t * in = malloc(sizeof(*in) * l->chunk_rows * MAX(l->n_words, 1));
+  uint64_t * column = malloc(sizeof(*column) * l->chunk_rows);
+
+  // Slack past the chunk for the 64 bit words the packers rewrite
+  uint8_t * out;
+  if (posix_memalign((void **)&out, DENSE_DB_LOAD_ALIGN, l->chunk_bytes + DENSE_DB_LOAD_ALIGN)) ERROR_AT_LINE("Error in allocating a load buffer");
+
+  for (;;) {
+    size_t n = 0;
+
+    pthread_mutex_lock(&l->lock);
+
+    uint64_t chunk = l->next_chunk++;
+
+    while (! l->done && n < l->chunk_rows) {
+      size_t got = l->read(l->arg, in + n * l->n_words, l->chunk_rows - n);
+
+      if (! got) l->done = 1;
+
+      n += got;
+    }
+
+    l->rows += n;
+
+    pthread_mutex_unlock(&l->lock);
+
+    if (! n) break;
+
+    memset(out, 0, l->chunk_bytes + DENSE_DB_LOAD_ALIGN);
+
+    pack_rows(l, in, n, column, out);
+
+    write_chunk(l, out, round_up_to_n(packed_bytes(l->table, n), DENSE_DB_LOAD_ALIGN), l->table->header_size + chunk * l->chunk_bytes);
+  }
+
+  free(in);
+  free(column);
+  free(out);
+
+  return NULL;
+}
+
+size_t dense_db_loader_write(dense_db_table_t * table, const char * path, int n_threads, dense_db_load_read_t read, void * arg)
+{
+  loader_t l = { 0 };
+
+  l.table = table;
+  l.read = read;
+  l.arg = arg;
+
+  // Without O_DIRECT the writes still skip faulting in every page
+  l.fd = open(path, O_WRONLY | O_DIRECT);
+  if (l.fd < 0 && errno == EINVAL) l.fd = open(path, O_WRONLY);
+  if (l.fd < 0) ERROR_AT_LINE("Error in opening %s", path);
+
+  l.slots = calloc(sizeof(*l.slots), MAX(table->n_fields, 1));
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    l.slots[i] = l.n_words;
+    l.n_words += (table->fields[i].size + 63) / 64;
+  }
+
+  // Chunks are whole blocks adding up to whole pages
+  size_t block_bytes = table->block_bits / 8;
+  size_t unit_rows = table->block_rows * (DENSE_DB_LOAD_ALIGN / gcd(MAX(block_bytes, 1), DENSE_DB_LOAD_ALIGN));
+
+  l.chunk_rows = unit_rows * MAX(CHUNK_ROWS / unit_rows, 1);
+  l.chunk_bytes = packed_bytes(table, l.chunk_rows);
+
+  pthread_mutex_init(&l.lock, NULL);
+
+  n_threads = MAX(n_threads, 1);
+
+  pthread_t threads[n_threads];
+
+  for (i = 0; i < n_threads; i++) {
+    if ((errno = pthread_create(threads + i, NULL, load_thread, &l))) ERROR_AT_LINE("Error in starting a load thread");
+  }
+
+  for (i = 0; i < n_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&l.lock);
+
+  if (fdatasync(l.fd) < 0) ERROR_AT_LINE("Error in fdatasync");
+  if (close(l.fd) < 0) ERROR_AT_LINE("Error in close");
+
+  free(l.slots);
+
+  return l.rows;
+}
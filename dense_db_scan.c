@@ -0,0 +1,331 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <error.h>
+#include <errno.h>
+#include <unistd.h>
+#include "dense_db.h"
+#include "dense_db_scan.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+#define ERROR_AT_LINE(fmt, ...) error_at_line(1, errno, __FILE__, __LINE__, fmt , ##__VA_ARGS__)
+
+#define CACHE_LINE 64
+
+// How much table data a chunk covers when the caller doesn't say
+#define DEFAULT_CHUNK_BYTES (256 * 1024)
+
+// The chunks a worker still owns, [next, end) of the scan's chunk list.
+// Others steal from the end, the owner takes from the front.
+typedef struct pool_deque {
+  pthread_mutex_t lock;
+
+  size_t next;
+  size_t end;
+} pool_deque_t;
+
+struct dense_db_pool {
+  int n_threads;
+
+  // n_threads - 1 helpers, the thread calling dense_db_table_scan is worker 0
+  pthread_t * threads;
+  pool_deque_t * deques;
+
+  // Held for the length of a scan, a pool runs one at a time
+  pthread_mutex_t scan_lock;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+
+  uint64_t generation;
+  int running;
+  int shutdown;
+
+  // The current scan, chunk i is rows [bounds[i], bounds[i + 1])
+  dense_db_table_t * table;
+  uint64_t * bounds;
+  dense_db_scan_cb cb;
+  void * arg;
+};
+
+typedef struct pool_worker {
+  dense_db_pool_t * pool;
+  int id;
+} pool_worker_t;
+
+static int take_chunk(dense_db_pool_t * pool, int id, size_t * chunk)
+{
+  pool_deque_t * own = pool->deques + id;
+
+  pthread_mutex_lock(&own->lock);
+
+  int found = own->next < own->end;
+  if (found) *chunk = own->next++;
+
+  pthread_mutex_unlock(&own->lock);
+
+  if (found) return 1;
+
+  // Out of work, take the back half of the first victim that has some left
+  int i;
+  for (i = 1; i < pool->n_threads; i++) {
+    pool_deque_t * victim = pool->deques + (id + i) % pool->n_threads;
+
+    size_t from = 0, to = 0;
+
+    pthread_mutex_lock(&victim->lock);
+
+    if (victim->next < victim->end) {
+      from = victim->next + (victim->end - victim->next) / 2;
+      to = victim->end;
+
+      victim->end = from;
+    }
+
+    pthread_mutex_unlock(&victim->lock);
+
+    if (from < to) {
+      *chunk = from;
+
+      pthread_mutex_lock(&own->lock);
+      own->next = from + 1;
+      own->end = to;
+      pthread_mutex_unlock(&own->lock);
+
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void run_worker(dense_db_pool_t * pool, int id)
+{
+  size_t chunk;
+
+  while (take_chunk(pool, id, &chunk)) {
+    uint64_t first = pool->bounds[chunk];
+
+    pool->cb(pool->table, first, pool->bounds[chunk + 1] - first, id, pool->arg);
+  }
+}
+
+static void * pool_thread(void * arg)
+{
+  pool_worker_t * worker = arg;
+  dense_db_pool_t * pool = worker->pool;
+
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+
+  for (;;) {
+    while (pool->generation == seen && ! pool->shutdown) pthread_cond_wait(&pool->start, &pool->lock);
+
+    if (pool->shutdown) break;
+
+    seen = pool->generation;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    run_worker(pool, worker->id);
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (--pool->running == 0) pthread_cond_signal(&pool->done);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  free(worker);
+
+  return NULL;
+}
+
+dense_db_pool_t * dense_db_pool_new(int n_threads)
+{
+  dense_db_pool_t * pool = calloc(sizeof(*pool), 1);
+
+  pool->n_threads = MAX(n_threads, 1);
+  pool->threads = calloc(sizeof(*pool->threads), pool->n_threads);
+  pool->deques = calloc(sizeof(*pool->deques), pool->n_threads);
+
+  pthread_mutex_init(&pool->scan_lock, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  int i;
+  for (i = 0; i < pool->n_threads; i++) {
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+  }
+
+  for (i = 1; i < pool->n_threads; i++) {
+    pool_worker_t * worker = malloc(sizeof(*worker));
+
+    worker->pool = pool;
+    worker->id = i;
+
+    if (pthread_create(pool->threads + i, NULL, pool_thread, worker)) ERROR_AT_LINE("Error in pthread_create");
+  }
+
+  return pool;
+}
+
+int dense_db_pool_size(dense_db_pool_t * pool)
+{
+  return pool->n_threads;
+}
+
+void dense_db_pool_destroy(dense_db_pool_t * pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  int i;
+  for (i = 1; i < pool->n_threads; i++) {
+    if (pthread_join(pool->threads[i], NULL)) ERROR_AT_LINE("Error in pthread_join");
+  }
+
+  for (i = 0; i < pool->n_threads; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+  }
+
+  pthread_mutex_destroy(&pool->scan_lock);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+
+  free(pool->threads);
+  free(pool->deques);
+  free(pool);
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+  while (b) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+
+  return a;
+}
+
+// Chunks may only start on rows r0 + k * period, rows at a block boundary
+// whose first bit starts a page of the mapping.  A page is a whole number
+// of 64 bit words, so no two chunks share one.  Where a page apart is
+// further than the chunks want to be, cache lines and then words will do.
+// Tables from before headers were padded may not put any block on a word,
+// then *period is 0 and the chunks have to run one after another.
+static void scan_alignment(dense_db_table_t * table, size_t chunk_rows, uint64_t * r0, uint64_t * period)
+{
+  uint64_t units[] = { sysconf(_SC_PAGESIZE) * 8, CACHE_LINE * 8, 64 };
+
+  uint64_t start = table->header_size * 8;
+
+  *r0 = 0;
+  *period = 0;
+
+  int i;
+  for (i = 0; i < 3; i++) {
+    uint64_t blocks = units[i] / gcd(table->block_bits, units[i]);
+
+    uint64_t k;
+    for (k = 0; k < blocks; k++) {
+      if ((start + k * table->block_bits) % units[i] == 0) {
+        *r0 = k * table->block_rows;
+        *period = blocks * table->block_rows;
+        break;
+      }
+    }
+
+    if (*period && *period <= chunk_rows) return;
+  }
+}
+
+// The first row at or after row that a chunk may start on
+static uint64_t next_boundary(uint64_t row, uint64_t r0, uint64_t period)
+{
+  if (row <= r0) return r0;
+
+  return r0 + (row - r0 + period - 1) / period * period;
+}
+
+void dense_db_table_scan(dense_db_pool_t * pool, dense_db_table_t * table, uint64_t first_row, size_t count, size_t chunk_rows, dense_db_scan_cb cb, void * arg)
+{
+  if (! count) return;
+
+  if (! chunk_rows) chunk_rows = MAX(1, DEFAULT_CHUNK_BYTES * 8 * table->block_rows / table->block_bits);
+
+  uint64_t r0, period;
+  scan_alignment(table, chunk_rows, &r0, &period);
+
+  // With nowhere safe to split, the helpers sit the scan out
+  int n_workers = period ? pool->n_threads : 1;
+
+  uint64_t end = first_row + count;
+
+  size_t n_chunks = 0, cap = 16;
+  uint64_t * bounds = malloc(sizeof(*bounds) * cap);
+
+  uint64_t row = first_row;
+  while (row < end) {
+    if (n_chunks + 2 > cap) bounds = realloc(bounds, sizeof(*bounds) * (cap *= 2));
+
+    bounds[n_chunks++] = row;
+
+    row = MIN(period ? next_boundary(row + chunk_rows, r0, period) : row + chunk_rows, end);
+  }
+
+  bounds[n_chunks] = end;
+
+  pthread_mutex_lock(&pool->scan_lock);
+
+  pool->table = table;
+  pool->bounds = bounds;
+  pool->cb = cb;
+  pool->arg = arg;
+
+  // Hand out contiguous runs of chunks, the stealing evens things out
+  int i;
+  for (i = 0; i < pool->n_threads; i++) {
+    pool->deques[i].next = i < n_workers ? n_chunks * i / n_workers : 0;
+    pool->deques[i].end = i < n_workers ? n_chunks * (i + 1) / n_workers : 0;
+  }
+
+  if (n_workers > 1) {
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pool->running = pool->n_threads - 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  run_worker(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running) pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+
+  pthread_mutex_unlock(&pool->scan_lock);
+
+  free(bounds);
+}
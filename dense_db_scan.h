@@ -0,0 +1,41 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DENSE_DB_SCAN_H
+#define DENSE_DB_SCAN_H
+
+#include "dense_db.h"
+
+// A fixed set of worker threads that scans are run on
+typedef struct dense_db_pool dense_db_pool_t;
+
+// Called for each chunk of a scan.  worker is in [0, dense_db_pool_size())
+// and no two chunks run on the same worker at once, so it can index
+// per-thread state.
+typedef void (* dense_db_scan_cb)(dense_db_table_t * table, uint64_t first_row, size_t count, int worker, void * arg);
+
+dense_db_pool_t * dense_db_pool_new(int n_threads);
+int dense_db_pool_size(dense_db_pool_t * pool);
+void dense_db_pool_destroy(dense_db_pool_t * pool);
+
+// Runs cb over count rows from first_row, split into chunks of roughly
+// chunk_rows rows (0 picks a size) that the pool's workers take from each
+// other as they run out.  Chunks start on pages of the data, or on cache
+// lines or words when pages are too far apart (always at block boundaries
+// for PAX tables), so two chunks never share a 64 bit word and each
+// callback may write to its own rows with the ordinary setters.  Old tables
+// that put no row on a word have their chunks run one at a time on the
+// calling thread.  The calling thread works on the scan too, and it returns
+// once every chunk is done.
+void dense_db_table_scan(dense_db_pool_t * pool, dense_db_table_t * table, uint64_t first_row, size_t count, size_t chunk_rows, dense_db_scan_cb cb, void * arg);
+
+#endif
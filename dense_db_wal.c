@@ -0,0 +1,487 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <error.h>
+#include <errno.h>
+#include "dense_db.h"
+#include "dense_db_wal.h"
+
+#define ERROR_AT_LINE(fmt, ...) error_at_line(1, errno, __FILE__, __LINE__, fmt , ##__VA_ARGS__)
+
+#define WAL_NAME "dense_db.wal"
+
+// Each record is one batch:
+//   magic:32 n_ops:32 len:64 checksum:64 then len bytes of ops
+// and each op is:
+//   table name length:16, table name, field name length:16, field name,
+//   row:64, size:32 then the value's (size + 7) / 8 little endian bytes
+// Names rather than offsets keep the log meaningful whatever happens to the
+// accessors.  Numbers are big endian, like the table headers.
+#define RECORD_MAGIC 0x44574131
+#define RECORD_HEADER 24
+
+struct dense_db_wal {
+  int fd;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  // Bytes of log written, known durable, and applied to the tables.  A
+  // batch is applied once everything before it has been.
+  uint64_t written;
+  uint64_t synced;
+  uint64_t applied;
+
+  // Whether a committer is syncing on behalf of everyone waiting
+  int syncing;
+};
+
+typedef struct batch_op {
+  dense_db_table_t * table;
+  dense_db_accessor_t acc;
+  uint64_t row;
+
+  // Where the value starts in the batch's buffer
+  size_t value;
+} batch_op_t;
+
+struct dense_db_batch {
+  dense_db_t * db;
+
+  uint8_t * buf;
+  size_t len;
+  size_t alloc;
+
+  batch_op_t * ops;
+  size_t n_ops;
+  size_t alloc_ops;
+};
+
+static uint64_t checksum(const uint8_t * data, size_t len)
+{
+  // FNV-1a, enough to spot a torn tail
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  size_t i;
+  for (i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static uint8_t * batch_reserve(dense_db_batch_t * batch, size_t len)
+{
+  if (batch->len + len > batch->alloc) {
+    batch->alloc = (batch->len + len) * 2;
+    batch->buf = realloc(batch->buf, batch->alloc);
+  }
+
+  uint8_t * ptr = batch->buf + batch->len;
+
+  batch->len += len;
+
+  return ptr;
+}
+
+static void batch_put(dense_db_batch_t * batch, const void * data, size_t len)
+{
+  memcpy(batch_reserve(batch, len), data, len);
+}
+
+static void batch_put_be16(dense_db_batch_t * batch, uint16_t val)
+{
+  val = htobe16(val);
+  batch_put(batch, &val, 2);
+}
+
+static void batch_put_be32(dense_db_batch_t * batch, uint32_t val)
+{
+  val = htobe32(val);
+  batch_put(batch, &val, 4);
+}
+
+static void batch_put_be64(dense_db_batch_t * batch, uint64_t val)
+{
+  val = htobe64(val);
+  batch_put(batch, &val, 8);
+}
+
+static const char * field_name(dense_db_table_t * table, dense_db_accessor_t acc)
+{
+  size_t offset = 0;
+
+  int i;
+  for (i = 0; i < table->n_fields; i++) {
+    if (offset == acc.offset && table->fields[i].size == acc.size) return table->fields[i].name;
+
+    offset += table->fields[i].size;
+  }
+
+  error_at_line(1, 0, __FILE__, __LINE__, "No field of table %s at bit %d", table->name, acc.offset);
+
+  return NULL;
+}
+
+dense_db_batch_t * dense_db_batch_new(dense_db_t * db)
+{
+  dense_db_batch_t * batch = calloc(sizeof(*batch), 1);
+
+  batch->db = db;
+  batch_reserve(batch, RECORD_HEADER);
+
+  return batch;
+}
+
+void dense_db_batch_destroy(dense_db_batch_t * batch)
+{
+  free(batch->buf);
+  free(batch->ops);
+  free(batch);
+}
+
+void dense_db_batch_set(dense_db_batch_t * batch, dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, void * in)
+{
+  assert(table->db == batch->db);
+
+  const char * field = field_name(table, acc);
+
+  batch_put_be16(batch, strlen(table->name));
+  batch_put(batch, table->name, strlen(table->name));
+  batch_put_be16(batch, strlen(field));
+  batch_put(batch, field, strlen(field));
+  batch_put_be64(batch, row);
+  batch_put_be32(batch, acc.size);
+
+  if (batch->n_ops == batch->alloc_ops) {
+    batch->alloc_ops = batch->alloc_ops ? batch->alloc_ops * 2 : 16;
+    batch->ops = realloc(batch->ops, sizeof(*batch->ops) * batch->alloc_ops);
+  }
+
+  batch_op_t * op = batch->ops + batch->n_ops++;
+
+  op->table = table;
+  op->acc = acc;
+  op->row = row;
+  op->value = batch->len;
+
+  batch_put(batch, in, (acc.size + 7) / 8);
+}
+
+void dense_db_batch_set_int(dense_db_batch_t * batch, dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, uint64_t in)
+{
+  assert(acc.size <= 64);
+
+  uint64_t num = htole64(in & acc.mask);
+
+  dense_db_batch_set(batch, table, row, acc, &num);
+}
+
+static void batch_apply(dense_db_batch_t * batch)
+{
+  size_t i;
+  for (i = 0; i < batch->n_ops; i++) {
+    batch_op_t * op = batch->ops + i;
+
+    dense_db_table_set(op->table, op->row, op->acc, batch->buf + op->value);
+  }
+}
+
+static void batch_reset(dense_db_batch_t * batch)
+{
+  batch->len = RECORD_HEADER;
+  batch->n_ops = 0;
+}
+
+static void write_all(int fd, const uint8_t * data, size_t len)
+{
+  while (len) {
+    ssize_t n = write(fd, data, len);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+
+      ERROR_AT_LINE("Error in writing the wal");
+    }
+
+    data += n;
+    len -= n;
+  }
+}
+
+void dense_db_batch_commit(dense_db_batch_t * batch)
+{
+  struct dense_db_wal * wal = batch->db->wal;
+
+  if (! batch->n_ops) return;
+
+  if (! wal) {
+    batch_apply(batch);
+    batch_reset(batch);
+    return;
+  }
+
+  uint8_t * ptr = batch->buf;
+  uint32_t buf32;
+  uint64_t buf64;
+
+  buf32 = htobe32(RECORD_MAGIC);
+  memcpy(ptr, &buf32, 4);
+  buf32 = htobe32(batch->n_ops);
+  memcpy(ptr + 4, &buf32, 4);
+  buf64 = htobe64(batch->len - RECORD_HEADER);
+  memcpy(ptr + 8, &buf64, 8);
+  buf64 = htobe64(checksum(batch->buf + RECORD_HEADER, batch->len - RECORD_HEADER));
+  memcpy(ptr + 16, &buf64, 8);
+
+  pthread_mutex_lock(&wal->lock);
+
+  write_all(wal->fd, batch->buf, batch->len);
+
+  uint64_t start = wal->written;
+  uint64_t end = start + batch->len;
+
+  wal->written = end;
+
+  // Group commit: whoever finds no sync running syncs everything written so
+  // far, the rest wait for it
+  while (wal->synced < end) {
+    if (wal->syncing) {
+      pthread_cond_wait(&wal->cond, &wal->lock);
+      continue;
+    }
+
+    uint64_t target = wal->written;
+
+    wal->syncing = 1;
+    pthread_mutex_unlock(&wal->lock);
+
+    if (fdatasync(wal->fd) < 0) ERROR_AT_LINE("Error in syncing the wal");
+
+    pthread_mutex_lock(&wal->lock);
+    wal->syncing = 0;
+    wal->synced = target;
+    pthread_cond_broadcast(&wal->cond);
+  }
+
+  // Apply in log order, so the tables end up as a replay would leave them.
+  // Only the order needs the lock: the sets themselves run without it, so
+  // later commits can write and sync the log meanwhile.
+  while (wal->applied != start) pthread_cond_wait(&wal->cond, &wal->lock);
+
+  pthread_mutex_unlock(&wal->lock);
+
+  batch_apply(batch);
+
+  pthread_mutex_lock(&wal->lock);
+
+  wal->applied = end;
+  pthread_cond_broadcast(&wal->cond);
+
+  pthread_mutex_unlock(&wal->lock);
+
+  batch_reset(batch);
+}
+
+static int table_exists(dense_db_t * db, const char * name)
+{
+  char * path;
+  assert(asprintf(&path, "%s/%s", db->storage_path, name) > 0);
+
+  struct stat sb;
+  int exists = stat(path, &sb) == 0;
+
+  free(path);
+
+  return exists;
+}
+
+// Read a length prefixed name into a NUL terminated one
+static char * get_name(const uint8_t ** ptr, const uint8_t * end)
+{
+  uint16_t len;
+
+  if (*ptr + 2 > end) return NULL;
+
+  memcpy(&len, *ptr, 2);
+  len = be16toh(len);
+  *ptr += 2;
+
+  if (*ptr + len > end) return NULL;
+
+  char * name = strndup((const char *)*ptr, len);
+  *ptr += len;
+
+  return name;
+}
+
+// Apply one record's ops.  Ops on tables or fields that no longer exist, or
+// on rows past a table's end, are skipped.
+static void replay_record(dense_db_t * db, const uint8_t * ptr, const uint8_t * end, uint32_t n_ops)
+{
+  uint32_t i;
+  for (i = 0; i < n_ops; i++) {
+    char * table_name = get_name(&ptr, end);
+    char * field = get_name(&ptr, end);
+
+    uint64_t row;
+    uint32_t size;
+
+    assert(table_name && field && ptr + 12 <= end);
+
+    memcpy(&row, ptr, 8);
+    memcpy(&size, ptr + 8, 4);
+    ptr += 12;
+
+    row = be64toh(row);
+    size = be32toh(size);
+
+    const uint8_t * value = ptr;
+    ptr += (size + 7) / 8;
+
+    assert(ptr <= end);
+
+    if (table_exists(db, table_name)) {
+      dense_db_table_t * table = dense_db_table_open(db, table_name);
+      dense_db_accessor_t acc = dense_db_table_get_accessor(table, field);
+
+      if (acc.size == size && row < table->rows) dense_db_table_set(table, row, acc, (void *)value);
+
+      dense_db_table_close(table);
+    }
+
+    free(table_name);
+    free(field);
+  }
+}
+
+// Apply every whole record in the log, stopping at a torn one
+static void replay(dense_db_t * db, int fd)
+{
+  struct stat sb;
+  if (fstat(fd, &sb) < 0) ERROR_AT_LINE("Error in stat of the wal");
+
+  size_t size = sb.st_size;
+  uint8_t * data = malloc(size + 1);
+
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(fd, data + done, size - done, done);
+
+    if (n < 0) ERROR_AT_LINE("Error in reading the wal");
+    if (n == 0) break;
+
+    done += n;
+  }
+
+  const uint8_t * ptr = data, * end = data + done;
+
+  while (ptr + RECORD_HEADER <= end) {
+    uint32_t magic, n_ops;
+    uint64_t len, sum;
+
+    memcpy(&magic, ptr, 4);
+    memcpy(&n_ops, ptr + 4, 4);
+    memcpy(&len, ptr + 8, 8);
+    memcpy(&sum, ptr + 16, 8);
+
+    len = be64toh(len);
+
+    if (be32toh(magic) != RECORD_MAGIC || len > end - ptr - RECORD_HEADER) break;
+    if (be64toh(sum) != checksum(ptr + RECORD_HEADER, len)) break;
+
+    replay_record(db, ptr + RECORD_HEADER, ptr + RECORD_HEADER + len, be32toh(n_ops));
+
+    ptr += RECORD_HEADER + len;
+  }
+
+  free(data);
+}
+
+void dense_db_enable_wal(dense_db_t * db)
+{
+  if (db->wal) return;
+
+  char * path;
+  assert(asprintf(&path, "%s/%s", db->storage_path, WAL_NAME) > 0);
+
+  int fd;
+  if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR)) < 0) ERROR_AT_LINE("Error in opening the wal %s", path);
+
+  free(path);
+
+  struct dense_db_wal * wal = calloc(sizeof(*wal), 1);
+
+  wal->fd = fd;
+
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_cond_init(&wal->cond, NULL);
+
+  replay(db, fd);
+
+  db->wal = wal;
+
+  dense_db_checkpoint(db);
+}
+
+void dense_db_checkpoint(dense_db_t * db)
+{
+  struct dense_db_wal * wal = db->wal;
+
+  if (! wal) {
+    dense_db_sync(db);
+    return;
+  }
+
+  pthread_mutex_lock(&wal->lock);
+
+  // Let the commits already in the log reach the tables
+  while (wal->applied != wal->written || wal->syncing) pthread_cond_wait(&wal->cond, &wal->lock);
+
+  dense_db_sync(db);
+
+  if (ftruncate(wal->fd, 0) < 0) ERROR_AT_LINE("Error in truncating the wal");
+  if (fsync(wal->fd) < 0) ERROR_AT_LINE("Error in syncing the wal");
+
+  wal->written = wal->synced = wal->applied = 0;
+
+  pthread_mutex_unlock(&wal->lock);
+}
+
+void dense_db_wal_close(dense_db_t * db)
+{
+  struct dense_db_wal * wal = db->wal;
+
+  if (! wal) return;
+
+  dense_db_checkpoint(db);
+
+  db->wal = NULL;
+
+  if (close(wal->fd) < 0) ERROR_AT_LINE("Error in closing the wal");
+
+  pthread_mutex_destroy(&wal->lock);
+  pthread_cond_destroy(&wal->cond);
+
+  free(wal);
+}
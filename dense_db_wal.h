@@ -0,0 +1,44 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DENSE_DB_WAL_H
+#define DENSE_DB_WAL_H
+
+#include "dense_db.h"
+
+// Sets to apply together, across fields, rows and tables of one db.  With
+// the write ahead log enabled, a committed batch survives a crash whole or
+// not at all.
+typedef struct dense_db_batch dense_db_batch_t;
+
+// Log batches to storage_path/dense_db.wal before applying them.  Whatever
+// an earlier process left in the log is replayed first.
+void dense_db_enable_wal(dense_db_t * db);
+
+// Sync every table and empty the log.  Commits wait while it runs.
+void dense_db_checkpoint(dense_db_t * db);
+
+dense_db_batch_t * dense_db_batch_new(dense_db_t * db);
+void dense_db_batch_destroy(dense_db_batch_t * batch);
+
+// The tables must stay open until the batch is committed
+void dense_db_batch_set(dense_db_batch_t * batch, dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, void * in);
+void dense_db_batch_set_int(dense_db_batch_t * batch, dense_db_table_t * table, uint64_t row, dense_db_accessor_t acc, uint64_t in);
+
+// Make the batch durable, then apply it to the tables and empty it.
+// Concurrent commits share their log syncs, and are applied in log order.
+void dense_db_batch_commit(dense_db_batch_t * batch);
+
+// Checkpoint and close the log, called from dense_db_destroy
+void dense_db_wal_close(dense_db_t * db);
+
+#endif
@@ -0,0 +1,395 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <error.h>
+#include <errno.h>
+#include "dense_db.h"
+#include "dense_db_zonemap.h"
+
+#define ERROR_AT_LINE(fmt, ...) error_at_line(1, errno, __FILE__, __LINE__, fmt , ##__VA_ARGS__)
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+// The saved map is:
+//   magic[8] state:32 n_fields:32 rows:64 zone_shift:32 padding:32
+// in big endian, like the table headers, then each zone's min:64 max:64
+// seen:64 in little endian.  state is only ZONES_CLEAN once the zones are
+// written and synced, and goes back to ZONES_DIRTY before the table next
+// changes, so a map that might be stale is never loaded.
+#define ZONES_MAGIC "DBZONES"
+#define ZONES_HEADER 32
+#define ZONES_STATE_OFFSET 8
+#define ZONES_DIRTY 0
+#define ZONES_CLEAN 1
+
+// IN predicates with more values than this aren't worth checking per zone
+#define ZONE_MAX_SET 64
+
+static char * zones_path(dense_db_table_t * table)
+{
+  char * path;
+  assert(asprintf(&path, "%s/.%s.zones", table->db->storage_path, table->name) > 0);
+
+  return path;
+}
+
+// Zones of fields too wide to track bound nothing
+static void zone_reset(dense_db_table_t * table, dense_db_zone_t * zone, int field)
+{
+  int wide = table->fields[field].size > 64;
+
+  zone->min = 0;
+  zone->max = wide ? ~0ull : 0;
+  zone->seen = wide ? ~0ull : 1;
+}
+
+static void zones_grow(dense_db_zonemap_t * zm, size_t n_zones, size_t n_fields)
+{
+  if (n_zones <= zm->alloc) return;
+
+  zm->alloc = MAX(n_zones, zm->alloc * 2);
+  zm->zones = realloc(zm->zones, sizeof(*zm->zones) * zm->alloc * n_fields);
+}
+
+static void zones_build(dense_db_table_t * table, dense_db_zonemap_t * zm)
+{
+  uint64_t * buf = malloc(sizeof(*buf) * DENSE_DB_ZONE_ROWS);
+
+  size_t z;
+  for (z = 0; z < zm->n_zones; z++) {
+    uint64_t first = z << DENSE_DB_ZONE_SHIFT;
+    size_t n = MIN(DENSE_DB_ZONE_ROWS, table->rows - first);
+
+    int i;
+    for (i = 0; i < table->n_fields; i++) {
+      dense_db_zone_t * zone = zm->zones + z * table->n_fields + i;
+
+      zone_reset(table, zone, i);
+
+      if (table->fields[i].size > 64) continue;
+
+      dense_db_table_get_column(table, dense_db_table_get_accessor(table, table->fields[i].name), first, n, buf);
+
+      zone->min = zone->max = buf[0];
+      zone->seen = 0;
+
+      size_t k;
+      for (k = 0; k < n; k++) {
+        zone->min = MIN(zone->min, buf[k]);
+        zone->max = MAX(zone->max, buf[k]);
+        zone->seen |= 1ull << (buf[k] & 63);
+      }
+    }
+  }
+
+  free(buf);
+}
+
+static int read_all(int fd, void * buf, size_t len, off_t offset)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = pread(fd, (char *)buf + done, len - done, offset + done);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+
+    done += n;
+  }
+
+  return 1;
+}
+
+static void write_all(int fd, const void * buf, size_t len, off_t offset)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = pwrite(fd, (const char *)buf + done, len - done, offset + done);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+
+      ERROR_AT_LINE("Error in writing a zone map");
+    }
+
+    done += n;
+  }
+}
+
+// Load the saved map if it's clean and matches the table
+static int zones_load(dense_db_table_t * table, dense_db_zonemap_t * zm)
+{
+  char * path = zones_path(table);
+  int fd = open(path, O_RDONLY);
+
+  free(path);
+
+  if (fd < 0) return 0;
+
+  uint8_t header[ZONES_HEADER];
+  size_t len = zm->n_zones * table->n_fields * sizeof(*zm->zones);
+  int ok = read_all(fd, header, sizeof(header), 0);
+
+  uint32_t state, n_fields, shift;
+  uint64_t rows;
+
+  memcpy(&state, header + 8, 4);
+  memcpy(&n_fields, header + 12, 4);
+  memcpy(&rows, header + 16, 8);
+  memcpy(&shift, header + 24, 4);
+
+  ok = ok && memcmp(header, ZONES_MAGIC, sizeof(ZONES_MAGIC)) == 0;
+  ok = ok && be32toh(state) == ZONES_CLEAN && be32toh(n_fields) == table->n_fields;
+  ok = ok && be64toh(rows) == table->rows && be32toh(shift) == DENSE_DB_ZONE_SHIFT;
+  ok = ok && read_all(fd, zm->zones, len, ZONES_HEADER);
+
+  if (close(fd) < 0) ERROR_AT_LINE("Error in close");
+
+  if (! ok) return 0;
+
+  size_t i;
+  for (i = 0; i < zm->n_zones * table->n_fields; i++) {
+    zm->zones[i].min = le64toh(zm->zones[i].min);
+    zm->zones[i].max = le64toh(zm->zones[i].max);
+    zm->zones[i].seen = le64toh(zm->zones[i].seen);
+  }
+
+  return 1;
+}
+
+dense_db_zonemap_t * dense_db_zonemap_new(dense_db_table_t * table)
+{
+  dense_db_zonemap_t * zm = calloc(sizeof(*zm), 1);
+
+  zm->n_zones = (table->rows + DENSE_DB_ZONE_ROWS - 1) >> DENSE_DB_ZONE_SHIFT;
+  zones_grow(zm, MAX(zm->n_zones, 1), table->n_fields);
+
+  // v1 headers can't record that the table has a map, so writers that
+  // don't know about it could make a saved one stale
+  zm->persist = table->version >= 2 && ! table->snapshot;
+
+  // Maps that are never saved never need marking either
+  if (! zm->persist || ! zones_load(table, zm)) {
+    zones_build(table, zm);
+
+    zm->dirty = 1;
+  }
+
+  pthread_mutex_init(&zm->lock, NULL);
+
+  return zm;
+}
+
+void dense_db_zonemap_mark_dirty(dense_db_table_t * table)
+{
+  dense_db_zonemap_t * zm = table->zones;
+
+  pthread_mutex_lock(&zm->lock);
+
+  if (! zm->dirty) {
+    char * path = zones_path(table);
+    int fd = open(path, O_WRONLY);
+
+    free(path);
+
+    // The saved map has to be known stale before the table changes
+    if (fd >= 0) {
+      uint32_t state = htobe32(ZONES_DIRTY);
+
+      write_all(fd, &state, sizeof(state), ZONES_STATE_OFFSET);
+
+      if (fdatasync(fd) < 0) ERROR_AT_LINE("Error in sync");
+      if (close(fd) < 0) ERROR_AT_LINE("Error in close");
+    }
+
+    __atomic_store_n(&zm->dirty, 1, __ATOMIC_RELEASE);
+  }
+
+  pthread_mutex_unlock(&zm->lock);
+}
+
+void dense_db_zonemap_set_column(dense_db_table_t * table, int field, uint64_t first_row, size_t count, const uint64_t * in, uint64_t mask)
+{
+  if (! table->zones || ! count) return;
+
+  while (count) {
+    size_t n = MIN(count, DENSE_DB_ZONE_ROWS - (first_row & (DENSE_DB_ZONE_ROWS - 1)));
+
+    uint64_t min = in[0] & mask, max = min, seen = 0;
+
+    size_t k;
+    for (k = 0; k < n; k++) {
+      uint64_t v = in[k] & mask;
+
+      min = MIN(min, v);
+      max = MAX(max, v);
+      seen |= 1ull << (v & 63);
+    }
+
+    dense_db_zone_merge(table->zones->zones + (first_row >> DENSE_DB_ZONE_SHIFT) * table->n_fields + field, min, max, seen);
+
+    first_row += n;
+    in += n;
+    count -= n;
+  }
+}
+
+void dense_db_zonemap_resize(dense_db_table_t * table, size_t old_rows, size_t rows)
+{
+  dense_db_zonemap_t * zm = table->zones;
+
+  if (! zm) return;
+
+  size_t n_zones = (rows + DENSE_DB_ZONE_ROWS - 1) >> DENSE_DB_ZONE_SHIFT;
+  size_t z;
+  int i;
+
+  zones_grow(zm, n_zones, table->n_fields);
+
+  // New rows read as zero
+  if (rows > old_rows) {
+    for (z = old_rows >> DENSE_DB_ZONE_SHIFT; z < MIN(zm->n_zones, n_zones); z++) {
+      for (i = 0; i < table->n_fields; i++) {
+        dense_db_zone_merge(zm->zones + z * table->n_fields + i, 0, 0, 1);
+      }
+    }
+  }
+
+  for (z = zm->n_zones; z < n_zones; z++) {
+    for (i = 0; i < table->n_fields; i++) {
+      zone_reset(table, zm->zones + z * table->n_fields + i, i);
+    }
+  }
+
+  zm->n_zones = n_zones;
+}
+
+void dense_db_zonemap_save(dense_db_table_t * table)
+{
+  dense_db_zonemap_t * zm = table->zones;
+
+  if (! zm->persist || ! zm->dirty) return;
+
+  char * path = zones_path(table);
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+
+  if (fd < 0) ERROR_AT_LINE("Error in saving the zone map of %s", table->name);
+
+  free(path);
+
+  uint8_t header[ZONES_HEADER] = { 0 };
+  uint32_t state = htobe32(ZONES_DIRTY), n_fields = htobe32(table->n_fields), shift = htobe32(DENSE_DB_ZONE_SHIFT);
+  uint64_t rows = htobe64(table->rows);
+
+  memcpy(header, ZONES_MAGIC, sizeof(ZONES_MAGIC));
+  memcpy(header + 8, &state, 4);
+  memcpy(header + 12, &n_fields, 4);
+  memcpy(header + 16, &rows, 8);
+  memcpy(header + 24, &shift, 4);
+
+  write_all(fd, header, sizeof(header), 0);
+
+  size_t n = zm->n_zones * table->n_fields;
+  uint64_t * buf = malloc(sizeof(*zm->zones) * n + 1);
+
+  size_t i;
+  for (i = 0; i < n; i++) {
+    buf[i * 3] = htole64(zm->zones[i].min);
+    buf[i * 3 + 1] = htole64(zm->zones[i].max);
+    buf[i * 3 + 2] = htole64(zm->zones[i].seen);
+  }
+
+  write_all(fd, buf, sizeof(*zm->zones) * n, ZONES_HEADER);
+
+  free(buf);
+
+  if (fdatasync(fd) < 0) ERROR_AT_LINE("Error in sync");
+
+  state = htobe32(ZONES_CLEAN);
+  write_all(fd, &state, sizeof(state), ZONES_STATE_OFFSET);
+
+  if (fdatasync(fd) < 0) ERROR_AT_LINE("Error in sync");
+  if (close(fd) < 0) ERROR_AT_LINE("Error in close");
+
+  zm->dirty = 0;
+}
+
+void dense_db_zonemap_destroy(dense_db_zonemap_t * zm)
+{
+  pthread_mutex_destroy(&zm->lock);
+
+  free(zm->zones);
+  free(zm);
+}
+
+int dense_db_table_zone_bounds(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t row, uint64_t * min, uint64_t * max)
+{
+  dense_db_zonemap_t * zm = table->zones;
+
+  if (! zm || acc.size > 64 || (row >> DENSE_DB_ZONE_SHIFT) >= zm->n_zones) return 0;
+
+  dense_db_zone_t * zone = zm->zones + (row >> DENSE_DB_ZONE_SHIFT) * table->n_fields + acc.field;
+
+  *min = __atomic_load_n(&zone->min, __ATOMIC_RELAXED);
+  *max = __atomic_load_n(&zone->max, __ATOMIC_RELAXED);
+
+  return 1;
+}
+
+static int zone_may_hold(const dense_db_zone_t * zone, uint64_t v)
+{
+  return v >= zone->min && v <= zone->max && (zone->seen >> (v & 63)) & 1;
+}
+
+int dense_db_table_zone_may_match(dense_db_table_t * table, dense_db_accessor_t acc, const dense_db_pred_t * pred, uint64_t first_row, size_t count)
+{
+  dense_db_zonemap_t * zm = table->zones;
+
+  if (! zm || acc.size > 64 || ! count) return 1;
+  if (pred->op == DENSE_DB_PRED_IN && pred->n_set > ZONE_MAX_SET) return 1;
+
+  size_t z, last = (first_row + count - 1) >> DENSE_DB_ZONE_SHIFT;
+
+  if (last >= zm->n_zones) return 1;
+
+  for (z = first_row >> DENSE_DB_ZONE_SHIFT; z <= last; z++) {
+    dense_db_zone_t zone = zm->zones[z * table->n_fields + acc.field];
+    size_t i;
+
+    switch (pred->op) {
+      case DENSE_DB_PRED_EQ:
+        if (zone_may_hold(&zone, pred->lo)) return 1;
+        break;
+      case DENSE_DB_PRED_RANGE:
+        if (pred->lo <= pred->hi && pred->lo <= zone.max && pred->hi >= zone.min) return 1;
+        break;
+      case DENSE_DB_PRED_IN:
+        for (i = 0; i < pred->n_set; i++) {
+          if (zone_may_hold(&zone, pred->set[i])) return 1;
+        }
+        break;
+    }
+  }
+
+  return 0;
+}
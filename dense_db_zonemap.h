@@ -0,0 +1,96 @@
+/*
+Copyright (c) 2012, Jason Carey  https://github.com/hanumantmk/DenseDB
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+  Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+  Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+  The names of its contributors may not be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DENSE_DB_ZONEMAP_H
+#define DENSE_DB_ZONEMAP_H
+
+#include <pthread.h>
+#include "dense_db.h"
+#include "dense_db_filter.h"
+
+// A zone map keeps bounds on the values of each field (of at most 64 bits)
+// in each zone of DENSE_DB_ZONE_ROWS rows, so filters can skip zones that
+// can't match without reading them.  Setters only ever widen the bounds,
+// so they may be looser than the values in the zone, never tighter.
+#define DENSE_DB_ZONE_SHIFT 12
+#define DENSE_DB_ZONE_ROWS (1 << DENSE_DB_ZONE_SHIFT)
+
+typedef struct dense_db_zone {
+  uint64_t min;
+  uint64_t max;
+
+  // Bit v % 64 set for every value v, which is exact for fields of up to 6
+  // bits and a cheap membership test for wider ones
+  uint64_t seen;
+} dense_db_zone_t;
+
+typedef struct dense_db_zonemap {
+  // n_zones * n_fields of them, by zone then field
+  dense_db_zone_t * zones;
+  size_t n_zones;
+  size_t alloc;
+
+  // Set once the table has changed since the map was loaded or saved, and
+  // its file marked so a crash before the next save rebuilds it
+  int dirty;
+  int persist;
+
+  pthread_mutex_t lock;
+} dense_db_zonemap_t;
+
+// Keep a zone map for the table, loading the one saved with it or building
+// it with a scan.  From then on the table's header says so, and every open
+// keeps it up to date.  The map is saved next to the table, as
+// .<name>.zones in the db's directory, when the db is destroyed.
+void dense_db_table_enable_zonemap(dense_db_table_t * table);
+
+// Bounds on the values of a field in the zone holding row, returning 0 when
+// there are none (no zone map, or a field wider than 64 bits)
+int dense_db_table_zone_bounds(dense_db_table_t * table, dense_db_accessor_t acc, uint64_t row, uint64_t * min, uint64_t * max);
+
+// Whether pred might hold for any of count rows from first_row, which is
+// always the case without a zone map
+int dense_db_table_zone_may_match(dense_db_table_t * table, dense_db_accessor_t acc, const dense_db_pred_t * pred, uint64_t first_row, size_t count);
+
+// Used by the table itself: load or build, mark dirty before a change,
+// widen for written values, follow resizes, save and free
+dense_db_zonemap_t * dense_db_zonemap_new(dense_db_table_t * table);
+void dense_db_zonemap_mark_dirty(dense_db_table_t * table);
+void dense_db_zonemap_set_column(dense_db_table_t * table, int field, uint64_t first_row, size_t count, const uint64_t * in, uint64_t mask);
+void dense_db_zonemap_resize(dense_db_table_t * table, size_t old_rows, size_t rows);
+void dense_db_zonemap_save(dense_db_table_t * table);
+void dense_db_zonemap_destroy(dense_db_zonemap_t * zm);
+
+static inline void dense_db_zonemap_begin(dense_db_table_t * table)
+{
+  if (table->zones && ! __atomic_load_n(&table->zones->dirty, __ATOMIC_ACQUIRE)) dense_db_zonemap_mark_dirty(table);
+}
+
+static inline void dense_db_zone_merge(dense_db_zone_t * zone, uint64_t min, uint64_t max, uint64_t seen)
+{
+  uint64_t cur = __atomic_load_n(&zone->min, __ATOMIC_RELAXED);
+  while (min < cur && ! __atomic_compare_exchange_n(&zone->min, &cur, min, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  cur = __atomic_load_n(&zone->max, __ATOMIC_RELAXED);
+  while (max > cur && ! __atomic_compare_exchange_n(&zone->max, &cur, max, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if (~__atomic_load_n(&zone->seen, __ATOMIC_RELAXED) & seen) __atomic_fetch_or(&zone->seen, seen, __ATOMIC_RELAXED);
+}
+
+static inline void dense_db_zonemap_set(dense_db_table_t * table, int field, uint64_t row, uint64_t v)
+{
+  if (! table->zones) return;
+
+  dense_db_zone_merge(table->zones->zones + (row >> DENSE_DB_ZONE_SHIFT) * table->n_fields + field, v, v, 1ull << (v & 63));
+}
+
+#endif
@@ -10,8 +10,14 @@ Redistribution and use in source and binary forms, with or without modification,
 THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <endian.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "dense_db.h"
 
 void pp_stats(dense_db_table_t * table)
@@ -38,29 +44,1125 @@ void pp(dense_db_table_t * table)
   size_t n_fields = table->n_fields;
   size_t rows = table->rows;
 
-  dense_db_accessor_t accs[n_fields];
+  int i;
+  for (i = 0; i < n_fields; i++) {
+    printf("%s%c", fields[i].name, i == n_fields - 1 ? '\n' : '\t');
+  }
+
+  dense_db_row_codec_t * codec = dense_db_row_codec_new(table, NULL, 0);
+
+  uint64_t buf[codec->n_words];
+  size_t * slots = codec->slots;
+
+  for (i = 0; i < rows; i++) {
+    dense_db_table_get_row(table, codec, i, buf);
+
+    printf("%d\t%s\t%d\t%d\t%d\t%d\n",
+      (int)buf[slots[0]], (char *)(buf + slots[1]), (int)buf[slots[2]],
+      (int)buf[slots[3]], (int)buf[slots[4]], (int)buf[slots[5]]);
+  }
+
+  dense_db_row_codec_destroy(codec);
+}
+
+void check_column(dense_db_table_t * table, dense_db_accessor_t acc)
+{
+  size_t rows = table->rows;
+
+  uint64_t * col = malloc(sizeof(*col) * rows);
+
+  dense_db_table_get_column(table, acc, 0, rows, col);
+
+  int i;
+  for (i = 0; i < rows; i++) {
+    assert(col[i] == dense_db_table_get_int(table, i, acc));
+  }
+
+  free(col);
+}
+
+void check_aggregate(dense_db_pool_t * pool, dense_db_table_t * table, dense_db_accessor_t acc)
+{
+  dense_db_agg_t agg;
+  dense_db_table_aggregate(pool, table, acc, 0, table->rows, &agg);
+
+  uint64_t sum = 0, max = 0, min = UINT64_MAX, nonzero = 0;
+
+  // Buckets of 3 from 1, so both ends catch values out of their range
+  uint64_t buckets[4], expect[4] = { 0 };
+
+  int i;
+  for (i = 0; i < table->rows; i++) {
+    uint64_t v = dense_db_table_get_int(table, i, acc);
+
+    sum += v;
+    max = v > max ? v : max;
+    min = v < min ? v : min;
+    nonzero += v != 0;
+
+    expect[v < 1 ? 0 : (v - 1) / 3 < 3 ? (v - 1) / 3 : 3]++;
+  }
+
+  assert(agg.count == table->rows);
+  assert(agg.sum == sum);
+  assert(agg.max == max);
+  assert(agg.min == min);
+  assert(agg.nonzero == nonzero);
+
+  dense_db_table_histogram(pool, table, acc, 0, table->rows, 1, 3, 4, buckets);
+
+  assert(memcmp(buckets, expect, sizeof(buckets)) == 0);
+}
+
+// bop == 3 and bip == 1
+void check_filter(dense_db_table_t * table, dense_db_accessor_t bop, dense_db_accessor_t bip)
+{
+  size_t rows = table->rows;
+
+  uint64_t * a = malloc(sizeof(*a) * ((rows + 63) / 64));
+  uint64_t * b = malloc(sizeof(*b) * ((rows + 63) / 64));
+
+  dense_db_pred_t is_3 = { DENSE_DB_PRED_EQ, 3 };
+  dense_db_pred_t is_1 = { DENSE_DB_PRED_EQ, 1 };
+
+  dense_db_table_filter(table, bop, &is_3, 0, rows, a);
+  dense_db_table_filter(table, bip, &is_1, 0, rows, b);
+
+  size_t indexed;
+  if (dense_db_table_index_count(table, bop, &is_3, &indexed)) assert(indexed == dense_db_bitmap_count(a, rows));
+
+  dense_db_bitmap_and(a, b, rows);
+
+  size_t expected = 0;
+
+  int i;
+  for (i = 0; i < rows; i++) {
+    expected += dense_db_table_get_int(table, i, bop) == 3 && dense_db_table_get_int(table, i, bip) == 1;
+  }
+
+  assert(dense_db_bitmap_count(a, rows) == expected);
+
+  free(a);
+  free(b);
+}
+
+// Look every row's value up, checking the row is among those found
+void check_lookup(dense_db_table_t * table, dense_db_accessor_t acc)
+{
+  uint64_t * rows = malloc(sizeof(*rows) * table->rows);
+
+  int i;
+  for (i = 0; i < table->rows; i++) {
+    uint64_t v = dense_db_table_get_int(table, i, acc);
+    size_t n = dense_db_table_hash_lookup(table, acc, v, rows, table->rows);
+
+    int found = 0, k;
+    for (k = 0; k < n; k++) {
+      assert(dense_db_table_get_int(table, rows[k], acc) == v);
+      found |= rows[k] == i;
+    }
+
+    assert(found);
+  }
+
+  free(rows);
+}
+
+// Copy every row of from into to, and make sure both read back the same
+void check_copy(dense_db_table_t * from, dense_db_table_t * to)
+{
+  dense_db_row_codec_t * codec = dense_db_row_codec_new(from, NULL, 0);
+  dense_db_row_codec_t * to_codec = dense_db_row_codec_new(to, NULL, 0);
+
+  uint64_t a[codec->n_words], b[codec->n_words];
+
+  int i;
+  for (i = 0; i < from->rows; i++) {
+    dense_db_table_get_row(from, codec, i, a);
+    dense_db_table_set_row(to, to_codec, i, a);
+    dense_db_table_get_row(to, to_codec, i, b);
+
+    assert(memcmp(a, b, sizeof(a)) == 0);
+  }
+
+  for (i = 0; i < from->n_fields; i++) {
+    dense_db_accessor_t acc = dense_db_table_get_accessor(to, from->fields[i].name);
+
+    if (acc.size <= 64) check_column(to, acc);
+  }
+
+  dense_db_row_codec_destroy(codec);
+  dense_db_row_codec_destroy(to_codec);
+}
+
+// Copy from into to and compact it, which mustn't change what it reads back
+void check_compact(dense_db_table_t * from, dense_db_table_t * to)
+{
+  check_copy(from, to);
+
+  dense_db_table_compact(to);
+
+  dense_db_row_codec_t * codec = dense_db_row_codec_new(from, NULL, 0);
+  dense_db_row_codec_t * to_codec = dense_db_row_codec_new(to, NULL, 0);
+
+  uint64_t a[codec->n_words], b[codec->n_words];
+
+  int i;
+  for (i = 0; i < from->rows; i++) {
+    dense_db_table_get_row(from, codec, i, a);
+    dense_db_table_get_row(to, to_codec, i, b);
+
+    assert(memcmp(a, b, sizeof(a)) == 0);
+  }
+
+  for (i = 0; i < to->n_fields; i++) {
+    dense_db_accessor_t acc = dense_db_table_get_accessor(to, to->fields[i].name);
+
+    if (acc.size <= 64) check_column(to, acc);
+  }
+
+  dense_db_row_codec_destroy(codec);
+  dense_db_row_codec_destroy(to_codec);
+}
+
+typedef struct load_source {
+  dense_db_table_t * table;
+  dense_db_row_codec_t * codec;
+  size_t next;
+} load_source_t;
+
+size_t load_rows(void * arg, uint64_t * rows, size_t max_rows)
+{
+  load_source_t * source = arg;
+
+  size_t n;
+  for (n = 0; n < max_rows && source->next < source->table->rows; n++, source->next++) {
+    dense_db_table_get_row(source->table, source->codec, source->next, rows + n * source->codec->n_words);
+  }
+
+  return n;
+}
+
+// Bulk load from's rows into a new table, which must read back the same
+void check_load(dense_db_table_t * from, char * name, int layout)
+{
+  load_source_t source = { from, dense_db_row_codec_new(from, NULL, 0), 0 };
+
+  dense_db_table_t * to = dense_db_table_load(from->db, name, from->fields, from->n_fields, layout, 2, load_rows, &source);
+
+  assert(to->rows == from->rows);
+
+  dense_db_row_codec_t * to_codec = dense_db_row_codec_new(to, NULL, 0);
+
+  uint64_t a[source.codec->n_words], b[source.codec->n_words];
+
+  int i;
+  for (i = 0; i < from->rows; i++) {
+    dense_db_table_get_row(from, source.codec, i, a);
+    dense_db_table_get_row(to, to_codec, i, b);
+
+    assert(memcmp(a, b, sizeof(a)) == 0);
+  }
+
+  dense_db_row_codec_destroy(source.codec);
+  dense_db_row_codec_destroy(to_codec);
+
+  dense_db_table_close(to);
+}
+
+// Grow a table, dirty the new rows, then shrink and grow it again: rows that
+// come back must read as zero and the rest must be untouched
+void check_resize(dense_db_table_t * table, dense_db_accessor_t acc)
+{
+  size_t rows = table->rows;
+  uint64_t before = dense_db_table_get_int(table, rows - 1, acc);
+
+  uint64_t first = dense_db_table_append_rows(table, 100);
+  assert(first == rows && table->rows == rows + 100);
+
+  int i;
+  for (i = 0; i < 100; i++) {
+    assert(dense_db_table_get_int(table, first + i, acc) == 0);
+    dense_db_table_set_int(table, first + i, acc, 1);
+  }
+
+  dense_db_table_resize(table, rows);
+  dense_db_table_resize(table, rows + 100);
+
+  for (i = 0; i < 100; i++) {
+    assert(dense_db_table_get_int(table, first + i, acc) == 0);
+  }
+
+  dense_db_table_resize(table, rows);
+  assert(dense_db_table_get_int(table, rows - 1, acc) == before);
+}
+
+// A table as the first version of the library wrote it: a 32 bit header of
+//   header_size n_fields rows
+// then each field's name and size, with the rows right after and nothing
+// past the last one.  509 rows of a:60 and b:4 end the file on a page.
+static const uint8_t baseline_header[] = {
+  0, 0, 0, 24,
+  0, 0, 0, 2,
+  0, 0, 1, 253,
+  'a', 0, 0, 0, 0, 60,
+  'b', 0, 0, 0, 0, 4,
+};
+
+#define BASELINE_ROWS 509
+
+static uint64_t baseline_a(uint64_t row)
+{
+  return (row * 0x123456789abcdull) & ((1ull << 60) - 1);
+}
+
+// Open a baseline table and read its last rows every way there is
+void check_baseline(dense_db_t * db, char * name)
+{
+  char * path;
+  assert(asprintf(&path, "%s/%s", db->storage_path, name) > 0);
+
+  FILE * file = fopen(path, "w");
+  assert(file);
+
+  free(path);
+
+  assert(fwrite(baseline_header, sizeof(baseline_header), 1, file) == 1);
+
+  int i;
+  for (i = 0; i < BASELINE_ROWS; i++) {
+    uint64_t word = htole64(baseline_a(i) | (uint64_t)(i % 16) << 60);
+
+    assert(fwrite(&word, sizeof(word), 1, file) == 1);
+  }
+
+  assert(fclose(file) == 0);
+
+  dense_db_table_t * table = dense_db_table_open(db, name);
+
+  assert(table->version == 1 && table->rows == BASELINE_ROWS);
+
+  // Grown past the last row, so 64 bit loads of it stay in the mapping
+  assert(table->size >= sizeof(baseline_header) + BASELINE_ROWS * 8 + 8);
+
+  dense_db_accessor_t a = dense_db_table_get_accessor(table, "a");
+  dense_db_accessor_t b = dense_db_table_get_accessor(table, "b");
+
+  uint64_t last = BASELINE_ROWS - 1;
+
+  assert(dense_db_table_get_int(table, last, a) == baseline_a(last));
+  assert(dense_db_table_get_int(table, last, b) == last % 16);
+
+  uint64_t v = 0;
+  dense_db_table_get(table, last, b, &v);
+  assert(le64toh(v) == last % 16);
+
+  uint64_t col[8];
+
+  dense_db_table_get_column(table, b, BASELINE_ROWS - 8, 8, col);
+
+  for (i = 0; i < 8; i++) {
+    assert(col[i] == (BASELINE_ROWS - 8 + i) % 16);
+  }
+
+  dense_db_table_get_column(table, a, BASELINE_ROWS - 8, 8, col);
+
+  for (i = 0; i < 8; i++) {
+    assert(col[i] == baseline_a(BASELINE_ROWS - 8 + i));
+  }
+
+  dense_db_table_close(table);
+}
+
+#define COLUMN_ROWS 5000
+
+static uint64_t column_value(int field, uint64_t row, int pass)
+{
+  return (row + 1) * 0x9e3779b97f4a7c15ull ^ (uint64_t)(field * 3 + pass) << 40;
+}
+
+// Store columns of odd widths, of fields straddling words and next to one
+// wider than 64 bits, over whole tables and over ranges that don't start or end on a
+// block, and read them back with get_column
+void check_set_column(dense_db_t * db, char * name, int layout)
+{
+  dense_db_field_t fields[] = {
+    { "a", 3 },
+    { "b", 61 },
+    { "wide", 100 },
+    { "c", 64 },
+    { "d", 7 },
+    { "e", 1 },
+  };
+
+  dense_db_table_t * table = dense_db_table_create(db, name, fields, 6, COLUMN_ROWS, layout);
+
+  dense_db_accessor_t wide = dense_db_table_get_accessor(table, "wide");
+  uint8_t wide_in[13], wide_out[13];
+
+  int i, k;
+  for (i = 0; i < COLUMN_ROWS; i++) {
+    for (k = 0; k < 13; k++) wide_in[k] = i * 31 + k;
+    wide_in[12] &= 0xf;
+
+    dense_db_table_set(table, i, wide, wide_in);
+  }
+
+  // Whole table, then across the first PAX block's end, then a few rows in
+  // the middle of one
+  struct { uint64_t first_row; size_t count; } ranges[] = {
+    { 0, COLUMN_ROWS },
+    { 4000, 200 },
+    { 7, 13 },
+  };
+
+  uint64_t * in = malloc(sizeof(*in) * COLUMN_ROWS);
+  uint64_t * out = malloc(sizeof(*out) * COLUMN_ROWS);
+  uint64_t * expect = malloc(sizeof(*expect) * COLUMN_ROWS * 6);
+
+  int f, pass;
+  for (pass = 0; pass < 3; pass++) {
+    uint64_t first_row = ranges[pass].first_row;
+    size_t count = ranges[pass].count;
+
+    for (f = 0; f < 6; f++) {
+      if (f == 2) continue;
+
+      dense_db_accessor_t acc = dense_db_table_get_accessor(table, fields[f].name);
+      uint64_t mask = fields[f].size == 64 ? ~0ull : (1ull << fields[f].size) - 1;
+
+      for (i = 0; i < count; i++) {
+        in[i] = column_value(f, first_row + i, pass);
+        expect[f * COLUMN_ROWS + first_row + i] = in[i] & mask;
+      }
+
+      dense_db_table_set_column(table, acc, first_row, count, in);
+    }
+
+    for (f = 0; f < 6; f++) {
+      if (f == 2) continue;
+
+      dense_db_accessor_t acc = dense_db_table_get_accessor(table, fields[f].name);
+
+      dense_db_table_get_column(table, acc, 0, COLUMN_ROWS, out);
+
+      for (i = 0; i < COLUMN_ROWS; i++) {
+        assert(out[i] == expect[f * COLUMN_ROWS + i]);
+        assert(dense_db_table_get_int(table, i, acc) == out[i]);
+      }
+
+      dense_db_table_get_column(table, acc, first_row, count, out);
+
+      for (i = 0; i < count; i++) {
+        assert(out[i] == expect[f * COLUMN_ROWS + first_row + i]);
+      }
+    }
+  }
+
+  // The wide field between them must be untouched
+  for (i = 0; i < COLUMN_ROWS; i++) {
+    for (k = 0; k < 13; k++) wide_in[k] = i * 31 + k;
+    wide_in[12] &= 0xf;
+
+    memset(wide_out, 0, sizeof(wide_out));
+    dense_db_table_get(table, i, wide, wide_out);
+
+    assert(memcmp(wide_in, wide_out, sizeof(wide_in)) == 0);
+  }
+
+  free(in);
+  free(out);
+  free(expect);
+
+  dense_db_table_close(table);
+}
+
+static int pred_holds(const dense_db_pred_t * pred, uint64_t v)
+{
+  size_t i;
+
+  switch (pred->op) {
+    case DENSE_DB_PRED_EQ:
+      return v == pred->lo;
+    case DENSE_DB_PRED_RANGE:
+      return pred->lo <= v && v <= pred->hi;
+  }
+
+  for (i = 0; i < pred->n_set; i++) {
+    if (pred->set[i] == v) return 1;
+  }
+
+  return 0;
+}
+
+// Filter count rows from first_row, checking each bit against the row
+static void check_pred(dense_db_table_t * table, dense_db_accessor_t acc, const dense_db_pred_t * pred, uint64_t first_row, size_t count)
+{
+  uint64_t * bitmap = malloc(sizeof(*bitmap) * ((count + 63) / 64));
+
+  dense_db_table_filter(table, acc, pred, first_row, count, bitmap);
+
+  int i;
+  for (i = 0; i < count; i++) {
+    int bit = (bitmap[i / 64] >> (i % 64)) & 1;
+
+    assert(bit == pred_holds(pred, dense_db_table_get_int(table, first_row + i, acc)));
+  }
+
+  free(bitmap);
+}
+
+#define PRED_ROWS (3 * DENSE_DB_ZONE_ROWS + 100)
+
+// Ranges and sets over a narrow field (IN through a lookup bitmap) and a
+// wide one (IN through a sorted set), on whole tables and on ranges of rows
+// crossing zones, before and after the zone map can skip them
+void check_preds(dense_db_t * db, char * name)
+{
+  dense_db_field_t fields[] = {
+    { "n", 12 },
+    { "w", 40 },
+  };
+
+  dense_db_table_t * table = dense_db_table_create(db, name, fields, 2, PRED_ROWS, DENSE_DB_LAYOUT_ROW);
+
+  dense_db_accessor_t n = dense_db_table_get_accessor(table, "n");
+  dense_db_accessor_t w = dense_db_table_get_accessor(table, "w");
+
+  uint64_t w_mask = (1ull << 40) - 1;
+
+  int i;
+  for (i = 0; i < PRED_ROWS; i++) {
+    // n rises with the row, so each zone holds its own values of it
+    dense_db_table_set_int(table, i, n, i / 8);
+    dense_db_table_set_int(table, i, w, i * 2654435761ull);
+  }
+
+  uint64_t small[] = { 3, 511, 512, 1024, 1500, 5000 };
+  uint64_t large[100];
+  uint64_t wide[] = { 0, 7 * 2654435761ull & w_mask, 4097 * 2654435761ull & w_mask, 12345, w_mask };
+
+  for (i = 0; i < 100; i++) large[i] = i * 17;
+
+  dense_db_pred_t preds[] = {
+    { DENSE_DB_PRED_RANGE, 500, 530 },
+    { DENSE_DB_PRED_RANGE, 0, 0 },
+    { DENSE_DB_PRED_RANGE, 2000, 3000 },
+    { DENSE_DB_PRED_RANGE, 30, 20 },
+    { DENSE_DB_PRED_IN, 0, 0, small, 6 },
+    { DENSE_DB_PRED_IN, 0, 0, large, 100 },
+    { DENSE_DB_PRED_IN, 0, 0, small, 0 },
+  };
+
+  dense_db_pred_t in_wide = { DENSE_DB_PRED_IN, 0, 0, wide, 5 };
+  dense_db_pred_t range_wide = { DENSE_DB_PRED_RANGE, 1ull << 38, 1ull << 39 };
+
+  int zoned, k;
+  for (zoned = 0; zoned < 2; zoned++) {
+    if (zoned) dense_db_table_enable_zonemap(table);
+
+    for (k = 0; k < 7; k++) {
+      check_pred(table, n, preds + k, 0, PRED_ROWS);
+      check_pred(table, n, preds + k, DENSE_DB_ZONE_ROWS - 100, DENSE_DB_ZONE_ROWS + 200);
+      check_pred(table, n, preds + k, 3, 70);
+    }
+
+    check_pred(table, w, &in_wide, 0, PRED_ROWS);
+    check_pred(table, w, &in_wide, DENSE_DB_ZONE_ROWS - 100, DENSE_DB_ZONE_ROWS + 200);
+    check_pred(table, w, &range_wide, 0, PRED_ROWS);
+  }
+
+  dense_db_table_close(table);
+}
+
+typedef struct scan_visits {
+  int n_workers;
+  uint32_t * visits;
+  uint64_t first_row;
+} scan_visits_t;
+
+static void count_visits(dense_db_table_t * table, uint64_t first_row, size_t count, int worker, void * arg)
+{
+  scan_visits_t * sv = arg;
+
+  assert(worker >= 0 && worker < sv->n_workers);
+
+  size_t i;
+  for (i = 0; i < count; i++) {
+    __atomic_fetch_add(sv->visits + first_row + i - sv->first_row, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Scan a range starting and ending off chunk boundaries on several threads,
+// with chunks picked for us and with tiny ones: each row once, no others
+void check_scan(dense_db_table_t * table)
+{
+  dense_db_pool_t * pool = dense_db_pool_new(4);
+
+  // Tables too small to leave rows out on both ends are scanned whole
+  uint64_t first_row = table->rows > 10 ? 3 : 0;
+  size_t count = table->rows > 10 ? table->rows - 10 : table->rows;
+  size_t chunks[] = { 0, 37 };
+
+  scan_visits_t sv = { dense_db_pool_size(pool), malloc(sizeof(uint32_t) * count), first_row };
+
+  int k, i;
+  for (k = 0; k < 2; k++) {
+    memset(sv.visits, 0, sizeof(uint32_t) * count);
+
+    dense_db_table_scan(pool, table, first_row, count, chunks[k], count_visits, &sv);
+
+    for (i = 0; i < count; i++) {
+      assert(sv.visits[i] == 1);
+    }
+  }
+
+  free(sv.visits);
+
+  dense_db_pool_destroy(pool);
+}
+
+// A first version table with a 19 byte header and 64 bit rows, so no row
+// starts on a word
+static const uint8_t unaligned_header[] = {
+  0, 0, 0, 19,
+  0, 0, 0, 1,
+  0, 0, 1, 44,
+  'a', 'b', 0, 0, 0, 0, 64,
+};
+
+#define UNALIGNED_ROWS 300
+
+// Its chunks may not be split between threads: all of them on worker 0
+void check_scan_unaligned(dense_db_t * db, char * name)
+{
+  char * path;
+  assert(asprintf(&path, "%s/%s", db->storage_path, name) > 0);
+
+  FILE * file = fopen(path, "w");
+  assert(file);
+
+  free(path);
+
+  assert(fwrite(unaligned_header, sizeof(unaligned_header), 1, file) == 1);
+
+  int i;
+  for (i = 0; i < UNALIGNED_ROWS; i++) {
+    uint64_t word = htole64(i);
+
+    assert(fwrite(&word, sizeof(word), 1, file) == 1);
+  }
+
+  assert(fclose(file) == 0);
+
+  dense_db_table_t * table = dense_db_table_open(db, name);
+
+  assert(table->rows == UNALIGNED_ROWS);
+
+  dense_db_pool_t * pool = dense_db_pool_new(4);
+
+  scan_visits_t sv = { 1, calloc(sizeof(uint32_t), UNALIGNED_ROWS), 0 };
+
+  dense_db_table_scan(pool, table, 0, UNALIGNED_ROWS, 37, count_visits, &sv);
+
+  for (i = 0; i < UNALIGNED_ROWS; i++) {
+    assert(sv.visits[i] == 1);
+  }
+
+  free(sv.visits);
+
+  dense_db_pool_destroy(pool);
+
+  dense_db_table_close(table);
+}
+
+#define SHARED_ROWS 64
+#define SHARED_ROUNDS 2000
+
+// Four fields over two words, the second straddling them
+static dense_db_field_t shared_fields[] = {
+  { "s0", 30 },
+  { "s1", 40 },
+  { "s2", 25 },
+  { "s3", 33 },
+};
+
+typedef struct shared_worker {
+  dense_db_table_t * table;
+  int field;
+  int * done;
+} shared_worker_t;
+
+// A round number in the low half of a field and a hash of it in the high
+// half, so a value mixing two writes doesn't decode
+static uint64_t shared_hash(int field, uint64_t round)
+{
+  int half = shared_fields[field].size / 2;
+
+  return (round * 0x9e3779b97f4a7c15ull >> 20) & ((1ull << (shared_fields[field].size - half)) - 1);
+}
+
+static uint64_t shared_encode(int field, uint64_t round)
+{
+  int half = shared_fields[field].size / 2;
+
+  return round | shared_hash(field, round) << half;
+}
+
+static uint64_t shared_decode(int field, uint64_t v)
+{
+  int half = shared_fields[field].size / 2;
+  uint64_t round = v & ((1ull << half) - 1);
+
+  assert(v >> half == shared_hash(field, round));
+
+  return round;
+}
+
+static void * shared_writer(void * arg)
+{
+  shared_worker_t * worker = arg;
+  dense_db_accessor_t acc = dense_db_table_get_accessor(worker->table, shared_fields[worker->field].name);
+
+  int round, row;
+  for (round = 1; round < SHARED_ROUNDS; round++) {
+    for (row = 0; row < SHARED_ROWS; row++) {
+      dense_db_table_set_int(worker->table, row, acc, shared_encode(worker->field, round));
+    }
+  }
+
+  return NULL;
+}
+
+static void * shared_reader(void * arg)
+{
+  shared_worker_t * worker = arg;
+  dense_db_table_t * table = worker->table;
+
+  dense_db_accessor_t accs[4];
+  uint64_t seen[SHARED_ROWS][4] = { { 0 } };
+
+  int f, row;
+  for (f = 0; f < 4; f++) accs[f] = dense_db_table_get_accessor(table, shared_fields[f].name);
+
+  while (! __atomic_load_n(worker->done, __ATOMIC_ACQUIRE)) {
+    for (row = 0; row < SHARED_ROWS; row++) {
+      uint64_t v[4], seq;
+
+      do {
+        seq = dense_db_table_read_begin(table, row);
+
+        for (f = 0; f < 4; f++) v[f] = dense_db_table_get_int(table, row, accs[f]);
+      } while (dense_db_table_read_retry(table, row, seq));
+
+      // Nothing torn, and no write seen going backwards
+      for (f = 0; f < 4; f++) {
+        uint64_t round = shared_decode(f, v[f]);
+
+        assert(round >= seen[row][f]);
+        seen[row][f] = round;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// One writer per field, all of them sharing words, while readers check
+// every value they see under the sequence locks.  No write may be lost.
+void check_shared_words(dense_db_t * db, char * name)
+{
+  dense_db_table_t * table = dense_db_table_create(db, name, shared_fields, 4, SHARED_ROWS, DENSE_DB_LAYOUT_ROW);
+
+  dense_db_table_enable_seqlock(table, 0);
+
+  int done = 0;
+
+  pthread_t writers[4], readers[2];
+  shared_worker_t workers[6];
 
   int i;
-  for (i = 0; i < n_fields; i++) {
-    printf("%s%c", fields[i].name, i == n_fields - 1 ? '\n' : '\t');
-    accs[i] = dense_db_table_get_accessor(table, fields[i].name);
+  for (i = 0; i < 6; i++) {
+    workers[i].table = table;
+    workers[i].field = i;
+    workers[i].done = &done;
+
+    assert(pthread_create(i < 4 ? writers + i : readers + i - 4, NULL, i < 4 ? shared_writer : shared_reader, workers + i) == 0);
+  }
+
+  for (i = 0; i < 4; i++) assert(pthread_join(writers[i], NULL) == 0);
+
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+  for (i = 0; i < 2; i++) assert(pthread_join(readers[i], NULL) == 0);
+
+  int row;
+  for (row = 0; row < SHARED_ROWS; row++) {
+    for (i = 0; i < 4; i++) {
+      dense_db_accessor_t acc = dense_db_table_get_accessor(table, shared_fields[i].name);
+
+      assert(dense_db_table_get_int(table, row, acc) == shared_encode(i, SHARED_ROUNDS - 1));
+    }
+  }
+
+  dense_db_table_close(table);
+}
+
+static size_t dirty_pages(dense_db_table_t * table)
+{
+  size_t n = 0, i;
+
+  for (i = 0; i < table->dirty_words; i++) {
+    n += __builtin_popcountll(__atomic_load_n(table->dirty + i, __ATOMIC_RELAXED));
+  }
+
+  return n;
+}
+
+// Writes leave their pages dirty until a sync, or until the flusher gets to
+// them on its own
+void check_flusher(dense_db_table_t * table, dense_db_accessor_t acc)
+{
+  uint64_t v = dense_db_table_get_int(table, 0, acc);
+
+  dense_table_sync(table);
+  assert(dirty_pages(table) == 0);
+
+  dense_db_table_set_int(table, 0, acc, v);
+  assert(dirty_pages(table) == 1);
+
+  dense_db_table_start_flusher(table, 1);
+
+  dense_db_table_set_int(table, table->rows - 1, acc, dense_db_table_get_int(table, table->rows - 1, acc));
+
+  int waited;
+  for (waited = 0; dirty_pages(table) && waited < 5000; waited++) usleep(1000);
+
+  assert(dirty_pages(table) == 0);
+
+  dense_db_table_stop_flusher(table);
+}
+
+#define LRU_TABLES 5
+#define LRU_ROWS 1000
+
+// More tables than the db may keep mapped, read all held at once and then
+// one at a time, under a budget that only fits two of them
+void check_lru(char ** names)
+{
+  dense_db_t * db = dense_db_new(".", 2);
+
+  dense_db_field_t fields[] = {
+    { "v", 16 },
+  };
+
+  dense_db_table_t * tables[LRU_TABLES];
+  dense_db_accessor_t v;
+
+  int t, i, pass;
+  for (t = 0; t < LRU_TABLES; t++) {
+    tables[t] = dense_db_table_create(db, names[t], fields, 1, LRU_ROWS, DENSE_DB_LAYOUT_ROW);
+    v = dense_db_table_get_accessor(tables[t], "v");
+
+    for (i = 0; i < LRU_ROWS; i++) {
+      dense_db_table_set_int(tables[t], i, v, t * LRU_ROWS + i);
+    }
+  }
+
+  check_flusher(tables[0], v);
+
+  // Held tables stay open whatever the limits
+  for (t = 0; t < LRU_TABLES; t++) {
+    for (i = 0; i < LRU_ROWS; i++) {
+      assert(dense_db_table_get_int(tables[t], i, v) == t * LRU_ROWS + i);
+    }
+  }
+
+  size_t size = tables[0]->size;
+
+  for (t = 0; t < LRU_TABLES; t++) {
+    dense_db_table_close(tables[t]);
+  }
+
+  assert(db->n_mapped <= 2);
+
+  dense_db_set_map_budget(db, 2 * size);
+
+  for (pass = 0; pass < 3; pass++) {
+    for (t = 0; t < LRU_TABLES; t++) {
+      dense_db_table_t * table = pass == 1 ? dense_db_table_open_hinted(db, names[t], DENSE_DB_HINT_SEQUENTIAL | DENSE_DB_HINT_WILLNEED) : dense_db_table_open(db, names[t]);
+
+      for (i = 0; i < LRU_ROWS; i++) {
+        assert(dense_db_table_get_int(table, i, v) == t * LRU_ROWS + i);
+      }
+
+      dense_db_table_close(table);
+
+      assert(db->n_mapped <= 2 && db->mapped_bytes <= 2 * size);
+    }
+  }
+
+  dense_db_destroy(db);
+}
+
+static uint8_t * read_file(char * path, size_t * len)
+{
+  FILE * file = fopen(path, "r");
+  assert(file);
+
+  assert(fseek(file, 0, SEEK_END) == 0);
+  *len = ftell(file);
+  rewind(file);
+
+  uint8_t * data = malloc(*len);
+  assert(fread(data, 1, *len, file) == *len);
+
+  assert(fclose(file) == 0);
+
+  return data;
+}
+
+static void write_file(char * path, uint8_t * data, size_t len)
+{
+  FILE * file = fopen(path, "w");
+  assert(file);
+
+  assert(fwrite(data, 1, len, file) == len);
+
+  assert(fclose(file) == 0);
+}
+
+#define WAL_ROWS 100
+
+static uint64_t wal_y(uint64_t row)
+{
+  return row * 0x9e3779b97f4a7c15ull;
+}
+
+// Commit two batches, then put the log back as a crash before the checkpoint
+// would have left it: whole, with its last record torn, and with its last
+// record corrupt.  Replay must apply every whole record and nothing after.
+void check_wal(char * name)
+{
+  dense_db_field_t fields[] = {
+    { "x", 5 },
+    { "y", 64 },
+  };
+
+  dense_db_t * db = dense_db_new(".", 4);
+
+  dense_db_enable_wal(db);
+
+  dense_db_table_t * table = dense_db_table_create(db, name, fields, 2, WAL_ROWS, DENSE_DB_LAYOUT_ROW);
+
+  dense_db_accessor_t x = dense_db_table_get_accessor(table, "x");
+  dense_db_accessor_t y = dense_db_table_get_accessor(table, "y");
+
+  dense_db_batch_t * batch = dense_db_batch_new(db);
+
+  size_t first_len, len;
+  uint8_t * log;
+
+  int i;
+  for (i = 0; i < WAL_ROWS; i++) {
+    dense_db_batch_set_int(batch, table, i, x, i % 32);
+    dense_db_batch_set_int(batch, table, i, y, wal_y(i));
+
+    if (i == WAL_ROWS / 2 - 1) {
+      dense_db_batch_commit(batch);
+      free(read_file("./dense_db.wal", &first_len));
+    }
+  }
+
+  dense_db_batch_commit(batch);
+  dense_db_batch_destroy(batch);
+
+  log = read_file("./dense_db.wal", &len);
+
+  assert(first_len > 0 && len > first_len);
+
+  for (i = 0; i < WAL_ROWS; i++) {
+    assert(dense_db_table_get_int(table, i, x) == i % 32);
+    assert(dense_db_table_get_int(table, i, y) == wal_y(i));
+  }
+
+  int mode;
+  for (mode = 0; mode < 3; mode++) {
+    // Lose every set the log holds, as if the tables never saw them
+    for (i = 0; i < WAL_ROWS; i++) {
+      dense_db_table_set_int(table, i, x, 0);
+      dense_db_table_set_int(table, i, y, 0);
+    }
+
+    dense_db_table_close(table);
+    dense_db_destroy(db);
+
+    if (mode == 0) write_file("./dense_db.wal", log, len);
+    if (mode == 1) write_file("./dense_db.wal", log, len - 3);
+
+    if (mode == 2) {
+      log[len - 1] ^= 1;
+      write_file("./dense_db.wal", log, len);
+    }
+
+    db = dense_db_new(".", 4);
+
+    dense_db_enable_wal(db);
+
+    table = dense_db_table_open(db, name);
+
+    for (i = 0; i < WAL_ROWS; i++) {
+      int applied = i < WAL_ROWS / 2 || mode == 0;
+
+      assert(dense_db_table_get_int(table, i, x) == (applied ? i % 32 : 0));
+      assert(dense_db_table_get_int(table, i, y) == (applied ? wal_y(i) : 0));
+    }
+  }
+
+  free(log);
+
+  dense_db_table_close(table);
+  dense_db_destroy(db);
+}
+
+// Snapshot, then change every row: the snapshot must keep reading the old
+// values while the table reads the new ones
+void check_snapshot(dense_db_table_t * table, dense_db_accessor_t acc)
+{
+  size_t rows = table->rows;
+  uint64_t mask = acc.size == 64 ? ~0ull : (1ull << acc.size) - 1;
+
+  uint64_t * before = malloc(sizeof(*before) * rows);
+  uint64_t * col = malloc(sizeof(*col) * rows);
+
+  dense_db_table_get_column(table, acc, 0, rows, before);
+
+  dense_db_table_t * snap = dense_db_table_snapshot(table);
+
+  int i;
+  for (i = 0; i < rows; i++) {
+    dense_db_table_set_int(table, i, acc, (before[i] + 1) & mask);
   }
 
+  dense_db_table_get_column(snap, acc, 0, rows, col);
+
   for (i = 0; i < rows; i++) {
-    char foo[20] = { 0 };
-    int bar, baz, bip, bop, bip2;
+    assert(col[i] == before[i]);
+    assert(dense_db_table_get_int(snap, i, acc) == before[i]);
+    assert(dense_db_table_get_int(table, i, acc) == ((before[i] + 1) & mask));
+  }
+
+  dense_db_table_close(snap);
+
+  dense_db_table_set_column(table, acc, 0, rows, before);
+
+  free(before);
+  free(col);
+}
+
+// Fetch rows out of order and repeated, both fewer and more of them than
+// multi_get groups, and make sure each matches a plain get
+void check_multi_get(dense_db_table_t * table, dense_db_accessor_t acc)
+{
+  size_t counts[] = { 1, 10, 63, 64, 65, 3 * table->rows };
+  size_t max = 0;
+
+  int i, k;
+  for (k = 0; k < 6; k++) {
+    if (counts[k] > max) max = counts[k];
+  }
+
+  uint64_t * rows = malloc(sizeof(*rows) * max);
+  uint64_t * out = malloc(sizeof(*out) * max);
+
+  for (i = 0; i < max; i++) {
+    rows[i] = i % 3 == 2 ? rows[i - 1] : (i * 7919 + 13) % table->rows;
+  }
 
-    dense_db_table_get(table, i, accs[1], foo);
-    bar = dense_db_table_get_int(table, i, accs[0]);
-    baz = dense_db_table_get_int(table, i, accs[2]);
-    bop = dense_db_table_get_int(table, i, accs[3]);
-    bip = dense_db_table_get_int(table, i, accs[4]);
-    bip2= dense_db_table_get_int(table, i, accs[5]);
+  for (k = 0; k < 6; k++) {
+    dense_db_table_multi_get(table, acc, rows, counts[k], out);
 
-    printf("%d\t%s\t%d\t%d\t%d\t%d\n", bar, foo, baz, bop, bip, bip2);
+    for (i = 0; i < counts[k]; i++) {
+      assert(out[i] == dense_db_table_get_int(table, rows[i], acc));
+    }
   }
+
+  free(rows);
+  free(out);
+}
+
+#define WIDE_ROWS 5000
+#define WIDE_BYTES 38
+
+static void wide_value(uint64_t row, uint8_t * out)
+{
+  int k;
+  for (k = 0; k < WIDE_BYTES; k++) out[k] = row * 131 + k * 7;
+
+  // 300 bits
+  out[WIDE_BYTES - 1] &= 0xf;
 }
 
+// Compact a table with a field too wide for one byte to give its width,
+// between narrow ones, over several blocks
+void check_compact_wide(dense_db_t * db, char * name)
+{
+  dense_db_field_t fields[] = {
+    { "k", 5 },
+    { "blob", 300 },
+    { "t", 9 },
+  };
+
+  dense_db_table_t * table = dense_db_table_create(db, name, fields, 3, WIDE_ROWS, DENSE_DB_LAYOUT_ROW);
+
+  dense_db_accessor_t k = dense_db_table_get_accessor(table, "k");
+  dense_db_accessor_t blob = dense_db_table_get_accessor(table, "blob");
+  dense_db_accessor_t t = dense_db_table_get_accessor(table, "t");
+
+  uint8_t in[WIDE_BYTES], out[WIDE_BYTES];
+
+  int i;
+  for (i = 0; i < WIDE_ROWS; i++) {
+    wide_value(i, in);
+
+    dense_db_table_set_int(table, i, k, i % 32);
+    dense_db_table_set(table, i, blob, in);
+    dense_db_table_set_int(table, i, t, i / 10);
+  }
+
+  dense_db_table_compact(table);
+
+  for (i = 0; i < WIDE_ROWS; i++) {
+    wide_value(i, in);
+
+    memset(out, 0, sizeof(out));
+    dense_db_table_get(table, i, blob, out);
+
+    assert(memcmp(in, out, sizeof(in)) == 0);
+
+    assert(dense_db_table_get_int(table, i, k) == i % 32);
+    assert(dense_db_table_get_int(table, i, t) == i / 10);
+  }
+
+  // And whole rows, the wide field taking whole words
+  dense_db_row_codec_t * codec = dense_db_row_codec_new(table, NULL, 0);
+
+  uint64_t row[codec->n_words];
+
+  for (i = 0; i < WIDE_ROWS; i++) {
+    wide_value(i, in);
+
+    dense_db_table_get_row(table, codec, i, row);
+
+    assert(row[codec->slots[0]] == i % 32);
+    assert(memcmp((uint8_t *)(row + codec->slots[1]), in, sizeof(in)) == 0);
+    assert(row[codec->slots[2]] == i / 10);
+  }
+
+  dense_db_row_codec_destroy(codec);
+
+  dense_db_table_close(table);
+}
 
 int main (int argc, char ** argv)
 {
@@ -85,7 +1187,7 @@ int main (int argc, char ** argv)
     { "bip2", 2 },
   };
 
-  dense_db_table_t * table = dense_db_table_create(db, "foo", fields, 6, amount);
+  dense_db_table_t * table = dense_db_table_create(db, "foo", fields, 6, amount, DENSE_DB_LAYOUT_ROW);
 
   dense_db_table_close(table);
 
@@ -115,16 +1217,128 @@ int main (int argc, char ** argv)
 
   dense_table_sync(table);
 
+  // One pool for every query, and the calling thread alone
+  dense_db_pool_t * agg_pool = dense_db_pool_new(4);
+
+  for (i = 0; i < 6; i++) {
+    if (i != 1) check_column(table, accs[i]);
+    if (i != 1) check_aggregate(agg_pool, table, accs[i]);
+  }
+
+  dense_db_pool_destroy(agg_pool);
+
+  check_aggregate(NULL, table, accs[0]);
+
+  check_filter(table, accs[3], accs[4]);
+
+  // Again, skipping what the zone map rules out
+  dense_db_table_enable_zonemap(table);
+
+  check_filter(table, accs[3], accs[4]);
+
+  // And from bitmap indexes
+  dense_db_table_create_bitmap_index(table, "bop");
+  dense_db_table_create_bitmap_index(table, "bip");
+
+  check_filter(table, accs[3], accs[4]);
+
+  dense_db_table_create_hash_index(table, "bar");
+
+  check_lookup(table, accs[0]);
+
+  check_multi_get(table, accs[0]);
+  check_multi_get(table, accs[3]);
+
+  check_scan(table);
+
+  check_snapshot(table, accs[0]);
+  check_snapshot(table, accs[2]);
+
   pp_stats(table);
 
   pp(table);
 
-  dense_db_table_close(table);
+  dense_db_table_t * pax = dense_db_table_create(db, "foo2", fields, 6, amount, DENSE_DB_LAYOUT_PAX);
+
+  check_copy(table, pax);
+
+  check_multi_get(pax, dense_db_table_get_accessor(pax, "bar"));
+  check_multi_get(pax, dense_db_table_get_accessor(pax, "bop"));
+
+  check_scan(pax);
+
+  dense_db_table_create_bitmap_index(pax, "bop");
+  dense_db_table_create_hash_index(pax, "bop");
+
+  check_resize(pax, dense_db_table_get_accessor(pax, "bop"));
+
+  check_filter(pax, dense_db_table_get_accessor(pax, "bop"), dense_db_table_get_accessor(pax, "bip"));
+  check_lookup(pax, dense_db_table_get_accessor(pax, "bop"));
+
+  dense_db_table_close(pax);
+
+  dense_db_table_close(dense_db_table_create(db, "foo3", fields, 6, amount, DENSE_DB_LAYOUT_PAX));
+
+  dense_db_table_t * pooled = dense_db_table_open_pooled(db, "foo3");
+
+  check_copy(table, pooled);
+
+  check_multi_get(pooled, dense_db_table_get_accessor(pooled, "bar"));
+
+  check_snapshot(pooled, dense_db_table_get_accessor(pooled, "bop"));
+
+  check_resize(pooled, dense_db_table_get_accessor(pooled, "bop"));
+
+  dense_db_table_close(pooled);
+
+  // A new pool under the cached table, which has to follow it there
+  dense_db_set_buffer_pool(db, 1 << 20);
+  dense_db_sync(db);
 
-  table = dense_db_table_create(db, "foo2", fields, 6, amount);
+  pooled = dense_db_table_open_pooled(db, "foo3");
+
+  check_copy(table, pooled);
+
+  dense_db_table_close(pooled);
+
+  dense_db_table_t * compact = dense_db_table_create(db, "foo4", fields, 6, amount, DENSE_DB_LAYOUT_ROW);
+
+  check_compact(table, compact);
+
+  dense_db_table_close(compact);
+
+  check_compact_wide(db, "foo18");
+
+  check_load(table, "foo5", DENSE_DB_LAYOUT_ROW);
+  check_load(table, "foo6", DENSE_DB_LAYOUT_PAX);
+
+  check_baseline(db, "foo7");
 
   dense_db_table_close(table);
 
+  check_set_column(db, "foo9", DENSE_DB_LAYOUT_ROW);
+  check_set_column(db, "foo10", DENSE_DB_LAYOUT_PAX);
+
+  check_preds(db, "foo12");
+
+  // Scans over several PAX blocks, and more rows than the table above
+  dense_db_table_t * scanned = dense_db_table_open(db, "foo10");
+  check_scan(scanned);
+  dense_db_table_close(scanned);
+
+  scanned = dense_db_table_open(db, "foo12");
+  check_scan(scanned);
+  dense_db_table_close(scanned);
+
+  check_scan_unaligned(db, "foo19");
+
+  check_shared_words(db, "foo11");
+
+  char * lru_names[LRU_TABLES] = { "foo13", "foo14", "foo15", "foo16", "foo17" };
+  check_lru(lru_names);
+
+  check_wal("foo8");
+
   dense_db_destroy(db);
 
   return 0;